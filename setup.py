@@ -28,9 +28,19 @@ if cuda_home is None:
 module = cpp_extension.CppExtension(
     name = "torch_ucc",
     sources = ["torch_ucc.cpp",
+               "torch_ucc_dispatch.cpp",
+               "torch_ucc_record.cpp",
                "torch_ucc_sendrecv.cpp",
                "torch_ucx_alltoall.cpp",
+               "torch_ucx_allreduce.cpp",
                "torch_ucx_coll.cpp",
+               "torch_ucx_compress.cpp",
+               "torch_ucx_metrics.cpp",
+               "torch_ucx_reduce.cpp",
+               "torch_ucx_shm.cpp",
+               "torch_ucx_sparse.cpp",
+               "torch_ucx_trace.cpp",
+               "torch_ucx_tune.cpp",
                "torch_xccl.cpp"],
     include_dirs = ["{}/include/".format(ucx_home),
                     "{}/include/".format(ucc_home),
@@ -38,8 +48,8 @@ module = cpp_extension.CppExtension(
     library_dirs = ["{}/lib/".format(ucx_home),
                     "{}/lib/".format(ucc_home),
                     "{}/lib64/".format(cuda_home)],
-    libraries = ["ucp", "uct", "ucm", "ucs", "xccl", "cudart"],
-    extra_compile_args=['-g', '-O0']
+    libraries = ["ucp", "uct", "ucm", "ucs", "xccl", "cudart", "rt"],
+    extra_compile_args=['-g', '-O3']
 
 )
 
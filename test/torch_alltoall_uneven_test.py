@@ -0,0 +1,51 @@
+#
+# Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+#
+
+# Runs the node aggregated alltoall on uneven nodes emulated on one host:
+# the last rank is alone on its node, all others share one. Needs at least
+# 3 ranks.
+
+import torch
+import torch.distributed as dist
+import sys
+import os
+
+try:
+    comm_size = int(os.environ['OMPI_COMM_WORLD_SIZE'])
+    comm_rank = int(os.environ['OMPI_COMM_WORLD_RANK'])
+except:
+    print('OMPI env variables are not found')
+    sys.exit(1)
+
+if comm_size < 3:
+    print('Test needs at least 3 ranks')
+    sys.exit(1)
+
+os.environ['MASTER_PORT'] = '32167'
+os.environ['MASTER_ADDR'] = 'localhost'
+os.environ['RANK']        = str(comm_rank)
+os.environ['WORLD_SIZE']  = str(comm_size)
+os.environ['TORCH_UCC_UCX_TOPO_AWARE']           = '1'
+os.environ['TORCH_UCC_UCX_ALLTOALL_HIER_THRESH'] = str(2**30)
+os.environ['TORCH_UCC_HOST_ID'] = 'node1' if comm_rank == comm_size - 1 else 'node0'
+
+import torch_ucc
+
+dist.init_process_group('ucc', rank=comm_rank, world_size=comm_size)
+pg = dist.new_group(backend='mpi')
+
+counts = [comm_size]
+for i in range(12):
+    counts.append(counts[-1] * 2)
+for count in counts:
+    send_tensor = torch.randint(0, 100, (count,), dtype=torch.int)
+    recv_tensor_ucc = torch.zeros(count, dtype=torch.int)
+    recv_tensor_mpi = torch.zeros(count, dtype=torch.int)
+    dist.all_to_all_single(recv_tensor_ucc, send_tensor)
+    dist.all_to_all_single(recv_tensor_mpi, send_tensor, group=pg)
+    if not torch.all(torch.eq(recv_tensor_ucc, recv_tensor_mpi)):
+        print("Test failed: ", count)
+        sys.exit(1)
+
+print("Test succeeded ", counts)
@@ -0,0 +1,136 @@
+#
+# Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+#
+
+# Measures how much of an async collective is hidden behind compute. Each
+# iteration posts the collective, runs a CPU kernel calibrated to take as
+# long as the collective alone, then waits. Overlap is
+# (comm + comp - total) / min(comm, comp): 100% means the collective
+# progressed completely during the compute, 0% means it only progressed
+# in wait(). Every progress thread and backend setting gets its own ucc
+# group since the settings are read when a group is created.
+
+import argparse
+import torch
+import torch.distributed as dist
+import sys
+import os
+from time import perf_counter
+import torch_ucc
+
+parser = argparse.ArgumentParser(description="Process Group Overlap Benchmark")
+parser.add_argument("--coll", type=str, default='allreduce',
+                    choices=['allreduce', 'alltoall'])
+parser.add_argument("--min-size", type=int, default=2**10)
+parser.add_argument("--max-size", type=int, default=2**24)
+parser.add_argument("--skip", type=int, default=10)
+parser.add_argument("--iter", type=int, default=50)
+parser.add_argument("--threads", type=str, default='0,1',
+                    help="TORCH_UCC_THREAD_ENABLE values to compare")
+parser.add_argument("--backends", type=str, default='ucx,xccl')
+args = parser.parse_args()
+
+try:
+    comm_size = int(os.environ['OMPI_COMM_WORLD_SIZE'])
+    comm_rank = int(os.environ['OMPI_COMM_WORLD_RANK'])
+except:
+    try:
+        comm_size = int(os.environ['WORLD_SIZE'])
+        comm_rank = int(os.environ['RANK'])
+    except:
+        print('OMPI env variables are not found')
+        sys.exit(1)
+
+if not os.environ.get('MASTER_PORT', None):
+    os.environ['MASTER_PORT'] = '32167'
+if not os.environ.get('MASTER_ADDR', None):
+    os.environ['MASTER_ADDR'] = 'localhost'
+if not os.environ.get('RANK', None):
+    os.environ['RANK'] = str(comm_rank)
+if not os.environ.get('WORLD_SIZE', None):
+    os.environ['WORLD_SIZE'] = str(comm_size)
+
+dist.init_process_group('ucc', rank=comm_rank, world_size=comm_size)
+
+def post(group, send, recv):
+    if args.coll == 'allreduce':
+        return dist.all_reduce(send, op=dist.ReduceOp.SUM, group=group,
+                               async_op=True)
+    return dist.all_to_all_single(recv, send, group=group, async_op=True)
+
+# fixed small matmuls so the kernel stays in cache and scales linearly
+mat = torch.rand([64, 64])
+def compute(reps):
+    acc = mat
+    for _ in range(reps):
+        acc = torch.mm(acc, mat).clamp_(-1.0, 1.0)
+    return acc
+
+def time_compute(reps):
+    start = perf_counter()
+    compute(reps)
+    return perf_counter() - start
+
+def max_over_ranks(val):
+    t = torch.tensor([val])
+    dist.all_reduce(t, op=dist.ReduceOp.MAX)
+    return t[0].item()
+
+def bench(group, size):
+    send = torch.ones([size // 4], dtype=torch.float32)
+    recv = torch.zeros([size // 4], dtype=torch.float32)
+    comm = 0
+    for i in range(args.iter + args.skip):
+        start = perf_counter()
+        post(group, send, recv).wait()
+        if i >= args.skip:
+            comm += perf_counter() - start
+    comm = max_over_ranks(comm / args.iter)
+
+    # all ranks use the same repetition count to keep them in step
+    unit = max_over_ranks(time_compute(100) / 100)
+    reps = max(int(comm / unit), 1)
+    comp  = 0
+    total = 0
+    for i in range(args.iter + args.skip):
+        dist.barrier()
+        start = perf_counter()
+        compute(reps)
+        mid = perf_counter()
+        dist.barrier()
+        req = post(group, send, recv)
+        post_done = perf_counter()
+        compute(reps)
+        req.wait()
+        finish = perf_counter()
+        if i >= args.skip:
+            comp  += mid - start
+            total += finish - post_done
+    comp  = max_over_ranks(comp / args.iter)
+    total = max_over_ranks(total / args.iter)
+    overlap = (comm + comp - total) / min(comm, comp)
+    return comm, comp, total, min(max(overlap, 0.0), 1.0)
+
+if comm_rank == 0:
+    print("World size {}, {}".format(comm_size, args.coll))
+    print("%-8s %-8s %-10s %-10s %-10s %-10s %-8s" %
+          ('backend', 'thread', 'size', 'comm, us', 'comp, us', 'total, us',
+           'overlap'))
+
+for backend in args.backends.split(','):
+    for thread in args.threads.split(','):
+        os.environ['TORCH_UCC_THREAD_ENABLE'] = thread
+        os.environ['TORCH_UCC_UCX_ENABLE']    = '1' if backend == 'ucx' else '0'
+        os.environ['TORCH_UCC_XCCL_ENABLE']   = '1' if backend == 'xccl' else '0'
+        group = dist.new_group(backend='ucc')
+        size = args.min_size
+        while size <= args.max_size:
+            if (args.coll == 'alltoall') and (size // 4 % comm_size != 0):
+                size = size * 2
+                continue
+            comm, comp, total, overlap = bench(group, size)
+            if comm_rank == 0:
+                print("%-8s %-8s %-10i %-10.1f %-10.1f %-10.1f %-8.1f" %
+                      (backend, thread, size, comm * 10**6, comp * 10**6,
+                       total * 10**6, overlap * 100))
+            size = size * 2
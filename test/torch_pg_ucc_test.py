@@ -28,6 +28,19 @@ os.environ['RANK']        = str(rank)
 os.environ['WORLD_SIZE']  = str(size)
 
 
+if args.op == "fusion_poll":
+    os.environ['TORCH_UCC_FUSION_BYTES'] = str(2**20)
+if args.op == "reverse_wait":
+    os.environ['TORCH_UCC_THREAD_ENABLE']  = '0'
+    os.environ['TORCH_UCC_UCX_TOPO_AWARE'] = '1'
+    os.environ['TORCH_UCC_UCX_SHM']        = '1'
+if args.op == "compress_inf":
+    # every rank is its own node so all exchanges are leader exchanges
+    os.environ['TORCH_UCC_UCX_TOPO_AWARE']   = '1'
+    os.environ['TORCH_UCC_HOST_ID']          = 'node' + str(rank)
+    os.environ['TORCH_UCC_UCX_COMPRESS']     = 'int8'
+    os.environ['TORCH_UCC_UCX_COMPRESS_MIN'] = '0'
+
 torch.cuda.set_device(rank)
 print("World size {}, rank {}".format(size, rank))
 dist.init_process_group(args.backend, rank=rank, world_size=size)
@@ -48,6 +61,30 @@ if args.op == "p2p":
         dist.send(t, 1)
     else:
         dist.recv(t, 0)
+elif args.op == "p2p_anysource":
+    if rank == 0:
+        for _ in range(size - 1):
+            src = dist.recv(t1)
+            print("rank 0 got", t1, "from", src)
+    else:
+        dist.send(t, 0)
+elif args.op == "p2p_eager_mismatch":
+    # a send under the eager size into a larger receive buffer
+    if rank == 0:
+        dist.send(t, 1)
+    elif rank == 1:
+        t2 = torch.zeros([4096])
+        dist.recv(t2, 0)
+        if not torch.all(t2[:size] == 1):
+            print("Test failed")
+            sys.exit(1)
+elif args.op == "batch_p2p":
+    # ring exchange with both directions in one batch
+    pg = dist.distributed_c10d._get_default_group()
+    torch_ucc.batch_isend_irecv(pg, [t, t1], [(rank + 1) % size,
+                                              (rank - 1 + size) % size],
+                                [True, False]).wait()
+    print("rank", rank, "got", t1)
 elif args.op == "broadcast":
     dist.broadcast(t, 0)
 elif args.op == "allreduce":
@@ -62,7 +99,84 @@ elif args.op == "alltoallv":
     dist.all_to_all_single(t2, t, out_split, in_split)
 elif args.op == "allgather":
     dist.all_gather([t1, t2], t)
-
+elif args.op == "fusion_poll":
+    # only rank 0 polls between the two allreduces, both still have to be
+    # fused the same way on all ranks
+    t2 += rank + 1
+    w1 = dist.all_reduce(t, op=dist.ReduceOp.SUM, async_op=True)
+    if rank == 0:
+        for _ in range(100):
+            w1.is_completed()
+    w2 = dist.all_reduce(t2, op=dist.ReduceOp.SUM, async_op=True)
+    w1.wait()
+    w2.wait()
+    expected = size * (size + 1) / 2
+    if not (torch.all(t == expected) and torch.all(t2 == expected)):
+        print("Test failed")
+        sys.exit(1)
+elif args.op == "reverse_wait":
+    # without the progress thread the second allreduce can only finish if
+    # waiting on it progresses the first one
+    t2 += rank + 1
+    w1 = dist.all_reduce(t, op=dist.ReduceOp.SUM, async_op=True)
+    w2 = dist.all_reduce(t2, op=dist.ReduceOp.SUM, async_op=True)
+    w2.wait()
+    w1.wait()
+    expected = size * (size + 1) / 2
+    if not (torch.all(t == expected) and torch.all(t2 == expected)):
+        print("Test failed")
+        sys.exit(1)
+elif args.op == "sparse_allreduce":
+    i = torch.tensor([[rank, size]])
+    v = torch.tensor([float(rank + 1), 1.0])
+    t = torch.sparse_coo_tensor(i, v, [size + 1])
+    dist.all_reduce(t, op=dist.ReduceOp.SUM)
+    t = t.to_dense()
+elif args.op == "metrics":
+    pg = dist.distributed_c10d._get_default_group()
+    torch_ucc.reset_metrics(pg)
+    dist.all_reduce(t)
+    dist.reduce(t1, 0)
+    dist.barrier()
+    if rank == 0:
+        dist.send(t2, 1)
+    elif rank == 1:
+        dist.recv(t2, 0)
+    colls = torch_ucc.get_metrics(pg)["collectives"]
+    nbytes = t.numel() * t.element_size()
+    expected = {"allreduce": 1, "reduce": 1, "barrier": 1,
+                "send": 1 if rank == 0 else 0,
+                "recv": 1 if rank == 1 else 0}
+    for name, ops in expected.items():
+        if (colls[name]["ops"] != ops) or \
+           (name != "barrier" and colls[name]["bytes"] != ops * nbytes):
+            print("Test failed: {} counted {}".format(name, colls[name]))
+            sys.exit(1)
+elif args.op == "scaled_allreduce":
+    # cuda tensors go through xccl, host ones through ucx
+    pg = dist.distributed_c10d._get_default_group()
+    torch_ucc.set_reduce_scaling(pg, 0.5, True)
+    dist.all_reduce(t, op=dist.ReduceOp.SUM)
+    torch_ucc.set_reduce_scaling(pg, 1.0, False)
+    expected = 0.5 * (size + 1) / 2
+    if not torch.allclose(t, torch.full_like(t, expected)):
+        print("Test failed")
+        sys.exit(1)
+elif args.op == "compress_inf":
+    t2 = torch.ones([1024]) * (rank + 1)
+    if rank == 0:
+        t2[5] = float("inf")
+        t2[700] = float("nan")
+    dist.all_reduce(t2, op=dist.ReduceOp.SUM)
+    expected = size * (size + 1) / 2
+    finite = torch.isfinite(t2)
+    if (t2[5] != float("inf")) or not torch.isnan(t2[700]) or \
+       (finite.sum() != 1022) or \
+       not torch.allclose(t2[finite], torch.full([1022], float(expected)),
+                          rtol=0.05):
+        print("Test failed")
+        sys.exit(1)
+    t2 = t2[:size]
 else:
     print("Incorrect operation")
     sys.exit(1)
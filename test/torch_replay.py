@@ -0,0 +1,154 @@
+#
+# Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+#
+
+# Replays a call sequence recorded with TORCH_UCC_RECORD=<file, %d is the
+# rank> using dummy tensors. Every rank reads its own file, so the job has
+# to be launched with the recorded world size. Calls are waited on in
+# order with up to --window outstanding, --keep-gaps also reproduces the
+# recorded time between posts. Sparse allreduces are skipped.
+
+import argparse
+import torch
+import torch.distributed as dist
+import sys
+import os
+from time import perf_counter, sleep
+import torch_ucc
+
+parser = argparse.ArgumentParser(description="Process Group Call Replay")
+parser.add_argument("--backend", type=str, default='ucc')
+parser.add_argument("--file", type=str, required=True,
+                    help="recorded file, %%d is replaced by the rank")
+parser.add_argument("--window", type=int, default=1)
+parser.add_argument("--iter", type=int, default=1)
+parser.add_argument("--keep-gaps", default=False, action='store_true')
+args = parser.parse_args()
+
+try:
+    comm_size = int(os.environ['OMPI_COMM_WORLD_SIZE'])
+    comm_rank = int(os.environ['OMPI_COMM_WORLD_RANK'])
+except:
+    try:
+        comm_size = int(os.environ['WORLD_SIZE'])
+        comm_rank = int(os.environ['RANK'])
+    except:
+        print('OMPI env variables are not found')
+        sys.exit(1)
+
+if not os.environ.get('MASTER_PORT', None):
+    os.environ['MASTER_PORT'] = '32167'
+if not os.environ.get('MASTER_ADDR', None):
+    os.environ['MASTER_ADDR'] = 'localhost'
+if not os.environ.get('RANK', None):
+    os.environ['RANK'] = str(comm_rank)
+if not os.environ.get('WORLD_SIZE', None):
+    os.environ['WORLD_SIZE'] = str(comm_size)
+
+ops = {
+    'sum':     dist.ReduceOp.SUM,
+    'product': dist.ReduceOp.PRODUCT,
+    'min':     dist.ReduceOp.MIN,
+    'max':     dist.ReduceOp.MAX,
+    'band':    dist.ReduceOp.BAND,
+    'bor':     dist.ReduceOp.BOR,
+    'bxor':    dist.ReduceOp.BXOR,
+}
+
+def parse_splits(field):
+    return [] if field == '-' else [int(s) for s in field.split(',')]
+
+def load(path):
+    calls = []
+    with open(path) as f:
+        for line in f:
+            if line.startswith('#') or not line.strip():
+                continue
+            ts, coll, dtype, numel, row, op, peer, tag, ins, outs = line.split()
+            calls.append({
+                'ts':    int(ts) * 1e-6,
+                'coll':  coll,
+                'dtype': None if dtype == '-' else getattr(torch, dtype),
+                'numel': int(numel),
+                'row':   int(row),
+                'op':    ops.get(op, dist.ReduceOp.SUM),
+                'peer':  int(peer),
+                'tag':   int(tag),
+                'in':    parse_splits(ins),
+                'out':   parse_splits(outs),
+            })
+    return calls
+
+# tensors are allocated upfront so that only communication is timed
+def prepare(call):
+    if call['dtype'] is None:
+        return
+    call['input'] = torch.ones([call['numel']], dtype=call['dtype'])
+    if call['coll'] == 'alltoall':
+        out = sum(call['out']) * call['row'] if call['out'] else call['numel']
+        call['output'] = torch.zeros([out], dtype=call['dtype'])
+        call['in']  = [s * call['row'] for s in call['in']]
+        call['out'] = [s * call['row'] for s in call['out']]
+
+def issue(call):
+    coll = call['coll']
+    if coll == 'allreduce':
+        return dist.all_reduce(call['input'], op=call['op'], async_op=True)
+    if coll == 'reduce':
+        return dist.reduce(call['input'], call['peer'], op=call['op'],
+                           async_op=True)
+    if coll == 'alltoall':
+        return dist.all_to_all_single(call['output'], call['input'],
+                                      call['out'] or None, call['in'] or None,
+                                      async_op=True)
+    if coll == 'barrier':
+        return dist.barrier(async_op=True)
+    if coll == 'send':
+        return dist.isend(call['input'], call['peer'], tag=call['tag'])
+    if coll == 'recv':
+        src = call['peer'] if call['peer'] >= 0 else None
+        return dist.irecv(call['input'], src, tag=call['tag'])
+    return None
+
+dist.init_process_group(args.backend, rank=comm_rank, world_size=comm_size)
+
+calls = load(args.file.replace('%d', str(comm_rank)))
+calls = [c for c in calls if c['coll'] != 'sparse_allreduce']
+for call in calls:
+    prepare(call)
+
+times = {}
+total = 0
+for it in range(args.iter):
+    dist.barrier()
+    pending = []
+    start = perf_counter()
+    for call in calls:
+        if args.keep_gaps:
+            gap = call['ts'] - calls[0]['ts'] - (perf_counter() - start)
+            if gap > 0:
+                sleep(gap)
+        post = perf_counter()
+        req = issue(call)
+        if req is not None:
+            pending.append((call, post, req))
+        while len(pending) >= args.window:
+            c, p, r = pending.pop(0)
+            r.wait()
+            times[c['coll']] = times.get(c['coll'], 0) + perf_counter() - p
+    for c, p, r in pending:
+        r.wait()
+        times[c['coll']] = times.get(c['coll'], 0) + perf_counter() - p
+    total += perf_counter() - start
+
+stats = torch.tensor([total] + [times.get(c, 0) for c in
+                                ['allreduce', 'reduce', 'alltoall', 'barrier',
+                                 'send', 'recv']], dtype=torch.float64)
+dist.all_reduce(stats, op=dist.ReduceOp.MAX)
+if comm_rank == 0:
+    print("World size {}, {} calls, {} iterations".format(comm_size, len(calls),
+                                                          args.iter))
+    print("%-10s %-12s" % ('coll', 'time, ms'))
+    for name, val in zip(['total', 'allreduce', 'reduce', 'alltoall',
+                          'barrier', 'send', 'recv'], stats.tolist()):
+        print("%-10s %-12.3f" % (name, val * 1e3 / args.iter))
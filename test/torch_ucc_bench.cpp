@@ -0,0 +1,505 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+/* Standalone benchmark of the native UCX collectives and p2p. It forks
+ * --ranks local processes that meet through a FileStore, so it runs on a
+ * single CPU-only box without MPI or Python. UCX_TLS defaults to shm,tcp.
+ * Results of rank 0 are printed as JSON, one object per op, algorithm and
+ * size. Iteration latency is the slowest rank's, there are no barriers
+ * between iterations.
+ *
+ * Build from the repo root:
+ *   g++ -O2 -std=c++14 -I. -I$TORCH/include \
+ *       -I$TORCH/include/torch/csrc/api/include -I$UCX_HOME/include \
+ *       -I$CUDA_HOME/include test/torch_ucc_bench.cpp torch_ucc_sendrecv.cpp \
+ *       torch_ucx_alltoall.cpp torch_ucx_allreduce.cpp torch_ucx_coll.cpp \
+ *       torch_ucx_compress.cpp torch_ucx_metrics.cpp torch_ucx_reduce.cpp \
+ *       torch_ucx_shm.cpp torch_ucx_sparse.cpp torch_ucx_trace.cpp \
+ *       torch_ucx_tune.cpp -L$TORCH/lib -L$UCX_HOME/lib -L$CUDA_HOME/lib64 \
+ *       -ltorch -lc10 -lucp -luct -lucs -lcudart -lrt -lpthread \
+ *       -o torch_ucc_bench
+ *
+ * Usage:
+ *   torch_ucc_bench [--ranks 4] [--ops allreduce,alltoall,...]
+ *                   [--algos default,...] [--min-size 8] [--max-size 64M]
+ *                   [--iters 100] [--warmup 10] [--out result.json]
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <c10d/FileStore.hpp>
+
+#include "torch_ucc_sendrecv.hpp"
+#include "torch_ucx_coll.hpp"
+#include "torch_ucx_compress.hpp"
+#include "torch_ucx_sparse.hpp"
+
+using namespace c10d;
+
+struct bench_args_t {
+    int                      ranks;
+    std::vector<std::string> ops;
+    std::vector<std::string> algos;
+    size_t                   min_size;
+    size_t                   max_size;
+    int                      iters;
+    int                      warmup;
+    double                   density;
+    std::string              out;
+};
+
+struct bench_ctx_t {
+    bench_args_t          *args;
+    torch_ucx_comm_t      *comm;
+    torch_ucx_coll_comm_t *coll;
+    std::vector<char>     sbuf;
+    std::vector<char>     rbuf;
+    uint32_t              p2p_tag;
+};
+
+static size_t parse_size(const char *str)
+{
+    char   *end;
+    size_t val = std::strtoull(str, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K': return val << 10;
+    case 'm': case 'M': return val << 20;
+    case 'g': case 'G': return val << 30;
+    default:            return val;
+    }
+}
+
+static std::vector<std::string> parse_list(const char *str)
+{
+    std::vector<std::string> list;
+    std::istringstream       in(str);
+    std::string              item;
+
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) {
+            list.push_back(item);
+        }
+    }
+    return list;
+}
+
+static void parse_args(int argc, char **argv, bench_args_t *args)
+{
+    args->ranks    = 2;
+    args->ops      = {"allreduce", "alltoall", "sparse", "sendrecv", "pingpong"};
+    args->algos    = {"default"};
+    args->min_size = 8;
+    args->max_size = 64 << 20;
+    args->iters    = 100;
+    args->warmup   = 10;
+    args->density  = 0.01;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string opt = argv[i];
+        const char  *val = argv[i + 1];
+
+        if (opt == "--ranks") {
+            args->ranks = std::max(std::atoi(val), 2);
+        } else if (opt == "--ops") {
+            args->ops = parse_list(val);
+        } else if (opt == "--algos") {
+            args->algos = parse_list(val);
+        } else if (opt == "--min-size") {
+            args->min_size = std::max(parse_size(val), (size_t)1);
+        } else if (opt == "--max-size") {
+            args->max_size = parse_size(val);
+        } else if (opt == "--iters") {
+            args->iters = std::max(std::atoi(val), 1);
+        } else if (opt == "--warmup") {
+            args->warmup = std::max(std::atoi(val), 0);
+        } else if (opt == "--density") {
+            args->density = std::atof(val);
+        } else if (opt == "--out") {
+            args->out = val;
+        } else {
+            fprintf(stderr, "unknown option %s\n", opt.c_str());
+            exit(1);
+        }
+    }
+}
+
+static void coll_run(torch_ucx_coll_request_t *request)
+{
+    while (torch_ucx_coll_test(request) == TORCH_UCX_INPROGRESS) {}
+}
+
+static void wait_reqs(torch_ucx_comm_t *comm, torch_ucx_request_t **reqs, int n)
+{
+    while (torch_ucx_req_test(comm, reqs, n, NULL, 1, n) == TORCH_UCX_INPROGRESS) {}
+}
+
+/* Algorithm presets on top of the comm defaults, names that don't apply
+ * to a collective are skipped for it */
+static bool apply_algo(const std::string &algo, torch_ucx_coll_type_t coll,
+                       torch_ucx_coll_config_t *config)
+{
+    if (algo == "default") {
+        return true;
+    }
+    if (algo == "flat") {
+        config->topo_aware = false;
+        return true;
+    }
+    if (coll == TORCH_UCX_COLL_ALLREDUCE) {
+        if (algo == "ring") {
+            config->ring_thresh = 1;
+        } else if (algo == "rd") {
+            config->ring_thresh = 0;
+        } else if ((algo == "bf16") || (algo == "fp16") || (algo == "int8")) {
+            config->compress     = torch_ucx_compress_parse(algo.c_str());
+            config->compress_min = 0;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (algo == "pairwise") {
+        config->chunk = 1;
+    } else if (algo == "linear") {
+        config->chunk = 0;
+    } else if (algo == "auto") {
+        config->chunk = TORCH_UCX_CHUNK_AUTO;
+    } else if (algo == "reverse") {
+        config->reverse = true;
+    } else if (algo == "hier") {
+        config->alltoall_hier_thresh = SIZE_MAX;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool bench_allreduce(bench_ctx_t *ctx, const std::string &algo,
+                            size_t size)
+{
+    torch_ucx_coll_request_t request;
+
+    if (size < sizeof(float)) {
+        return false;
+    }
+    torch_ucx_coll_get_config(ctx->coll, TORCH_UCX_COLL_ALLREDUCE, size,
+                              &request.config);
+    if (!apply_algo(algo, TORCH_UCX_COLL_ALLREDUCE, &request.config)) {
+        return false;
+    }
+    request.src_buf_mtype = TORCH_UCX_HOST;
+    request.dst_buf_mtype = TORCH_UCX_HOST;
+    request.src_buffer    = ctx->sbuf.data();
+    request.dst_buffer    = ctx->sbuf.data();
+    request.len           = size / sizeof(float) * sizeof(float);
+    request.count         = size / sizeof(float);
+    request.dtype         = TORCH_UCX_DT_FLOAT32;
+    request.op            = TORCH_UCX_OP_SUM;
+    request.pre_scale     = 1.0;
+    request.post_scale    = 1.0;
+    torch_ucx_allreduce_start(ctx->coll, &request);
+    coll_run(&request);
+    return true;
+}
+
+/* size is the total per rank, split in equal blocks */
+static bool bench_alltoall(bench_ctx_t *ctx, const std::string &algo,
+                           size_t size)
+{
+    torch_ucx_coll_request_t request;
+    size_t                   block = size / ctx->comm->size;
+
+    if (block == 0) {
+        return false;
+    }
+    torch_ucx_coll_get_config(ctx->coll, TORCH_UCX_COLL_ALLTOALL, block,
+                              &request.config);
+    if (!apply_algo(algo, TORCH_UCX_COLL_ALLTOALL, &request.config)) {
+        return false;
+    }
+    request.src_buf_mtype = TORCH_UCX_HOST;
+    request.dst_buf_mtype = TORCH_UCX_HOST;
+    request.src_buffer    = ctx->sbuf.data();
+    request.dst_buffer    = ctx->rbuf.data();
+    request.len           = block;
+    request.dtype         = TORCH_UCX_DT_UINT8;
+    torch_ucx_alltoall_start(ctx->coll, &request);
+    coll_run(&request);
+    return true;
+}
+
+/* allgather of a 1-d sparse tensor of size bytes of fp32 values */
+static bool bench_sparse(bench_ctx_t *ctx, const std::string &algo, size_t size)
+{
+    torch_ucx_coll_request_t request;
+    torch_ucx_sparse_t       sp;
+    int64_t                  rows = size / sizeof(float);
+    int64_t                  nnz  = std::max((int64_t)(rows * ctx->args->density),
+                                             (int64_t)1);
+    std::vector<int64_t>     indices(nnz);
+
+    if ((algo != "default") || (rows == 0)) {
+        return false;
+    }
+    for (int64_t i = 0; i < nnz; i++) {
+        indices[i] = (i * rows / nnz + ctx->comm->rank) % rows;
+    }
+    sp.indices      = indices.data();
+    sp.values       = ctx->sbuf.data();
+    sp.nnz          = nnz;
+    sp.sparse_dim   = 1;
+    sp.sizes        = {rows};
+    sp.row_len      = 1;
+    sp.dtype        = TORCH_UCX_DT_FLOAT32;
+    sp.dense_thresh = 0;
+
+    request.config        = ctx->coll->config;
+    request.src_buf_mtype = TORCH_UCX_HOST;
+    request.dst_buf_mtype = TORCH_UCX_HOST;
+    request.sparse        = &sp;
+    torch_ucx_sparse_start(ctx->coll, &request);
+    coll_run(&request);
+    return true;
+}
+
+/* ranks exchange with their pair partner, the last one idles when odd */
+static bool bench_sendrecv(bench_ctx_t *ctx, const std::string &algo,
+                           size_t size)
+{
+    torch_ucx_request_t *reqs[2] = {NULL, NULL};
+    int                 peer     = ctx->comm->rank ^ 1;
+
+    if (algo != "default") {
+        return false;
+    }
+    if (peer >= ctx->comm->size) {
+        return true;
+    }
+    torch_ucx_recv_nb(ctx->comm, ctx->rbuf.data(), size, peer, ctx->p2p_tag,
+                      &reqs[0], TORCH_UCX_P2P_TAG);
+    torch_ucx_send_nb(ctx->comm, ctx->sbuf.data(), size, peer, ctx->p2p_tag,
+                      &reqs[1], TORCH_UCX_P2P_TAG);
+    wait_reqs(ctx->comm, reqs, 2);
+    return true;
+}
+
+/* even ranks send first, the reported latency is the round trip */
+static bool bench_pingpong(bench_ctx_t *ctx, const std::string &algo,
+                           size_t size)
+{
+    torch_ucx_request_t *req = NULL;
+    int                 rank = ctx->comm->rank;
+    int                 peer = rank ^ 1;
+
+    if (algo != "default") {
+        return false;
+    }
+    if (peer >= ctx->comm->size) {
+        return true;
+    }
+    for (int turn = 0; turn < 2; turn++) {
+        if ((rank & 1) == turn) {
+            torch_ucx_send_nb(ctx->comm, ctx->sbuf.data(), size, peer,
+                              ctx->p2p_tag, &req, TORCH_UCX_P2P_TAG);
+        } else {
+            torch_ucx_recv_nb(ctx->comm, ctx->rbuf.data(), size, peer,
+                              ctx->p2p_tag, &req, TORCH_UCX_P2P_TAG);
+        }
+        wait_reqs(ctx->comm, &req, 1);
+    }
+    return true;
+}
+
+/* bytes each rank moves per op relative to size, as in nccl-tests */
+static double bus_factor(const std::string &op, int n)
+{
+    if (op == "allreduce") {
+        return 2.0 * (n - 1) / n;
+    }
+    if ((op == "alltoall") || (op == "sparse")) {
+        return (double)(n - 1) / n;
+    }
+    return 1.0;
+}
+
+static void max_over_ranks(bench_ctx_t *ctx, std::vector<double> *times)
+{
+    torch_ucx_coll_request_t request;
+
+    request.config        = ctx->coll->config;
+    request.src_buf_mtype = TORCH_UCX_HOST;
+    request.dst_buf_mtype = TORCH_UCX_HOST;
+    request.src_buffer    = times->data();
+    request.dst_buffer    = times->data();
+    request.len           = times->size() * sizeof(double);
+    request.count         = times->size();
+    request.dtype         = TORCH_UCX_DT_FLOAT64;
+    request.op            = TORCH_UCX_OP_MAX;
+    request.pre_scale     = 1.0;
+    request.post_scale    = 1.0;
+    torch_ucx_allreduce_start(ctx->coll, &request);
+    coll_run(&request);
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t idx = std::min((size_t)(p * sorted.size()), sorted.size() - 1);
+
+    return sorted[idx];
+}
+
+static int run_rank(bench_args_t *args, const std::string &store_path,
+                    int rank)
+{
+    auto        store = std::make_shared<FileStore>(store_path, args->ranks);
+    bench_ctx_t ctx;
+    std::string json  = "[";
+    const char  *sep  = "\n";
+    int         n     = args->ranks;
+
+    /* one benchmarked call, returns false if the algo does not apply */
+    typedef bool (*bench_op_t)(bench_ctx_t*, const std::string&, size_t);
+    const std::vector<std::pair<std::string, bench_op_t>> all_ops = {
+        {"allreduce", bench_allreduce},
+        {"alltoall",  bench_alltoall},
+        {"sparse",    bench_sparse},
+        {"sendrecv",  bench_sendrecv},
+        {"pingpong",  bench_pingpong}
+    };
+
+    ctx.args    = args;
+    ctx.p2p_tag = 1;
+    if ((torch_ucx_comm_init(&ctx.comm, n, rank, store) != TORCH_UCX_OK) ||
+        (torch_ucx_coll_comm_init(ctx.comm, store, &ctx.coll) != TORCH_UCX_OK)) {
+        fprintf(stderr, "rank %d: failed to init ucx\n", rank);
+        return 1;
+    }
+    ctx.sbuf.assign(std::max(args->max_size, sizeof(double)), 1);
+    ctx.rbuf.assign(std::max(args->max_size, sizeof(double)), 0);
+
+    for (auto &op: all_ops) {
+        if (std::find(args->ops.begin(), args->ops.end(), op.first) ==
+            args->ops.end()) {
+            continue;
+        }
+        for (auto &algo: args->algos) {
+            for (size_t size = args->min_size; size <= args->max_size;
+                 size *= 2) {
+                std::vector<double> times(args->iters);
+                bool                ok = true;
+
+                for (int it = -args->warmup; (it < args->iters) && ok; it++) {
+                    auto start = std::chrono::steady_clock::now();
+
+                    ok = op.second(&ctx, algo, size);
+                    if (it >= 0) {
+                        times[it] = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start).count();
+                    }
+                }
+                /* applicability only depends on arguments, all ranks agree */
+                if (!ok) {
+                    continue;
+                }
+                max_over_ranks(&ctx, &times);
+                if (rank != 0) {
+                    continue;
+                }
+                std::sort(times.begin(), times.end());
+                double avg = 0;
+                for (auto t: times) {
+                    avg += t;
+                }
+                avg /= times.size();
+                double algbw = size / avg / 1e9;
+                char   line[512];
+
+                snprintf(line, sizeof(line),
+                         "%s  {\"op\": \"%s\", \"algo\": \"%s\", \"ranks\": %d, "
+                         "\"size\": %zu, \"avg_us\": %.2f, \"p50_us\": %.2f, "
+                         "\"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, "
+                         "\"algbw_gbs\": %.3f, \"busbw_gbs\": %.3f, "
+                         "\"msg_rate\": %.1f}",
+                         sep, op.first.c_str(), algo.c_str(), n, size,
+                         avg * 1e6, percentile(times, 0.5) * 1e6,
+                         percentile(times, 0.9) * 1e6,
+                         percentile(times, 0.99) * 1e6, times.back() * 1e6,
+                         algbw, algbw * bus_factor(op.first, n), 1.0 / avg);
+                json += line;
+                sep   = ",\n";
+            }
+        }
+    }
+    json += "\n]\n";
+
+    if (rank == 0) {
+        if (args->out.empty()) {
+            fputs(json.c_str(), stdout);
+        } else {
+            FILE *f = fopen(args->out.c_str(), "w");
+
+            if (f == NULL) {
+                fprintf(stderr, "failed to open %s\n", args->out.c_str());
+                return 1;
+            }
+            fputs(json.c_str(), f);
+            fclose(f);
+        }
+    }
+    torch_ucx_coll_comm_close(ctx.coll);
+    torch_ucx_comm_close(ctx.comm, store);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bench_args_t       args;
+    std::vector<pid_t> pids;
+    char               store_path[] = "/tmp/torch_ucc_bench_XXXXXX";
+    int                fd, status, rc = 0;
+
+    parse_args(argc, argv, &args);
+    setenv("UCX_TLS", "shm,tcp", 0);
+    fd = mkstemp(store_path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    for (int rank = 0; rank < args.ranks; rank++) {
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            exit(run_rank(&args, store_path, rank));
+        }
+        if (pid < 0) {
+            perror("fork");
+            rc = 1;
+            break;
+        }
+        pids.push_back(pid);
+    }
+    for (auto pid: pids) {
+        if ((waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) ||
+            (WEXITSTATUS(status) != 0)) {
+            rc = 1;
+        }
+    }
+    unlink(store_path);
+    return rc;
+}
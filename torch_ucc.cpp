@@ -8,7 +8,13 @@
 #include "torch_ucc.hpp"
 #include "torch_ucc_sendrecv.hpp"
 #include "torch_ucx_coll.hpp"
+#include "torch_ucx_reduce.hpp"
+#include "torch_ucx_trace.hpp"
+#include "torch_ucx_tune.hpp"
 #include "torch_xccl.hpp"
+#include <ATen/record_function.h>
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <iostream>
 #include <stdio.h>
@@ -20,6 +26,44 @@ std::map<ReduceOp, xccl_op_t> xccl_op_map = {
     {ReduceOp::MAX,     XCCL_OP_MAX},
     {ReduceOp::SUM,     XCCL_OP_SUM},
     {ReduceOp::PRODUCT, XCCL_OP_PROD},
+    {ReduceOp::BAND,    XCCL_OP_BAND},
+    {ReduceOp::BOR,     XCCL_OP_BOR},
+    {ReduceOp::BXOR,    XCCL_OP_BXOR},
+};
+
+std::map<ReduceOp, torch_ucx_reduce_op_t> ucx_op_map = {
+    {ReduceOp::MIN,     TORCH_UCX_OP_MIN},
+    {ReduceOp::MAX,     TORCH_UCX_OP_MAX},
+    {ReduceOp::SUM,     TORCH_UCX_OP_SUM},
+    {ReduceOp::PRODUCT, TORCH_UCX_OP_PROD},
+    {ReduceOp::BAND,    TORCH_UCX_OP_BAND},
+    {ReduceOp::BOR,     TORCH_UCX_OP_BOR},
+    {ReduceOp::BXOR,    TORCH_UCX_OP_BXOR},
+};
+
+static xccl_op_t get_xccl_op(ReduceOp op)
+{
+    auto it = xccl_op_map.find(op);
+
+    if (it == xccl_op_map.end()) {
+        throw std::runtime_error("ProcessGroupUCC: unsupported reduce op for xccl");
+    }
+    return it->second;
+}
+
+std::map<at::ScalarType, torch_ucx_dtype_t> ucx_type_map = {
+    {at::kByte,          TORCH_UCX_DT_UINT8},
+    {at::kChar,          TORCH_UCX_DT_INT8},
+    {at::kShort,         TORCH_UCX_DT_INT16},
+    {at::kHalf,          TORCH_UCX_DT_FLOAT16},
+    {at::kBFloat16,      TORCH_UCX_DT_BFLOAT16},
+    {at::kDouble,        TORCH_UCX_DT_FLOAT64},
+    {at::kFloat,         TORCH_UCX_DT_FLOAT32},
+    {at::kInt,           TORCH_UCX_DT_INT32},
+    {at::kLong,          TORCH_UCX_DT_INT64},
+    {at::kBool,          TORCH_UCX_DT_BOOL},
+    {at::kComplexFloat,  TORCH_UCX_DT_COMPLEX64},
+    {at::kComplexDouble, TORCH_UCX_DT_COMPLEX128},
 };
 
 std::map<at::ScalarType, xccl_dt_t> xccl_type_map = {
@@ -63,6 +107,9 @@ xccl_coll_req_h ProcessGroupUCC::launch_xccl_collective(xccl_collective_type_t c
   }
 
   if ((coll == XCCL_REDUCE) || (coll == XCCL_ALLREDUCE)) {
+    if (!xccl_type_map.count(tensor.scalar_type())) {
+      throw std::runtime_error("ProcessGroupUCC: unsupported tensor type for xccl");
+    }
     coll_args.reduce_info.dt       = xccl_type_map.at(tensor.scalar_type());
     coll_args.reduce_info.op       = op;
     coll_args.reduce_info.count    = tensor.numel();
@@ -76,6 +123,23 @@ xccl_coll_req_h ProcessGroupUCC::launch_xccl_collective(xccl_collective_type_t c
    return request;
 }
 
+static std::exception_ptr ucc_exception(const std::string& what)
+{
+    return std::make_exception_ptr(std::runtime_error("ProcessGroupUCC: " + what));
+}
+
+static bool ucx_timed_out(torch_ucx_comm_t *comm, uint64_t start_ns)
+{
+    return (comm->timeout_ns > 0) &&
+           (torch_ucx_metrics_now() - start_ns > comm->timeout_ns);
+}
+
+static std::string ucx_p2p_error(const char *what, int peer)
+{
+    return std::string("p2p with peer ") +
+           ((peer < 0) ? std::string("any") : std::to_string(peer)) + " " + what;
+}
+
 ProcessGroupUCC::WorkUCX::~WorkUCX()
 {
     if (req != NULL) {
@@ -83,29 +147,103 @@ ProcessGroupUCC::WorkUCX::~WorkUCX()
     }
 }
 
+/* The sender is read before the request is released, a single poll
+ * either progresses or releases a completed request */
 bool ProcessGroupUCC::WorkUCX::isCompleted()
 {
     torch_ucx_status_t st;
 
+    if ((req != NULL) && (req->status == TORCH_UCX_REQUEST_DONE)) {
+        if (req->sender >= 0) {
+            src_rank = req->sender;
+        }
+        if (req->result != UCS_OK) {
+            finish(ucc_exception(ucx_p2p_error(ucs_status_string(req->result),
+                                               req->peer)));
+        }
+    }
     st = torch_ucx_req_test(comm, &req, 1, NULL, 1, 1);
     return (st != TORCH_UCX_INPROGRESS);
 }
 
-bool ProcessGroupUCC::WorkUCX::isSuccess() const
+/* A request ucp could not cancel is kept on the comm until it is closed */
+bool ProcessGroupUCC::WorkUCX::wait()
 {
-  //TODO
-  return true;
+    int peer;
+
+    RECORD_FUNCTION("ucc:wait", std::vector<c10::IValue>());
+    while (!isCompleted()) {
+        if (ucx_timed_out(comm, start_ns)) {
+            peer = req->peer;
+            torch_ucx_request_cancel(comm, req);
+            req  = NULL;
+            finish(ucc_exception(ucx_p2p_error("timed out", peer)));
+            break;
+        }
+    }
+    if (!isSuccess()) {
+        std::rethrow_exception(exception());
+    }
+    return true;
 }
 
-bool ProcessGroupUCC::WorkUCX::wait()
+int ProcessGroupUCC::WorkUCX::sourceRank() const
 {
-    torch_ucx_req_test(comm, &req, 1, NULL, -1, 1);
+    if (src_rank < 0) {
+        throw std::runtime_error("ProcessGroupUCC: source rank is only known "
+                                 "for completed receives");
+    }
+    return src_rank;
+}
+
+ProcessGroupUCC::WorkUCXBatch::~WorkUCXBatch()
+{
+    for (auto req: reqs) {
+        if (req != NULL) {
+            torch_ucx_request_free(req);
+        }
+    }
+}
+
+bool ProcessGroupUCC::WorkUCXBatch::isCompleted()
+{
+    torch_ucx_status_t st;
+
+    st = torch_ucx_batch_test(comm, &reqs, &result);
+    if ((st != TORCH_UCX_INPROGRESS) && (result != UCS_OK)) {
+        finish(ucc_exception(std::string("batched p2p failed: ") +
+                             ucs_status_string(result)));
+    }
+    return (st != TORCH_UCX_INPROGRESS);
+}
+
+bool ProcessGroupUCC::WorkUCXBatch::wait()
+{
+    std::string peers;
+
+    RECORD_FUNCTION("ucc:wait", std::vector<c10::IValue>());
+    while (!isCompleted()) {
+        if (ucx_timed_out(comm, start_ns)) {
+            for (auto req: reqs) {
+                peers += " " + std::to_string(req->peer);
+                torch_ucx_request_cancel(comm, req);
+            }
+            reqs.clear();
+            finish(ucc_exception("batched p2p timed out, waiting on peers" +
+                                 peers));
+            break;
+        }
+    }
+    if (!isSuccess()) {
+        std::rethrow_exception(exception());
+    }
     return true;
 }
 
 ProcessGroupUCC::WorkUCXColl::~WorkUCXColl()
 {
     if (req != NULL) {
+        torch_ucx_coll_release(req);
         delete req;
     }
 }
@@ -117,30 +255,87 @@ bool ProcessGroupUCC::WorkUCXColl::isCompleted()
     if (no_progress) {
         st = req->status;
     } else {
-        st = torch_ucx_coll_test(req);
+        st = torch_ucx_coll_test_ordered(req);
+    }
+    if (st == TORCH_UCX_ERROR) {
+        finish(ucc_exception(req->error));
     }
 
     return (st != TORCH_UCX_INPROGRESS);
 }
 
-bool ProcessGroupUCC::WorkUCXColl::isSuccess() const
-{
-  //TODO
-  return true;
-}
-
 bool ProcessGroupUCC::WorkUCXColl::wait()
 {
     torch_ucx_status_t st;
 
+    RECORD_FUNCTION("ucc:wait", std::vector<c10::IValue>());
     do {
         if (no_progress) {
             st = req->status;
         } else {
-            st = torch_ucx_coll_test(req);
+            st = torch_ucx_coll_test_ordered(req);
         }
     } while(st == TORCH_UCX_INPROGRESS);
 
+    if (st == TORCH_UCX_ERROR) {
+        finish(ucc_exception(req->error));
+        std::rethrow_exception(exception());
+    }
+    return true;
+}
+
+bool ProcessGroupUCC::WorkUCXSparse::wait()
+{
+    torch_ucx_sparse_t *sp = &sparse;
+    int64_t            total, offset;
+
+    WorkUCXColl::wait();
+    if (finished) {
+        return true;
+    }
+    finished = true;
+
+    if (sp->is_dense) {
+        auto dense = at::empty(input.sizes(), values.options());
+
+        memcpy(dense.data_ptr(), sp->dense.data(), sp->dense.size());
+        if (scale != 1.0) {
+            dense.mul_(scale);
+        }
+        input.copy_(dense.to_sparse(sp->sparse_dim));
+        return true;
+    }
+
+    std::vector<int64_t> value_sizes = values.sizes().vec();
+
+    total          = sp->out_values.size() /
+                     (sp->row_len * torch_ucx_dtype_size(sp->dtype));
+    value_sizes[0] = total;
+    auto all_indices = at::empty({total, sp->sparse_dim},
+                                 indices.options().dtype(at::kLong));
+    auto all_values  = at::empty(value_sizes, values.options());
+    memcpy(all_indices.data_ptr(), sp->out_indices.data(),
+           sp->out_indices.size() * sizeof(int64_t));
+    memcpy(all_values.data_ptr(), sp->out_values.data(), sp->out_values.size());
+
+    if (outputs.empty()) {
+        auto result = at::sparse_coo_tensor(all_indices.t(), all_values,
+                                            input.sizes(),
+                                            values.options()).coalesce();
+        if (scale != 1.0) {
+            result.mul_(scale);
+        }
+        input.copy_(result);
+        return true;
+    }
+    offset = 0;
+    for (size_t i = 0; i < outputs.size(); i++) {
+        outputs[i].copy_(at::sparse_coo_tensor(
+            all_indices.narrow(0, offset, sp->nnzs[i]).t(),
+            all_values.narrow(0, offset, sp->nnzs[i]),
+            input.sizes(), values.options()));
+        offset += sp->nnzs[i];
+    }
     return true;
 }
 
@@ -149,25 +344,47 @@ ProcessGroupUCC::WorkUCC::~WorkUCC()
   xccl_collective_finalize(req);
 }
 
+/* The user tensor of a scaled allreduce only takes the result, it keeps
+ * its input if the collective fails */
+void ProcessGroupUCC::WorkUCC::unpack()
+{
+  if (!scaled.defined()) {
+    return;
+  }
+  if (post_scale != 1.0) {
+    scaled.mul_(post_scale);
+  }
+  if (scaled.data_ptr() != output.data_ptr()) {
+    output.copy_(scaled);
+  }
+  scaled = at::Tensor();
+}
+
 bool ProcessGroupUCC::WorkUCC::isCompleted()
 {
   xccl_status_t st;
 
   st = xccl_collective_test(req);
+  if ((st != XCCL_OK) && (st != XCCL_INPROGRESS)) {
+    finish(ucc_exception("xccl collective failed"));
+  } else if (st == XCCL_OK) {
+    unpack();
+  }
   
   return st != XCCL_INPROGRESS;
 }
 
-bool ProcessGroupUCC::WorkUCC::isSuccess() const
-{
-  return true;
-}
-
 bool ProcessGroupUCC::WorkUCC::wait()
 {
   xccl_status_t st;
 
+  RECORD_FUNCTION("ucc:wait", std::vector<c10::IValue>());
   st = xccl_collective_wait(req);
+  if (st != XCCL_OK) {
+    finish(ucc_exception("xccl collective failed"));
+    std::rethrow_exception(exception());
+  }
+  unpack();
 
   if (args.coll_type == XCCL_ALLGATHER) {
     for (size_t i = 0; i < output_data_vec.size(); ++i) {
@@ -176,7 +393,67 @@ bool ProcessGroupUCC::WorkUCC::wait()
 
   }
 
-  return st == XCCL_OK;
+  return true;
+}
+
+/* Copies the results of all members out of the fused buffer, done by the
+ * first member that sees the fused allreduce complete */
+void ProcessGroupUCC::WorkUCXFused::unpack()
+{
+    char *buf = (char*)fusion->buffer.data_ptr();
+
+    if (fusion->unpacked) {
+        return;
+    }
+    for (size_t i = 0; i < fusion->tensors.size(); i++) {
+        auto &tensor = fusion->tensors[i];
+
+        memcpy(tensor.data_ptr(), buf + fusion->offsets[i],
+               tensor.numel() * tensor.element_size());
+    }
+    fusion->unpacked = true;
+}
+
+/* NULL until the fusion is flushed, which another thread may be doing */
+std::shared_ptr<ProcessGroupUCC::WorkUCXColl>
+ProcessGroupUCC::WorkUCXFused::fused_work(bool flush)
+{
+    std::lock_guard<std::mutex> lock(pg->fusion_mutex);
+
+    /* an unflushed fusion is always the pending one */
+    if (!fusion->work && flush) {
+        pg->flush_fusion_locked();
+    }
+    return fusion->work;
+}
+
+bool ProcessGroupUCC::WorkUCXFused::isCompleted()
+{
+    auto work = fused_work(false);
+
+    if (!work || !work->isCompleted()) {
+        return false;
+    }
+    if (!work->isSuccess()) {
+        finish(work->exception());
+        return true;
+    }
+    unpack();
+    return true;
+}
+
+bool ProcessGroupUCC::WorkUCXFused::wait()
+{
+    auto work = fused_work(true);
+
+    try {
+        work->wait();
+    } catch (...) {
+        finish(std::current_exception());
+        throw;
+    }
+    unpack();
+    return true;
 }
 
 void ProcessGroupUCC::read_config()
@@ -186,27 +463,116 @@ void ProcessGroupUCC::read_config()
     config.enable_xccl            = true;
     config.enable_ucx             = true;
     config.enable_progress_thread = true;
+    config.sparse_dense_thresh    = 0;
+    config.fusion_bytes           = 0;
+    config.fusion_tensor          = 64 << 10;
+    config.priority_interval      = 16;
  
     env = std::getenv("TORCH_UCC_UCX_ENABLE");
     if (env) {
-        config.enable_xccl = std::atoi(env);
+        config.enable_ucx = std::atoi(env);
     }
     env = std::getenv("TORCH_UCC_XCCL_ENABLE");
     if (env) {
-        config.enable_ucx = std::atoi(env);
+        config.enable_xccl = std::atoi(env);
     }
     env = std::getenv("TORCH_UCC_THREAD_ENABLE");
     if (env) {
         config.enable_progress_thread = std::atoi(env);
     }
+    env = std::getenv("TORCH_UCC_SPARSE_DENSE_THRESH");
+    if (env) {
+        config.sparse_dense_thresh = std::atof(env);
+    }
+    env = std::getenv("TORCH_UCC_FUSION_BYTES");
+    if (env) {
+        config.fusion_bytes = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_FUSION_TENSOR");
+    if (env) {
+        config.fusion_tensor = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_PRIORITY_INTERVAL");
+    if (env) {
+        config.priority_interval = std::max(std::atoi(env), 1);
+    }
+    env = std::getenv("TORCH_UCC_RECORD");
+    if (env) {
+        config.record_file = env;
+    }
+    env = std::getenv("TORCH_UCC_DISPATCH");
+    if (env) {
+        if (torch_ucc_dispatch_parse(env, &config.dispatch_rules) != TORCH_UCX_OK) {
+            throw std::runtime_error("ProcessGroupUCC: invalid TORCH_UCC_DISPATCH");
+        }
+    }
+}
+
+/* The first matching dispatch rule whose backend can run the call wins,
+ * otherwise native UCX is preferred over XCCL. The selection only depends
+ * on arguments that are the same on all ranks, so every rank takes the
+ * same backend. */
+torch_ucc_backend_t ProcessGroupUCC::select_backend(torch_ucx_coll_type_t coll,
+                                                    at::ScalarType dtype,
+                                                    torch_ucx_memtype_t mtype,
+                                                    size_t len,
+                                                    bool ucx_supported)
+{
+    std::vector<torch_ucc_backend_t> backends;
+
+    ucx_supported = ucx_supported && config.enable_ucx;
+    torch_ucc_dispatch_match(config.dispatch_rules, coll, dtype, mtype, len,
+                             &backends);
+    backends.push_back(TORCH_UCC_BACKEND_UCX);
+    backends.push_back(TORCH_UCC_BACKEND_XCCL);
+    for (auto backend: backends) {
+        if (((backend == TORCH_UCC_BACKEND_UCX) && ucx_supported) ||
+            ((backend == TORCH_UCC_BACKEND_XCCL) && config.enable_xccl)) {
+            return backend;
+        }
+    }
+    throw std::runtime_error("ProcessGroupUCC: no collective backends");
+}
 
+/* TORCH_UCC_TRACE_FILE may contain %d, it is replaced by the rank. Each
+ * dump holds the events since the previous one, dumps after the first get
+ * their index added before the extension so they don't overwrite it. */
+void ProcessGroupUCC::dump_trace(int rank)
+{
+    static std::atomic<int> n_dumps(0);
+    std::string             file = "torch_ucc_trace_%d.json";
+    char                    *env = std::getenv("TORCH_UCC_TRACE_FILE");
+    size_t                  pos;
+    int                     idx;
+
+    if (!torch_ucx_trace_on) {
+        return;
+    }
+    if (env) {
+        file = env;
+    }
+    pos = file.find("%d");
+    if (pos != std::string::npos) {
+        file.replace(pos, 2, std::to_string(rank));
+    }
+    idx = n_dumps++;
+    if (idx > 0) {
+        pos = file.rfind('.');
+        if ((pos == std::string::npos) || (pos < file.rfind('/') + 1)) {
+            pos = file.size();
+        }
+        file.insert(pos, "." + std::to_string(idx));
+    }
+    torch_ucx_trace_dump(file.c_str(), rank);
 }
 
 ProcessGroupUCC::ProcessGroupUCC(const std::shared_ptr<Store>& store,
                                  int rank,
-                                 int size)
+                                 int size,
+                                 std::chrono::milliseconds timeout)
     : ProcessGroup(rank, size),
-      store_(store), stop_progress_loop(false) {
+      store_(store), stop_progress_loop(false), progress_active(0),
+      priority(0), reduce_pre_scale(1.0), reduce_average(false) {
     torch_ucx_status_t st;
 
     read_config();
@@ -214,7 +580,9 @@ ProcessGroupUCC::ProcessGroupUCC(const std::shared_ptr<Store>& store,
     if (st != TORCH_UCX_OK) {
         throw std::runtime_error("ProcessGroupUCC init failed");
     }
-    st = torch_ucx_coll_comm_init(ucx_comm, &ucx_coll_comm);
+    ucx_comm->timeout_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               timeout).count();
+    st = torch_ucx_coll_comm_init(ucx_comm, store_, &ucx_coll_comm);
     if (st != TORCH_UCX_OK) {
         throw std::runtime_error("ProcessGroupUCC init failed");
     }
@@ -223,43 +591,114 @@ ProcessGroupUCC::ProcessGroupUCC(const std::shared_ptr<Store>& store,
         throw std::runtime_error("ProcessGroupUCC init failed");
     }
 
+    recorder = NULL;
+    if (!config.record_file.empty() &&
+        (torch_ucc_record_open(config.record_file.c_str(), rank,
+                               &recorder) != TORCH_UCX_OK)) {
+        recorder = NULL;
+    }
     if (config.enable_progress_thread) {
         progress_thread = std::thread(&ProcessGroupUCC::progress_loop, this);
     }
 }
 
+/* All started collectives are progressed together, highest priority first.
+ * While a higher priority one is active the others only advance every
+ * priority_interval rounds, so a large collective stops posting segments
+ * but is never starved: a peer may need it to finish before it posts the
+ * collective this rank prioritizes. */
 void ProcessGroupUCC::progress_loop()
 {
-    std::unique_lock<std::mutex> lock(pg_mutex);
-    torch_ucx_coll_request_t     *req;
-    torch_ucx_status_t           st;
+    std::unique_lock<std::mutex>          lock(pg_mutex);
+    torch_ucx_metrics_t                   *metrics = &ucx_coll_comm->metrics;
+    std::vector<torch_ucx_coll_request_t*> active;
+    torch_ucx_coll_request_t              *req;
+    uint64_t                              start;
+    uint64_t                              round = 0;
+    int                                   top;
  
-    while(!stop_progress_loop) {
-        if (progress_queue.empty()) {
+    while(!stop_progress_loop || !active.empty()) {
+        if (progress_queue.empty() && active.empty()) {
             queue_produce_cv.wait(lock);
             continue;
         }
-        req = progress_queue.front();
-        progress_queue.pop_front();
+        while (!progress_queue.empty()) {
+            req = progress_queue.front();
+            progress_queue.pop_front();
+            metrics->queue_depth--;
+            torch_ucx_trace("queued", TORCH_UCX_TRACE_END, req);
+            /* FIFO within a priority */
+            active.insert(std::upper_bound(active.begin(), active.end(), req,
+                              [](torch_ucx_coll_request_t *a,
+                                 torch_ucx_coll_request_t *b) {
+                                  return a->priority > b->priority;
+                              }), req);
+        }
+        progress_active = active.size();
         lock.unlock();
-        queue_consume_cv.notify_one();
-        do {
-            st = torch_ucx_coll_test(req);
-        } while(st == TORCH_UCX_INPROGRESS);
+        queue_consume_cv.notify_all();
+        start = torch_ucx_metrics_now();
+        top   = active.front()->priority;
+        round++;
+        for (auto it = active.begin(); it != active.end();) {
+            if (((*it)->priority < top) &&
+                (round % config.priority_interval != 0)) {
+                break;
+            }
+            if (torch_ucx_coll_test(*it) != TORCH_UCX_INPROGRESS) {
+                it = active.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        metrics->busy_ns += torch_ucx_metrics_now() - start;
         lock.lock();
+        progress_active = active.size();
+        if (active.empty()) {
+            queue_consume_cv.notify_all();
+        }
     }
 }
 
-void ProcessGroupUCC::enqueue_request(torch_ucx_coll_request_t* req)
+/* Tuning runs its collectives on the calling thread, so everything the
+ * progress thread holds is completed first. Without the thread the tuner
+ * completes them itself. All ranks tune the same buckets in the same
+ * order, so the drained collectives can complete. */
+void ProcessGroupUCC::get_coll_config(torch_ucx_coll_type_t coll, size_t len,
+                                      torch_ucx_coll_config_t *coll_config)
+{
+    if (config.enable_progress_thread &&
+        torch_ucx_tune_needed(ucx_coll_comm, coll, len)) {
+        std::unique_lock<std::mutex> lock(pg_mutex);
+
+        queue_consume_cv.wait(lock, [&] {
+            return progress_queue.empty() && (progress_active == 0);
+        });
+    }
+    torch_ucx_coll_get_config(ucx_coll_comm, coll, len, coll_config);
+}
+
+void ProcessGroupUCC::enqueue_request(torch_ucx_coll_request_t* req,
+                                      int priority)
 {
     std::unique_lock<std::mutex> lock(pg_mutex);
+    torch_ucx_metrics_t          *metrics = &ucx_coll_comm->metrics;
+    uint64_t                     depth;
+
+    req->priority = priority;
+    torch_ucx_trace("queued", TORCH_UCX_TRACE_BEGIN, req);
     progress_queue.push_back(req);
+    depth = ++metrics->queue_depth;
+    if (depth > metrics->queue_max) {
+        metrics->queue_max = depth;
+    }
     lock.unlock();
     queue_produce_cv.notify_one();
 }
 
 ProcessGroupUCC::~ProcessGroupUCC()
 {
+    flush_fusion();
     if (config.enable_progress_thread) {
         std::unique_lock<std::mutex> lock(pg_mutex);
         queue_consume_cv.wait(lock, [&] { return progress_queue.empty(); });
@@ -269,16 +708,228 @@ ProcessGroupUCC::~ProcessGroupUCC()
         progress_thread.join();
     }
 
+    dump_trace(rank_);
+    torch_ucc_record_close(recorder);
     torch_xccl_comm_close(xccl_comm);
     torch_ucx_coll_comm_close(ucx_coll_comm);
     torch_ucx_comm_close(ucx_comm, store_);
 }
 
+py::dict ProcessGroupUCC::get_metrics()
+{
+    torch_ucx_metrics_t *metrics = &ucx_coll_comm->metrics;
+    py::dict            result, colls, transports;
+    py::list            size_bounds, lat_bounds;
+    std::string         info;
+
+    for (int i = 0; i < TORCH_UCX_METRICS_N_SIZES - 1; i++) {
+        size_bounds.append(torch_ucx_metrics_size_bound(i));
+    }
+    for (int j = 0; j < TORCH_UCX_METRICS_N_LATS - 1; j++) {
+        lat_bounds.append(torch_ucx_metrics_lat_bound_us(j));
+    }
+    for (int c = 0; c < TORCH_UCX_METRICS_LAST; c++) {
+        torch_ucx_coll_metrics_t *cm = &metrics->coll[c];
+        py::dict                 coll;
+        py::list                 hist;
+
+        for (int i = 0; i < TORCH_UCX_METRICS_N_SIZES; i++) {
+            py::list row;
+
+            for (int j = 0; j < TORCH_UCX_METRICS_N_LATS; j++) {
+                row.append(cm->lat[i][j].load());
+            }
+            hist.append(row);
+        }
+        coll["ops"]        = cm->ops.load();
+        coll["bytes"]      = cm->bytes.load();
+        coll["latency_us"] = hist;
+        colls[torch_ucx_metrics_coll_names[c]] = coll;
+    }
+    for (int peer = 0; peer < size_; peer++) {
+        if (torch_ucx_ep_info(ucx_comm, peer, &info) == TORCH_UCX_OK) {
+            transports[py::int_(peer)] = info;
+        }
+    }
+    result["collectives"]    = colls;
+    result["size_bounds"]    = size_bounds;
+    result["latency_bounds"] = lat_bounds;
+    result["queue_depth"]    = metrics->queue_depth.load();
+    result["queue_max"]      = metrics->queue_max.load();
+    result["busy_us"]        = metrics->busy_ns.load() / 1000;
+    result["transports"]     = transports;
+    return result;
+}
+
+void ProcessGroupUCC::reset_metrics()
+{
+    torch_ucx_metrics_reset(&ucx_coll_comm->metrics);
+}
+
+/* Fusion only depends on the sequence of calls, never on timing: a fusion
+ * is flushed when the next allreduce doesn't fit or match it, before any
+ * other operation of the group, when one of its works is waited for and
+ * by flush_fusion(). So all ranks fuse the same allreduces as long as they
+ * make the same calls in the same order. Polling with isCompleted() does
+ * not flush. */
+std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::fuse_allreduce(at::Tensor& tensor,
+                                                                    torch_ucx_reduce_op_t op,
+                                                                    double pre_scale,
+                                                                    double post_scale)
+{
+    std::lock_guard<std::mutex> lock(fusion_mutex);
+    size_t                      len = tensor.numel() * tensor.element_size();
+    auto                        &f  = fusion_pending;
+
+    if (f && ((f->dtype != tensor.scalar_type()) || (f->op != op) ||
+              (f->pre_scale != pre_scale) || (f->post_scale != post_scale) ||
+              (f->priority != priority) ||
+              (f->len + len > config.fusion_bytes))) {
+        flush_fusion_locked();
+    }
+    if (!f) {
+        f             = std::make_shared<ucc_fusion_t>();
+        f->dtype      = tensor.scalar_type();
+        f->op         = op;
+        f->pre_scale  = pre_scale;
+        f->post_scale = post_scale;
+        f->priority   = priority;
+        f->len        = 0;
+        f->unpacked   = false;
+        for (auto &buf: fusion_pool) {
+            if (buf.use_count() == 1) {
+                f->buffer = buf;
+                break;
+            }
+        }
+        if (!f->buffer.defined()) {
+            f->buffer = at::empty({(int64_t)config.fusion_bytes}, at::kByte);
+            if (fusion_pool.size() < 4) {
+                fusion_pool.push_back(f->buffer);
+            }
+        }
+    }
+    memcpy((char*)f->buffer.data_ptr() + f->len, tensor.data_ptr(), len);
+    f->tensors.push_back(tensor);
+    f->offsets.push_back(f->len);
+    f->len += len;
+    return std::make_shared<ProcessGroupUCC::WorkUCXFused>(this, f);
+}
+
+void ProcessGroupUCC::flush_fusion()
+{
+    std::lock_guard<std::mutex> lock(fusion_mutex);
+
+    flush_fusion_locked();
+}
+
+void ProcessGroupUCC::flush_fusion_locked()
+{
+    std::shared_ptr<ucc_fusion_t> f = std::move(fusion_pending);
+
+    fusion_pending = nullptr;
+    if (!f) {
+        return;
+    }
+    auto work = std::make_shared<ProcessGroupUCC::WorkUCXColl>();
+
+    work->req->src_buf_mtype = TORCH_UCX_HOST;
+    work->req->dst_buf_mtype = TORCH_UCX_HOST;
+    work->req->src_buffer    = f->buffer.data_ptr();
+    work->req->dst_buffer    = f->buffer.data_ptr();
+    work->req->len           = f->len;
+    work->req->dtype         = ucx_type_map.at(f->dtype);
+    work->req->count         = f->len / torch_ucx_dtype_size(work->req->dtype);
+    work->req->op            = f->op;
+    work->req->pre_scale     = f->pre_scale;
+    work->req->post_scale    = f->post_scale;
+
+    get_coll_config(TORCH_UCX_COLL_ALLREDUCE,
+                    work->req->len, &work->req->config);
+    torch_ucx_allreduce_start(ucx_coll_comm, work->req);
+    if (config.enable_progress_thread) {
+        enqueue_request(work->req, f->priority);
+        work->no_progress = true;
+    }
+    f->work = work;
+}
+
+void ProcessGroupUCC::set_reduce_scaling(double pre_scale, bool average)
+{
+    reduce_pre_scale = pre_scale;
+    reduce_average   = average;
+}
+
+int ProcessGroupUCC::set_priority(int level)
+{
+    return priority.exchange(level);
+}
+
+static ProcessGroupUCC* get_ucc_pg(const std::shared_ptr<ProcessGroup>& pg)
+{
+    auto ucc_pg = std::dynamic_pointer_cast<ProcessGroupUCC>(pg);
+
+    if (!ucc_pg) {
+        throw std::runtime_error("ProcessGroupUCC: not a ucc process group");
+    }
+    return ucc_pg.get();
+}
+
+/* Local duplicates are summed before sending, the indices are sent
+ * transposed so that the rows of all ranks can be concatenated. */
+std::shared_ptr<ProcessGroupUCC::WorkUCXSparse> ProcessGroupUCC::start_sparse(at::Tensor& tensor,
+                                                                              double dense_thresh)
+{
+    auto               work = std::make_shared<ProcessGroupUCC::WorkUCXSparse>();
+    torch_ucx_sparse_t *sp  = &work->sparse;
+
+    if (tensor.is_cuda() || !ucx_type_map.count(tensor.scalar_type())) {
+        throw std::runtime_error("ProcessGroupUCC: unsupported sparse tensor");
+    }
+    auto coalesced = tensor.is_coalesced() ? tensor : tensor.coalesce();
+
+    work->input   = tensor;
+    work->indices = coalesced._indices().t().contiguous();
+    work->values  = coalesced._values().contiguous();
+    torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_SPARSE,
+                            work->indices.numel() * work->indices.element_size() +
+                            work->values.numel() * work->values.element_size());
+
+    sp->indices      = work->indices.data_ptr<int64_t>();
+    sp->values       = work->values.data_ptr();
+    sp->nnz          = coalesced._nnz();
+    sp->sparse_dim   = tensor.sparse_dim();
+    sp->row_len      = 1;
+    sp->dtype        = ucx_type_map.at(tensor.scalar_type());
+    sp->dense_thresh = dense_thresh;
+    sp->sizes.clear();
+    for (int64_t d = 0; d < tensor.dim(); d++) {
+        if (d < sp->sparse_dim) {
+            sp->sizes.push_back(tensor.size(d));
+        } else {
+            sp->row_len *= tensor.size(d);
+        }
+    }
+
+    work->req->config        = ucx_coll_comm->config;
+    work->req->src_buf_mtype = TORCH_UCX_HOST;
+    work->req->dst_buf_mtype = TORCH_UCX_HOST;
+    torch_ucx_sparse_start(ucx_coll_comm, work->req);
+    if (config.enable_progress_thread) {
+        enqueue_request(work->req, priority);
+        work->no_progress = true;
+    }
+    return work;
+}
+
 std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::broadcast(std::vector<at::Tensor>& tensors,
                                                                const BroadcastOptions& opts)
 {
    xccl_coll_req_h request;
-  
+
+  RECORD_FUNCTION("ucc:broadcast", std::vector<c10::IValue>({tensors[0]}));
+  torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_BROADCAST,
+                          tensors[0].numel() * tensors[0].element_size());
 //   request = launch_xccl_collective(XCCL_BCAST, tensors, opts.rootRank,
 //                                    XCCL_OP_LAST_PREDEFINED);
   return std::make_shared<ProcessGroupUCC::WorkUCC>(request);
@@ -288,9 +939,99 @@ std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::allreduce(std::vector<at::T
                                                                const AllreduceOptions& opts)
 {
    xccl_coll_req_h request;
-  
+
+  RECORD_FUNCTION("ucc:allreduce", std::vector<c10::IValue>({tensors[0]}));
+  if (recorder) {
+      torch_ucc_record(recorder, tensors[0].is_sparse() ? "sparse_allreduce" :
+                                                          "allreduce",
+                       &tensors[0], &opts.reduceOp, -1, -1);
+  }
+  if ((tensors.size() == 1) && tensors[0].is_sparse()) {
+      flush_fusion();
+      if (opts.reduceOp != ReduceOp::SUM) {
+          throw std::runtime_error("ProcessGroupUCC: sparse allreduce "
+                                   "supports SUM only");
+      }
+      auto work = start_sparse(tensors[0], config.sparse_dense_thresh);
+      if (tensors[0].is_floating_point() || tensors[0].is_complex()) {
+          work->scale = reduce_pre_scale * (reduce_average ? 1.0 / size_ : 1.0);
+      }
+      return work;
+  }
+  check_tensor(tensors);
+  auto   &tensor    = tensors[0];
+  double pre_scale  = 1.0;
+  double post_scale = 1.0;
+
+  torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_ALLREDUCE,
+                          tensor.numel() * tensor.element_size());
+
+  /* scaling applies to SUM of floating point tensors only, other
+   * allreduces of the group are left as they are */
+  if ((opts.reduceOp == ReduceOp::SUM) &&
+      (tensor.is_floating_point() || tensor.is_complex())) {
+      pre_scale  = reduce_pre_scale;
+      post_scale = reduce_average ? 1.0 / size_ : 1.0;
+  }
+  if (select_backend(TORCH_UCX_COLL_ALLREDUCE, tensor.scalar_type(),
+                     tensor.is_cuda() ? TORCH_UCX_CUDA : TORCH_UCX_HOST,
+                     tensor.element_size() * tensor.numel(),
+                     !tensor.is_cuda() &&
+                     ucx_type_map.count(tensor.scalar_type()) &&
+                     ucx_op_map.count(opts.reduceOp) &&
+                     torch_ucx_reduce_supported(ucx_type_map.at(tensor.scalar_type()),
+                                                ucx_op_map.at(opts.reduceOp))) ==
+      TORCH_UCC_BACKEND_UCX) {
+      size_t len = tensor.element_size() * tensor.numel();
+
+      if ((config.fusion_bytes != 0) && (len <= config.fusion_tensor) &&
+          (len <= config.fusion_bytes)) {
+          return fuse_allreduce(tensor, ucx_op_map.at(opts.reduceOp),
+                                pre_scale, post_scale);
+      }
+      flush_fusion();
+      auto ucx_request = std::make_shared<ProcessGroupUCC::WorkUCXColl>();
+
+      ucx_request->req->src_buf_mtype = TORCH_UCX_HOST;
+      ucx_request->req->dst_buf_mtype = TORCH_UCX_HOST;
+      ucx_request->req->src_buffer    = tensor.data_ptr();
+      ucx_request->req->dst_buffer    = tensor.data_ptr();
+      ucx_request->req->len           = tensor.element_size() * tensor.numel();
+      ucx_request->req->count         = tensor.numel();
+      ucx_request->req->dtype         = ucx_type_map.at(tensor.scalar_type());
+      ucx_request->req->op            = ucx_op_map.at(opts.reduceOp);
+      ucx_request->req->pre_scale     = pre_scale;
+      ucx_request->req->post_scale    = post_scale;
+
+      get_coll_config(TORCH_UCX_COLL_ALLREDUCE,
+                      ucx_request->req->len, &ucx_request->req->config);
+      torch_ucx_allreduce_start(ucx_coll_comm, ucx_request->req);
+      if (config.enable_progress_thread) {
+          enqueue_request(ucx_request->req, priority);
+          ucx_request->no_progress = true;
+      }
+      return ucx_request;
+  }
+
+  flush_fusion();
+  if ((pre_scale != 1.0) || (post_scale != 1.0)) {
+      /* the pre-scale goes to a copy, the post-scale to the result */
+      auto work   = std::make_shared<ProcessGroupUCC::WorkUCC>();
+      auto scaled = tensor;
+
+      if (pre_scale != 1.0) {
+          scaled = tensor.clone();
+          scaled.mul_(pre_scale);
+      }
+      work->req        = launch_xccl_collective(XCCL_ALLREDUCE, {scaled}, -1,
+                                                get_xccl_op(opts.reduceOp));
+      work->scaled     = scaled;
+      work->output     = tensor;
+      work->post_scale = post_scale;
+      return work;
+  }
   request = launch_xccl_collective(XCCL_ALLREDUCE, tensors, -1,
-                                   xccl_op_map.at(opts.reduceOp));
+                                   get_xccl_op(opts.reduceOp));
   return std::make_shared<ProcessGroupUCC::WorkUCC>(request);
 }
 
@@ -303,9 +1044,17 @@ std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::reduce(std::vector<at::Tens
                                                             const ReduceOptions& opts)
 {
    xccl_coll_req_h request;
-  
+
+  RECORD_FUNCTION("ucc:reduce", std::vector<c10::IValue>({tensors[0]}));
+  if (recorder) {
+      torch_ucc_record(recorder, "reduce", &tensors[0], &opts.reduceOp,
+                       opts.rootRank, -1);
+  }
+  torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_REDUCE,
+                          tensors[0].numel() * tensors[0].element_size());
+  flush_fusion();
   request = launch_xccl_collective(XCCL_REDUCE, tensors, opts.rootRank,
-                                   xccl_op_map.at(opts.reduceOp));
+                                   get_xccl_op(opts.reduceOp));
   return std::make_shared<ProcessGroupUCC::WorkUCC>(request);
 }
 
@@ -313,6 +1062,19 @@ std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::allgather(std::vector<std::
                                                               std::vector<at::Tensor>& inputTensors,
                                                               const AllgatherOptions& opts)
 {
+  RECORD_FUNCTION("ucc:allgather", std::vector<c10::IValue>({inputTensors[0]}));
+  flush_fusion();
+  if ((inputTensors.size() == 1) && inputTensors[0].is_sparse()) {
+      if ((outputTensors.size() != 1) || (outputTensors[0].size() != (size_t)size_)) {
+          throw std::runtime_error("ProcessGroupUCC: sparse allgather takes "
+                                   "one output per rank");
+      }
+      auto work = start_sparse(inputTensors[0], 0);
+      work->outputs = outputTensors[0];
+      return work;
+  }
+  torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_ALLGATHER,
+                          inputTensors[0].numel() * inputTensors[0].element_size());
   auto req     = std::make_shared<ProcessGroupUCC::WorkUCC>();
 //   auto &tensor = inputTensors[0];
 //   xccl_coll_op_args_t coll_args;
@@ -346,6 +1108,12 @@ std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::barrier(
   xccl_coll_req_h request;
   xccl_coll_op_args_t coll_args;
 
+  RECORD_FUNCTION("ucc:barrier", std::vector<c10::IValue>());
+  if (recorder) {
+      torch_ucc_record(recorder, "barrier", NULL, NULL, -1, -1);
+  }
+  torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_BARRIER, 0);
+  flush_fusion();
   coll_args.coll_type = XCCL_BARRIER;
 
   xccl_collective_init(&coll_args, &request, xccl_comm->xccl_team);
@@ -405,70 +1173,81 @@ std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::alltoall_base(at::Tensor& o
                                                                    std::vector<int64_t>& inputSplitSizes,
                                                                    const AllToAllOptions& opts)
 {
-    if (config.enable_ucx) {
-        auto request = std::make_shared<ProcessGroupUCC::WorkUCXColl>();
+    bool   alltoallv = (outputSplitSizes.size() != 0) && (inputSplitSizes.size() != 0);
+    size_t block_len = inputTensor.element_size() * inputTensor.numel() / size_;
 
-        if ((outputSplitSizes.size() == 0) || (inputSplitSizes.size() == 0)) {
-            request->req->src_buf_mtype = (inputTensor.is_cuda() ? TORCH_UCX_CUDA: TORCH_UCX_HOST);
-            request->req->dst_buf_mtype = (outputTensor.is_cuda() ? TORCH_UCX_CUDA: TORCH_UCX_HOST);
-            request->req->src_buffer = inputTensor.data_ptr();
-            request->req->dst_buffer = outputTensor.data_ptr();
-            request->req->len = inputTensor.element_size() * inputTensor.numel() / size_;
-        } else {
-            throw std::runtime_error("ProcessGroupUCC: ucx backend doesn't support alltoallv");
-        }
+    RECORD_FUNCTION("ucc:alltoall_base", std::vector<c10::IValue>({inputTensor}));
+    if (recorder) {
+        torch_ucc_record(recorder, "alltoall", &inputTensor, NULL, -1, -1,
+                         inputSplitSizes, outputSplitSizes);
+    }
+    torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_ALLTOALL,
+                            inputTensor.numel() * inputTensor.element_size());
+    flush_fusion();
+    if (select_backend(TORCH_UCX_COLL_ALLTOALL, inputTensor.scalar_type(),
+                       inputTensor.is_cuda() ? TORCH_UCX_CUDA : TORCH_UCX_HOST,
+                       block_len, !alltoallv) == TORCH_UCC_BACKEND_UCX) {
+        auto request = std::make_shared<ProcessGroupUCC::WorkUCXColl>();
 
+        request->req->src_buf_mtype = (inputTensor.is_cuda() ? TORCH_UCX_CUDA: TORCH_UCX_HOST);
+        request->req->dst_buf_mtype = (outputTensor.is_cuda() ? TORCH_UCX_CUDA: TORCH_UCX_HOST);
+        request->req->src_buffer = inputTensor.data_ptr();
+        request->req->dst_buffer = outputTensor.data_ptr();
+        request->req->len = block_len;
+        request->req->dtype = ucx_type_map.count(inputTensor.scalar_type()) ?
+                              ucx_type_map.at(inputTensor.scalar_type()) :
+                              TORCH_UCX_DT_UINT8;
+
+        get_coll_config(TORCH_UCX_COLL_ALLTOALL,
+                        request->req->len, &request->req->config);
         torch_ucx_alltoall_start(ucx_coll_comm, request->req);
         if (config.enable_progress_thread) {
-            enqueue_request(request->req);
+            enqueue_request(request->req, priority);
             request->no_progress = true;
         }
         return request;
     }
-    if (config.enable_xccl) {
-        auto req = std::make_shared<ProcessGroupUCC::WorkUCC>();
-        xccl_coll_req_h     request;
-        xccl_coll_op_args_t coll_args;
-
-        if ((outputSplitSizes.size() == 0) || (inputSplitSizes.size() == 0)) {
-            coll_args.coll_type              = XCCL_ALLTOALL;
-            coll_args.buffer_info.src_buffer = inputTensor.data_ptr();
-            coll_args.buffer_info.dst_buffer = outputTensor.data_ptr();
-            coll_args.buffer_info.len        = inputTensor.element_size() * inputTensor.numel() / size_;
-            coll_args.alg.set_by_user        = 0;
-            coll_args.tag                    = 123;
-        } else {
-            req->scratch.resize(4 * size_);
-            uint32_t *send_lengths = req->scratch.data();
-            uint32_t *recv_lengths = (uint32_t*)((ptrdiff_t)send_lengths + 1*size_*sizeof(uint32_t));
-            uint32_t *send_offsets = (uint32_t*)((ptrdiff_t)send_lengths + 2*size_*sizeof(uint32_t));
-            uint32_t *recv_offsets = (uint32_t*)((ptrdiff_t)send_lengths + 3*size_*sizeof(uint32_t));
-
-            computeLengthsAndOffsets(size_, inputSplitSizes, inputTensor, send_lengths, send_offsets);
-            computeLengthsAndOffsets(size_, outputSplitSizes, outputTensor, recv_lengths, recv_offsets);
-
-            coll_args.coll_type                     = XCCL_ALLTOALLV;
-            coll_args.buffer_info.src_buffer        = inputTensor.data_ptr();
-            coll_args.buffer_info.src_displacements = send_offsets;
-            coll_args.buffer_info.src_counts        = send_lengths;
-            coll_args.buffer_info.src_datatype      = xccl_type_map.at(inputTensor.scalar_type());
-            coll_args.buffer_info.dst_buffer        = outputTensor.data_ptr();
-            coll_args.buffer_info.dst_displacements = recv_offsets;
-            coll_args.buffer_info.dst_counts        = recv_lengths;
-            coll_args.buffer_info.dst_datatype      = xccl_type_map.at(outputTensor.scalar_type());
-            coll_args.alg.set_by_user               = 0;
-            coll_args.tag                           = 123;
-        }
 
-        xccl_collective_init(&coll_args, &request, xccl_comm->xccl_team);
-        xccl_collective_post(request);
-
-        req->args = coll_args;
-        req->req  = request;
-        return req;
+    auto req = std::make_shared<ProcessGroupUCC::WorkUCC>();
+    xccl_coll_req_h     request;
+    xccl_coll_op_args_t coll_args;
+
+    if (!alltoallv) {
+        coll_args.coll_type              = XCCL_ALLTOALL;
+        coll_args.buffer_info.src_buffer = inputTensor.data_ptr();
+        coll_args.buffer_info.dst_buffer = outputTensor.data_ptr();
+        coll_args.buffer_info.len        = block_len;
+        coll_args.alg.set_by_user        = 0;
+        coll_args.tag                    = 123;
+    } else {
+        req->scratch.resize(4 * size_);
+        uint32_t *send_lengths = req->scratch.data();
+        uint32_t *recv_lengths = (uint32_t*)((ptrdiff_t)send_lengths + 1*size_*sizeof(uint32_t));
+        uint32_t *send_offsets = (uint32_t*)((ptrdiff_t)send_lengths + 2*size_*sizeof(uint32_t));
+        uint32_t *recv_offsets = (uint32_t*)((ptrdiff_t)send_lengths + 3*size_*sizeof(uint32_t));
+
+        computeLengthsAndOffsets(size_, inputSplitSizes, inputTensor, send_lengths, send_offsets);
+        computeLengthsAndOffsets(size_, outputSplitSizes, outputTensor, recv_lengths, recv_offsets);
+
+        coll_args.coll_type                     = XCCL_ALLTOALLV;
+        coll_args.buffer_info.src_buffer        = inputTensor.data_ptr();
+        coll_args.buffer_info.src_displacements = send_offsets;
+        coll_args.buffer_info.src_counts        = send_lengths;
+        coll_args.buffer_info.src_datatype      = xccl_type_map.at(inputTensor.scalar_type());
+        coll_args.buffer_info.dst_buffer        = outputTensor.data_ptr();
+        coll_args.buffer_info.dst_displacements = recv_offsets;
+        coll_args.buffer_info.dst_counts        = recv_lengths;
+        coll_args.buffer_info.dst_datatype      = xccl_type_map.at(outputTensor.scalar_type());
+        coll_args.alg.set_by_user               = 0;
+        coll_args.tag                           = 123;
     }
 
-    throw std::runtime_error("ProcessGroupUCC: no collective backends");
+    xccl_collective_init(&coll_args, &request, xccl_comm->xccl_team);
+    xccl_collective_post(request);
+
+    req->args = coll_args;
+    req->req  = request;
+    return req;
 }
 
 std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::alltoall(std::vector<at::Tensor>& outputTensors,
@@ -488,6 +1267,13 @@ std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::send(std::vector<at::Tensor
     torch_ucx_request_t *req;
     torch_ucx_status_t  st;
 
+    RECORD_FUNCTION("ucc:send", std::vector<c10::IValue>({tensor}));
+    if (recorder) {
+        torch_ucc_record(recorder, "send", &tensor, NULL, dstRank, tag);
+    }
+    torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_SEND,
+                            size);
+    flush_fusion();
     st = torch_ucx_send_nb(ucx_comm, tensor.data_ptr(), size, dstRank,
                            tag, &req, TORCH_UCX_P2P_TAG);
     if (st < 0) {
@@ -506,19 +1292,106 @@ std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::recv(std::vector<at::Tensor
     torch_ucx_request_t *req;
     torch_ucx_status_t  st;
 
+    RECORD_FUNCTION("ucc:recv", std::vector<c10::IValue>({tensor}));
+    if (recorder) {
+        torch_ucc_record(recorder, "recv", &tensor, NULL, srcRank, tag);
+    }
+    torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_RECV,
+                            size);
+    flush_fusion();
     st = torch_ucx_recv_nb(ucx_comm, tensor.data_ptr(), size, srcRank,
                            tag, &req, TORCH_UCX_P2P_TAG);
     if (st < 0) {
        throw std::runtime_error("TorchUCC: failed to recv msg");
     }
 
-    return std::make_shared<ProcessGroupUCC::WorkUCX>(req, ucx_comm);
+    return std::make_shared<ProcessGroupUCC::WorkUCX>(req, ucx_comm, srcRank);
 }
 
 std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::recvAnysource(std::vector<at::Tensor>& tensors,
                                                                    int tag)
 {
-    throw std::runtime_error("TorchUCC: recvAnysource is not supported");
+    auto   &tensor = tensors[0];
+    size_t size    = tensor.numel() * tensor.element_size();
+    torch_ucx_request_t *req;
+    torch_ucx_status_t  st;
+
+    RECORD_FUNCTION("ucc:recv_anysource", std::vector<c10::IValue>({tensor}));
+    if (recorder) {
+        torch_ucc_record(recorder, "recv", &tensor, NULL, TORCH_UCX_ANY_SOURCE,
+                         tag);
+    }
+    torch_ucx_metrics_count(&ucx_coll_comm->metrics, TORCH_UCX_METRICS_RECV,
+                            size);
+    flush_fusion();
+    st = torch_ucx_recv_nb(ucx_comm, tensor.data_ptr(), size,
+                           TORCH_UCX_ANY_SOURCE, tag, &req, TORCH_UCX_P2P_TAG);
+    if (st < 0) {
+       throw std::runtime_error("TorchUCC: failed to recv msg");
+    }
+
+    return std::make_shared<ProcessGroupUCC::WorkUCX>(req, ucx_comm);
+}
+
+std::shared_ptr<ProcessGroup::Work> ProcessGroupUCC::batch_isend_irecv(std::vector<at::Tensor>& tensors,
+                                                                       const std::vector<int>& peers,
+                                                                       const std::vector<bool>& is_send,
+                                                                       int tag)
+{
+    auto work = std::make_shared<ProcessGroupUCC::WorkUCXBatch>(ucx_comm);
+    torch_ucx_status_t st;
+
+    RECORD_FUNCTION("ucc:batch_isend_irecv",
+                    std::vector<c10::IValue>(tensors.begin(), tensors.end()));
+    if ((peers.size() != tensors.size()) || (is_send.size() != tensors.size())) {
+        throw std::runtime_error("ProcessGroupUCC: batch_isend_irecv needs a "
+                                 "peer and a direction per tensor");
+    }
+    flush_fusion();
+    work->reqs.reserve(tensors.size());
+    /* receives first so that the sends of the peers find them posted */
+    try {
+        for (bool send: {false, true}) {
+            for (size_t i = 0; i < tensors.size(); i++) {
+                auto                &tensor = tensors[i];
+                size_t              size    = tensor.numel() * tensor.element_size();
+                torch_ucx_request_t *req;
+
+                if (is_send[i] != send) {
+                    continue;
+                }
+                if (recorder) {
+                    torch_ucc_record(recorder, send ? "send" : "recv", &tensor,
+                                     NULL, peers[i], tag);
+                }
+                torch_ucx_metrics_count(&ucx_coll_comm->metrics,
+                                        send ? TORCH_UCX_METRICS_SEND :
+                                               TORCH_UCX_METRICS_RECV, size);
+                if (send) {
+                    st = torch_ucx_send_nb(ucx_comm, tensor.data_ptr(), size,
+                                           peers[i], tag, &req, TORCH_UCX_P2P_TAG);
+                } else {
+                    st = torch_ucx_recv_nb(ucx_comm, tensor.data_ptr(), size,
+                                           peers[i], tag, &req, TORCH_UCX_P2P_TAG);
+                }
+                if (st < 0) {
+                    throw std::runtime_error("TorchUCC: failed to post batched p2p");
+                }
+                work->reqs.push_back(req);
+            }
+        }
+    } catch (...) {
+        /* ucp still owns what was posted, sends it can't cancel are kept
+         * on the comm until close */
+        for (auto req: work->reqs) {
+            if (req != NULL) {
+                torch_ucx_request_cancel(ucx_comm, req);
+            }
+        }
+        work->reqs.clear();
+        throw;
+    }
+    return work;
 }
 
 std::shared_ptr<ProcessGroup> ProcessGroupUCC::createProcessGroupUCC(
@@ -526,11 +1399,37 @@ std::shared_ptr<ProcessGroup> ProcessGroupUCC::createProcessGroupUCC(
     int rank,
     int size,
     const std::chrono::duration<float>& timeout) {
-  return std::make_shared<ProcessGroupUCC>(store, rank, size);
+  return std::make_shared<ProcessGroupUCC>(
+      store, rank, size,
+      std::chrono::duration_cast<std::chrono::milliseconds>(timeout));
 }
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
   m.def("createProcessGroupUCC", &ProcessGroupUCC::createProcessGroupUCC);
+  m.def("set_reduce_scaling", [](const std::shared_ptr<ProcessGroup>& pg,
+                                 double pre_scale, bool average) {
+      get_ucc_pg(pg)->set_reduce_scaling(pre_scale, average);
+  }, py::arg("pg"), py::arg("pre_scale") = 1.0, py::arg("average") = false);
+  m.def("dump_trace", &ProcessGroupUCC::dump_trace, py::arg("rank"));
+  m.def("get_metrics", [](const std::shared_ptr<ProcessGroup>& pg) {
+      return get_ucc_pg(pg)->get_metrics();
+  });
+  m.def("reset_metrics", [](const std::shared_ptr<ProcessGroup>& pg) {
+      get_ucc_pg(pg)->reset_metrics();
+  });
+  m.def("set_priority", [](const std::shared_ptr<ProcessGroup>& pg, int level) {
+      return get_ucc_pg(pg)->set_priority(level);
+  }, py::arg("pg"), py::arg("level"));
+  m.def("flush_fusion", [](const std::shared_ptr<ProcessGroup>& pg) {
+      get_ucc_pg(pg)->flush_fusion();
+  }, py::arg("pg"));
+  m.def("batch_isend_irecv", [](const std::shared_ptr<ProcessGroup>& pg,
+                                std::vector<at::Tensor> tensors,
+                                const std::vector<int>& peers,
+                                const std::vector<bool>& is_send, int tag) {
+      return get_ucc_pg(pg)->batch_isend_irecv(tensors, peers, is_send, tag);
+  }, py::arg("pg"), py::arg("tensors"), py::arg("peers"), py::arg("is_send"),
+     py::arg("tag") = 0);
 }
 
 } // namespace c10d
@@ -8,6 +8,7 @@
 
 #include <torch/extension.h>
 
+#include <atomic>
 #include <deque>
 #include <exception>
 #include <memory>
@@ -25,8 +26,11 @@
 #include <ucp/api/ucp.h>
 #include <api/xccl.h>
 
+#include "torch_ucc_dispatch.hpp"
+#include "torch_ucc_record.hpp"
 #include "torch_ucc_sendrecv.hpp"
 #include "torch_ucx_coll.hpp"
+#include "torch_ucx_sparse.hpp"
 #include "torch_xccl.hpp"
 
 namespace c10d {
@@ -35,27 +39,47 @@ class ProcessGroupUCC : public ProcessGroup {
  public:
     class WorkUCX: public ProcessGroup::Work {
     public:
-        WorkUCX(torch_ucx_request_t *request, torch_ucx_comm_t *ucx_comm):
-            req(request), comm(ucx_comm) {}
+        WorkUCX(torch_ucx_request_t *request, torch_ucx_comm_t *ucx_comm,
+                int source = -1):
+            req(request), comm(ucx_comm), src_rank(source),
+            start_ns(torch_ucx_metrics_now()) {}
         virtual ~WorkUCX();
         bool isCompleted() override;
-        bool isSuccess() const override;
         bool wait() override;
+        int sourceRank() const override;
     protected:
         torch_ucx_request_t *req;
         torch_ucx_comm_t    *comm;
+        /* peer of a receive, known after completion for any source */
+        int                 src_rank;
+        uint64_t            start_ns;
+        friend class ProcessGroupUCC;
+    };
+
+    /* Sends and receives posted together, completed as one */
+    class WorkUCXBatch: public ProcessGroup::Work {
+    public:
+        WorkUCXBatch(torch_ucx_comm_t *ucx_comm):
+            comm(ucx_comm), result(UCS_OK), start_ns(torch_ucx_metrics_now()) {}
+        virtual ~WorkUCXBatch();
+        bool isCompleted() override;
+        bool wait() override;
+    protected:
+        std::vector<torch_ucx_request_t*> reqs;
+        torch_ucx_comm_t                  *comm;
+        ucs_status_t                      result;
+        uint64_t                          start_ns;
         friend class ProcessGroupUCC;
     };
 
     class WorkUCXColl: public ProcessGroup::Work {
     public:
         WorkUCXColl() {
-            req = new torch_ucx_coll_request_t;
+            req = new torch_ucx_coll_request_t();
             no_progress = false;
         }
         virtual ~WorkUCXColl();
         bool isCompleted() override;
-        bool isSuccess() const override;
         bool wait() override;
     protected:
         bool                     no_progress;
@@ -63,14 +87,34 @@ class ProcessGroupUCC : public ProcessGroup {
         friend class ProcessGroupUCC;
     };
 
+    /* Sparse allreduce/allgather, the outputs are assembled in wait() */
+    class WorkUCXSparse: public WorkUCXColl {
+    public:
+        WorkUCXSparse() {
+            req->sparse = &sparse;
+            finished    = false;
+            scale       = 1.0;
+        }
+        bool wait() override;
+    protected:
+        torch_ucx_sparse_t      sparse;
+        bool                    finished;
+        double                  scale;
+        at::Tensor              input;
+        at::Tensor              indices;
+        at::Tensor              values;
+        /* allgather outputs, empty for allreduce */
+        std::vector<at::Tensor> outputs;
+        friend class ProcessGroupUCC;
+    };
+
   class WorkUCC : public ProcessGroup::Work {
    public:
-    WorkUCC(xccl_coll_req_h request): req(request){}
-    WorkUCC(){}
+    WorkUCC(xccl_coll_req_h request): req(request), post_scale(1.0) {}
+    WorkUCC(): post_scale(1.0) {}
 
     virtual ~WorkUCC();
     bool isCompleted() override;
-    bool isSuccess() const override;
     bool wait() override;
 
    protected:
@@ -79,13 +123,54 @@ class ProcessGroupUCC : public ProcessGroup {
     std::vector<uint32_t>   scratch;
     std::vector<at::Tensor> output_data_vec;
     at::Tensor              flat_tensor;
+    /* scaled allreduce, run on a pre-scaled copy of output */
+    at::Tensor              scaled;
+    at::Tensor              output;
+    double                  post_scale;
+    void                    unpack();
     friend class ProcessGroupUCC;
   };
 
 
+  /* Small allreduces gathered into one buffer, see fuse_allreduce() */
+  struct ucc_fusion_t {
+    at::ScalarType               dtype;
+    torch_ucx_reduce_op_t        op;
+    double                       pre_scale;
+    double                       post_scale;
+    int                          priority;
+    at::Tensor                   buffer;
+    size_t                       len;
+    std::vector<at::Tensor>      tensors;
+    std::vector<size_t>          offsets;
+    /* the fused allreduce, set when the fusion is flushed */
+    std::shared_ptr<WorkUCXColl> work;
+    bool                         unpacked;
+  };
+
+  /* Polling never flushes a fusion since ranks poll at different points,
+   * isCompleted() stays false until wait() or flush_fusion() is called on
+   * every rank */
+  class WorkUCXFused : public ProcessGroup::Work {
+   public:
+    WorkUCXFused(ProcessGroupUCC *process_group,
+                 const std::shared_ptr<ucc_fusion_t>& f):
+        pg(process_group), fusion(f) {}
+    bool isCompleted() override;
+    bool wait() override;
+
+   protected:
+    ProcessGroupUCC               *pg;
+    std::shared_ptr<ucc_fusion_t> fusion;
+    void                          unpack();
+    std::shared_ptr<WorkUCXColl>  fused_work(bool flush);
+    friend class ProcessGroupUCC;
+  };
+
   explicit ProcessGroupUCC(const std::shared_ptr<Store>& store,
                            int rank = -1,
-                           int size = -1);
+                           int size = -1,
+                           std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
   virtual ~ProcessGroupUCC();
 
   std::shared_ptr<ProcessGroup::Work> broadcast(std::vector<at::Tensor>& data,
@@ -143,6 +228,30 @@ class ProcessGroupUCC : public ProcessGroup {
   std::shared_ptr<ProcessGroup::Work> recvAnysource(std::vector<at::Tensor>& tensors,
                                                     int tag);
 
+  /* Posts all receives, then all sends, is_send selects the direction of
+   * each tensor. Returns a single work for the whole batch. */
+  std::shared_ptr<ProcessGroup::Work> batch_isend_irecv(std::vector<at::Tensor>& tensors,
+                                                        const std::vector<int>& peers,
+                                                        const std::vector<bool>& is_send,
+                                                        int tag);
+
+  /* Writes the events traced so far when TORCH_UCC_TRACE is set, also
+   * done at destruction */
+  static void dump_trace(int rank);
+
+  /* Op and byte counters and latency histograms per collective, progress
+   * queue statistics and the transports of the connected endpoints */
+  py::dict get_metrics();
+  void reset_metrics();
+  /* ReduceOp has no AVG in this torch version, SUM allreduces of floating
+   * point tensors are scaled by pre_scale and averaged if average is set */
+  void set_reduce_scaling(double pre_scale, bool average);
+  /* priority of the collectives posted from now on, returns the old one */
+  int set_priority(int level);
+  /* starts the pending fused allreduce, has to be called by all ranks at
+   * the same point */
+  void flush_fusion();
+
   static std::shared_ptr<ProcessGroup> createProcessGroupUCC(
       const std::shared_ptr<::c10d::Store>& store,
       int rank,
@@ -160,24 +269,58 @@ protected:
     torch_ucx_comm_t                      *ucx_comm;
     torch_ucx_coll_comm_t                 *ucx_coll_comm;
     torch_xccl_comm_t                     *xccl_comm;
+    torch_ucc_recorder_t                  *recorder;
     std::mutex                            pg_mutex;
     std::thread                           progress_thread;
     bool                                  stop_progress_loop;
     std::deque<torch_ucx_coll_request_t*> progress_queue;
+    /* started requests the progress thread hasn't completed yet */
+    size_t                                progress_active;
     std::condition_variable               queue_produce_cv;
     std::condition_variable               queue_consume_cv;
+    std::atomic<int>                      priority;
+    std::atomic<double>                   reduce_pre_scale;
+    std::atomic<bool>                     reduce_average;
+
+    std::mutex                            fusion_mutex;
+    std::shared_ptr<ucc_fusion_t>         fusion_pending;
+    /* fusion buffers, one is reused once no fusion holds it */
+    std::vector<at::Tensor>               fusion_pool;
 
     void progress_loop();
-    void enqueue_request(torch_ucx_coll_request_t* req);
+    void enqueue_request(torch_ucx_coll_request_t* req, int priority);
+    void get_coll_config(torch_ucx_coll_type_t coll, size_t len,
+                         torch_ucx_coll_config_t *coll_config);
+    std::shared_ptr<ProcessGroup::Work> fuse_allreduce(at::Tensor& tensor,
+                                                       torch_ucx_reduce_op_t op,
+                                                       double pre_scale,
+                                                       double post_scale);
+    void flush_fusion_locked();
 private:
     struct ucc_config {
         bool enable_progress_thread;
         bool enable_xccl;
         bool enable_ucx;
+        double sparse_dense_thresh;
+        std::string record_file;
+        /* allreduces of up to fusion_tensor bytes are fused into buffers
+         * of fusion_bytes, 0 disables fusion */
+        size_t fusion_bytes;
+        size_t fusion_tensor;
+        /* while a higher priority collective is active lower ones are
+         * progressed every priority_interval rounds only */
+        int priority_interval;
+        std::vector<torch_ucc_dispatch_rule_t> dispatch_rules;
     } config;
   
     void                 read_config();
+    torch_ucc_backend_t  select_backend(torch_ucx_coll_type_t coll,
+                                        at::ScalarType dtype,
+                                        torch_ucx_memtype_t mtype, size_t len,
+                                        bool ucx_supported);
     void                 check_tensor(const std::vector<at::Tensor>& tensors);
+    std::shared_ptr<WorkUCXSparse> start_sparse(at::Tensor& tensor,
+                                                double dense_thresh);
     xccl_coll_req_h      launch_xccl_collective(xccl_collective_type_t coll,
                                            const std::vector<at::Tensor>& tensors,
                                            int root, xccl_op_t op);
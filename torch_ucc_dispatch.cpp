@@ -0,0 +1,165 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <string>
+#include "torch_ucc_dispatch.hpp"
+
+namespace c10d {
+
+static const std::map<std::string, int> dispatch_coll_names = {
+    {"alltoall",  TORCH_UCX_COLL_ALLTOALL},
+    {"allreduce", TORCH_UCX_COLL_ALLREDUCE},
+};
+
+static const std::map<std::string, int> dispatch_dtype_names = {
+    {"uint8",    (int)at::kByte},
+    {"int8",     (int)at::kChar},
+    {"int16",    (int)at::kShort},
+    {"int32",    (int)at::kInt},
+    {"int64",    (int)at::kLong},
+    {"float16",  (int)at::kHalf},
+    {"bfloat16", (int)at::kBFloat16},
+    {"float32",  (int)at::kFloat},
+    {"float64",  (int)at::kDouble},
+    {"bool",     (int)at::kBool},
+};
+
+static const std::map<std::string, int> dispatch_mtype_names = {
+    {"host", TORCH_UCX_HOST},
+    {"cuda", TORCH_UCX_CUDA},
+};
+
+static const std::map<std::string, int> dispatch_backend_names = {
+    {"ucx",  TORCH_UCC_BACKEND_UCX},
+    {"xccl", TORCH_UCC_BACKEND_XCCL},
+};
+
+static bool dispatch_parse_field(const std::string &field,
+                                 const std::map<std::string, int> &names,
+                                 int *value)
+{
+    if (field.empty() || (field == "*")) {
+        *value = TORCH_UCC_DISPATCH_ANY;
+        return true;
+    }
+    auto it = names.find(field);
+    if (it == names.end()) {
+        return false;
+    }
+    *value = it->second;
+    return true;
+}
+
+/* Plain number of bytes with an optional k, m or g suffix */
+static bool dispatch_parse_size(const std::string &field, size_t dflt,
+                                size_t *value)
+{
+    char *end;
+
+    if (field.empty()) {
+        *value = dflt;
+        return true;
+    }
+    *value = std::strtoull(field.c_str(), &end, 10);
+    switch (*end) {
+    case 'k': case 'K': *value <<= 10; end++; break;
+    case 'm': case 'M': *value <<= 20; end++; break;
+    case 'g': case 'G': *value <<= 30; end++; break;
+    default: break;
+    }
+    return (end != field.c_str()) && (*end == '\0');
+}
+
+static bool dispatch_parse_rule(const std::string &text,
+                                torch_ucc_dispatch_rule_t *rule)
+{
+    size_t                   eq = text.find('=');
+    std::vector<std::string> fields;
+    std::string              field;
+    int                      backend;
+    size_t                   dash;
+
+    if (eq == std::string::npos) {
+        return false;
+    }
+    std::istringstream match(text.substr(0, eq));
+    while (std::getline(match, field, ':')) {
+        fields.push_back(field);
+    }
+    /* trailing fields may be left out, extra ones are an error */
+    if (fields.size() > 4) {
+        return false;
+    }
+    fields.resize(4);
+    if (!dispatch_parse_field(fields[0], dispatch_coll_names, &rule->coll) ||
+        !dispatch_parse_field(fields[1], dispatch_dtype_names, &rule->dtype) ||
+        !dispatch_parse_field(fields[2], dispatch_mtype_names, &rule->mtype) ||
+        !dispatch_parse_field(text.substr(eq + 1), dispatch_backend_names,
+                              &backend) ||
+        (backend == TORCH_UCC_DISPATCH_ANY)) {
+        return false;
+    }
+    rule->backend = static_cast<torch_ucc_backend_t>(backend);
+
+    if (fields[3].empty() || (fields[3] == "*")) {
+        rule->min_len = 0;
+        rule->max_len = SIZE_MAX;
+        return true;
+    }
+    dash = fields[3].find('-');
+    if (dash == std::string::npos) {
+        return false;
+    }
+    return dispatch_parse_size(fields[3].substr(0, dash), 0, &rule->min_len) &&
+           dispatch_parse_size(fields[3].substr(dash + 1), SIZE_MAX,
+                               &rule->max_len);
+}
+
+torch_ucx_status_t torch_ucc_dispatch_parse(const char *spec,
+                                            std::vector<torch_ucc_dispatch_rule_t> *rules)
+{
+    std::istringstream        in(spec);
+    std::string               text;
+    torch_ucc_dispatch_rule_t rule;
+
+    while (std::getline(in, text, ';')) {
+        if (text.empty()) {
+            continue;
+        }
+        if (!dispatch_parse_rule(text, &rule)) {
+            fprintf(stderr, "TorchUCC: invalid dispatch rule: %s\n",
+                    text.c_str());
+            return TORCH_UCX_ERROR;
+        }
+        rules->push_back(rule);
+    }
+    return TORCH_UCX_OK;
+}
+
+static inline bool dispatch_field_match(int field, int value)
+{
+    return (field == TORCH_UCC_DISPATCH_ANY) || (field == value);
+}
+
+void torch_ucc_dispatch_match(const std::vector<torch_ucc_dispatch_rule_t> &rules,
+                              torch_ucx_coll_type_t coll, at::ScalarType dtype,
+                              torch_ucx_memtype_t mtype, size_t len,
+                              std::vector<torch_ucc_backend_t> *backends)
+{
+    for (auto &rule: rules) {
+        if (dispatch_field_match(rule.coll, coll) &&
+            dispatch_field_match(rule.dtype, (int)dtype) &&
+            dispatch_field_match(rule.mtype, mtype) &&
+            (len >= rule.min_len) && (len <= rule.max_len)) {
+            backends->push_back(rule.backend);
+        }
+    }
+}
+
+}
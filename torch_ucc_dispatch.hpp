@@ -0,0 +1,49 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include <torch/extension.h>
+
+#include <vector>
+
+#include "torch_ucx_coll.hpp"
+
+namespace c10d {
+
+enum torch_ucc_backend_t {
+    TORCH_UCC_BACKEND_UCX,
+    TORCH_UCC_BACKEND_XCCL
+};
+
+#define TORCH_UCC_DISPATCH_ANY (-1)
+
+/* A call matches a rule if every field is either ANY or equal and its
+ * length is within [min_len, max_len]. Length is the block size for
+ * alltoall and the buffer size for allreduce. */
+struct torch_ucc_dispatch_rule_t {
+    int                 coll;
+    int                 dtype;
+    int                 mtype;
+    size_t              min_len;
+    size_t              max_len;
+    torch_ucc_backend_t backend;
+};
+
+/* Rules are separated by ';' and have the form
+ * coll[:dtype[:mem[:min-max]]]=backend, e.g.
+ * "alltoall:*:host:0-64k=ucx;alltoall=xccl". Omitted fields and '*'
+ * match anything, either bound of the size range can be left empty. */
+torch_ucx_status_t torch_ucc_dispatch_parse(const char *spec,
+                                            std::vector<torch_ucc_dispatch_rule_t> *rules);
+
+/* Appends to backends, in rule order, the backends of all matching rules */
+void torch_ucc_dispatch_match(const std::vector<torch_ucc_dispatch_rule_t> &rules,
+                              torch_ucx_coll_type_t coll, at::ScalarType dtype,
+                              torch_ucx_memtype_t mtype, size_t len,
+                              std::vector<torch_ucc_backend_t> *backends);
+
+}
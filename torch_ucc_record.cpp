@@ -0,0 +1,130 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <map>
+#include <string>
+#include "torch_ucc_record.hpp"
+
+namespace c10d {
+
+/* names as in torch, so that the replay can use getattr(torch, name) */
+static const std::map<at::ScalarType, const char*> record_dtype_names = {
+    {at::kByte,     "uint8"},
+    {at::kChar,     "int8"},
+    {at::kShort,    "int16"},
+    {at::kInt,      "int32"},
+    {at::kLong,     "int64"},
+    {at::kHalf,     "float16"},
+    {at::kBFloat16, "bfloat16"},
+    {at::kFloat,    "float32"},
+    {at::kDouble,   "float64"},
+    {at::kBool,     "bool"},
+};
+
+static const std::map<ReduceOp, const char*> record_op_names = {
+    {ReduceOp::SUM,     "sum"},
+    {ReduceOp::PRODUCT, "product"},
+    {ReduceOp::MIN,     "min"},
+    {ReduceOp::MAX,     "max"},
+    {ReduceOp::BAND,    "band"},
+    {ReduceOp::BOR,     "bor"},
+    {ReduceOp::BXOR,    "bxor"},
+};
+
+static uint64_t torch_ucc_record_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+torch_ucx_status_t torch_ucc_record_open(const char *path, int rank,
+                                         torch_ucc_recorder_t **recorder)
+{
+    std::string          file = path;
+    size_t               pos  = file.find("%d");
+    torch_ucc_recorder_t *rec;
+
+    if (pos != std::string::npos) {
+        file.replace(pos, 2, std::to_string(rank));
+    }
+    rec       = new torch_ucc_recorder_t;
+    rec->file = fopen(file.c_str(), "w");
+    if (rec->file == NULL) {
+        fprintf(stderr, "TorchUCC: failed to open record file %s\n",
+                file.c_str());
+        delete rec;
+        return TORCH_UCX_ERROR;
+    }
+    fprintf(rec->file, "# ts_us coll dtype numel row op peer tag "
+            "in_splits out_splits\n");
+    rec->start_ns = torch_ucc_record_now();
+    *recorder     = rec;
+    return TORCH_UCX_OK;
+}
+
+static void torch_ucc_record_splits(FILE *f, const std::vector<int64_t> &splits)
+{
+    const char *sep = " ";
+
+    if (splits.empty()) {
+        fprintf(f, " -");
+        return;
+    }
+    for (auto split: splits) {
+        fprintf(f, "%s%lld", sep, (long long)split);
+        sep = ",";
+    }
+}
+
+void torch_ucc_record(torch_ucc_recorder_t *recorder, const char *coll,
+                      const at::Tensor *tensor, const ReduceOp *op,
+                      int peer, int tag,
+                      const std::vector<int64_t> &in_splits,
+                      const std::vector<int64_t> &out_splits)
+{
+    uint64_t   ts    = torch_ucc_record_now() - recorder->start_ns;
+    const char *dt   = "-";
+    const char *name = "-";
+    int64_t    numel = 0;
+    int64_t    row   = 0;
+
+    if (tensor) {
+        auto it = record_dtype_names.find(tensor->scalar_type());
+
+        dt    = (it != record_dtype_names.end()) ? it->second : "uint8";
+        numel = tensor->numel();
+        row   = ((tensor->dim() > 0) && (tensor->size(0) > 0)) ?
+                numel / tensor->size(0) : 1;
+        if (it == record_dtype_names.end()) {
+            numel *= tensor->element_size();
+            row   *= tensor->element_size();
+        }
+    }
+    if (op) {
+        auto it = record_op_names.find(*op);
+
+        name = (it != record_op_names.end()) ? it->second : "sum";
+    }
+
+    std::lock_guard<std::mutex> lock(recorder->mutex);
+    fprintf(recorder->file, "%llu %s %s %lld %lld %s %d %d",
+            (unsigned long long)(ts / 1000), coll, dt, (long long)numel,
+            (long long)row, name, peer, tag);
+    torch_ucc_record_splits(recorder->file, in_splits);
+    torch_ucc_record_splits(recorder->file, out_splits);
+    fprintf(recorder->file, "\n");
+}
+
+void torch_ucc_record_close(torch_ucc_recorder_t *recorder)
+{
+    if (recorder == NULL) {
+        return;
+    }
+    fclose(recorder->file);
+    delete recorder;
+}
+
+}
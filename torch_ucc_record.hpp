@@ -0,0 +1,44 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include <torch/extension.h>
+
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include <c10d/Types.hpp>
+
+#include "torch_ucx_coll.hpp"
+
+namespace c10d {
+
+/* One line per call, fields separated by spaces:
+ *   ts_us coll dtype numel row op peer tag in_splits out_splits
+ * ts_us is the post time since the group was created, row the elements
+ * per first dimension index, peer the root or p2p peer and splits comma
+ * separated lists of first dimension sizes. Absent fields are "-". */
+struct torch_ucc_recorder_t {
+    FILE       *file;
+    std::mutex mutex;
+    uint64_t   start_ns;
+};
+
+/* Opens path, %d in it is replaced by the rank */
+torch_ucx_status_t torch_ucc_record_open(const char *path, int rank,
+                                         torch_ucc_recorder_t **recorder);
+
+void torch_ucc_record(torch_ucc_recorder_t *recorder, const char *coll,
+                      const at::Tensor *tensor, const ReduceOp *op,
+                      int peer, int tag,
+                      const std::vector<int64_t> &in_splits = {},
+                      const std::vector<int64_t> &out_splits = {});
+
+void torch_ucc_record_close(torch_ucc_recorder_t *recorder);
+
+}
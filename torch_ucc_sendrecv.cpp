@@ -4,18 +4,479 @@
  * * See file LICENSE for terms.
  * */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <thread>
 #include "torch_ucc_sendrecv.hpp"
 
 namespace c10d {
 
+static torch_ucx_ep_warmup_t torch_ucx_get_ep_warmup()
+{
+    char *env;
+
+    env = std::getenv("TORCH_UCC_UCX_EP_WARMUP");
+    if (!env) {
+        return TORCH_UCX_EP_WARMUP_NONE;
+    }
+    if (!strcmp(env, "ring")) {
+        return TORCH_UCX_EP_WARMUP_RING;
+    }
+    if (!strcmp(env, "rd")) {
+        return TORCH_UCX_EP_WARMUP_RECURSIVE_DOUBLING;
+    }
+    if (!strcmp(env, "all")) {
+        return TORCH_UCX_EP_WARMUP_ALL;
+    }
+    return TORCH_UCX_EP_WARMUP_NONE;
+}
+
+static size_t torch_ucx_get_eager_size()
+{
+#ifdef TORCH_UCX_HAVE_AM_EAGER
+    char *env;
+
+    env = std::getenv("TORCH_UCC_UCX_EAGER_SIZE");
+    if (env) {
+        return std::strtoull(env, NULL, 10);
+    }
+    return 1024;
+#else
+    return 0;
+#endif
+}
+
+static int torch_ucx_get_eager_slots()
+{
+    char *env;
+
+    env = std::getenv("TORCH_UCC_UCX_EAGER_SLOTS");
+    if (env) {
+        return std::max(std::atoi(env), 0);
+    }
+    return 16;
+}
+
 static void torch_ucx_req_init(void* request)
 {
     torch_ucx_request_t *req = static_cast<torch_ucx_request_t*>(request);
     req->status = TORCH_UCX_REQUEST_ACTIVE;
+    req->sender = -1;
+    req->eager    = NULL;
+    req->result   = UCS_OK;
+    req->peer     = -1;
+    req->watch    = NULL;
+    req->by_eager = false;
 }
 
 static void torch_ucx_req_cleanup(void* request){ }
 
+#define TORCH_UCX_AM_EAGER_ID 0
+
+struct torch_ucx_eager_msg_t {
+    ucp_tag_t         tag;
+    size_t            len;
+    /* slot of the sender, -1 if all were taken and the data is in overflow */
+    int               slot;
+    std::vector<char> overflow;
+};
+
+struct torch_ucx_eager_post_t {
+    ucp_tag_t           tag;
+    ucp_tag_t           mask;
+    void                *data;
+    size_t              len;
+    torch_ucx_request_t *req;
+};
+
+/* Messages that arrive before their receive is posted are kept in arrival
+ * order, their data is copied to one of n_slots preallocated slots of the
+ * sending peer. Slots of a peer are allocated when it sends first. */
+struct torch_ucx_eager_t {
+    std::mutex                         mutex;
+    ucp_worker_h                       worker;
+    size_t                             slot_size;
+    int                                n_slots;
+    std::vector<std::vector<char>>     slots;
+    std::vector<std::vector<int>>      free_slots;
+    std::deque<torch_ucx_eager_msg_t>  unexpected;
+    std::deque<torch_ucx_eager_post_t> posted;
+    /* p2p tag receives larger than slot_size, see torch_ucx_eager_watch */
+    std::deque<torch_ucx_eager_post_t> watched;
+    std::vector<torch_ucx_request_t*>  free_reqs;
+    /* requests handed out and not freed yet, the state outlives the comm
+     * until the last of them is freed */
+    int                                n_held;
+    bool                               closed;
+};
+
+static inline bool torch_ucx_tag_match(ucp_tag_t tag, ucp_tag_t recv_tag,
+                                       ucp_tag_t mask)
+{
+    return ((tag & mask) == (recv_tag & mask));
+}
+
+static inline int torch_ucx_tag_sender(ucp_tag_t tag)
+{
+    return (tag & TORCH_UCX_RANK_MASK) >> TORCH_UCX_RANK_BITS_OFFSET;
+}
+
+/* called with eager->mutex held */
+static torch_ucx_request_t* torch_ucx_eager_request_get(torch_ucx_eager_t *eager)
+{
+    torch_ucx_request_t *req;
+
+    if (eager->free_reqs.empty()) {
+        req           = new torch_ucx_request_t;
+        req->eager    = eager;
+        req->watch    = NULL;
+        req->by_eager = false;
+    } else {
+        req = eager->free_reqs.back();
+        eager->free_reqs.pop_back();
+    }
+    eager->n_held++;
+    req->status = TORCH_UCX_REQUEST_ACTIVE;
+    req->sender = -1;
+    req->result = UCS_OK;
+    return req;
+}
+
+void torch_ucx_eager_request_free(torch_ucx_request_t *request)
+{
+    torch_ucx_eager_t            *eager = request->eager;
+    std::unique_lock<std::mutex> lock(eager->mutex);
+
+    /* a receive released before completion must not be matched anymore */
+    if (request->status != TORCH_UCX_REQUEST_DONE) {
+        for (auto it = eager->posted.begin(); it != eager->posted.end(); ++it) {
+            if (it->req == request) {
+                eager->posted.erase(it);
+                break;
+            }
+        }
+    }
+    eager->n_held--;
+    if (eager->closed) {
+        delete request;
+        if (eager->n_held == 0) {
+            lock.unlock();
+            delete eager;
+        }
+        return;
+    }
+    request->status = TORCH_UCX_REQUEST_ACTIVE;
+    eager->free_reqs.push_back(request);
+}
+
+void torch_ucx_eager_unwatch(torch_ucx_request_t *request)
+{
+    torch_ucx_eager_t            *eager = request->watch;
+    std::unique_lock<std::mutex> lock(eager->mutex);
+
+    request->watch = NULL;
+    for (auto it = eager->watched.begin(); it != eager->watched.end(); ++it) {
+        if (it->req == request) {
+            eager->watched.erase(it);
+            break;
+        }
+    }
+    eager->n_held--;
+    if (eager->closed && (eager->n_held == 0)) {
+        lock.unlock();
+        delete eager;
+    }
+}
+
+/* called with eager->mutex held, copies the first arrived message matching
+ * the tag out of its slot */
+static bool torch_ucx_eager_take(torch_ucx_eager_t *eager, void *data,
+                                 size_t size, ucp_tag_t ucp_tag,
+                                 ucp_tag_t ucp_tag_mask, int *sender)
+{
+    const char *src;
+
+    for (auto it = eager->unexpected.begin(); it != eager->unexpected.end(); ++it) {
+        if (!torch_ucx_tag_match(it->tag, ucp_tag, ucp_tag_mask)) {
+            continue;
+        }
+        *sender = torch_ucx_tag_sender(it->tag);
+        if (it->slot >= 0) {
+            src = &eager->slots[*sender][it->slot * eager->slot_size];
+            eager->free_slots[*sender].push_back(it->slot);
+        } else {
+            src = it->overflow.data();
+        }
+        memcpy(data, src, std::min(it->len, size));
+        eager->unexpected.erase(it);
+        return true;
+    }
+    return false;
+}
+
+/* Runs from worker progress. The sender tag is the AM header, its rank
+ * bits identify the peer. */
+static ucs_status_t torch_ucx_eager_am_cb(void *arg, const void *header,
+                                          size_t header_length, void *data,
+                                          size_t length,
+                                          const ucp_am_recv_param_t *param)
+{
+    torch_ucx_eager_t     *eager = static_cast<torch_ucx_eager_t*>(arg);
+    const char            *src   = static_cast<const char*>(data);
+    torch_ucx_eager_msg_t msg;
+    ucp_tag_t             tag;
+    int                   sender;
+
+    memcpy(&tag, header, sizeof(tag));
+    sender = torch_ucx_tag_sender(tag);
+
+    std::lock_guard<std::mutex> lock(eager->mutex);
+    for (auto it = eager->posted.begin(); it != eager->posted.end(); ++it) {
+        if (!torch_ucx_tag_match(tag, it->tag, it->mask)) {
+            continue;
+        }
+        if (length > it->len) {
+            fprintf(stderr, "TorchUCC: eager message from %d truncated\n",
+                    sender);
+            length = it->len;
+        }
+        memcpy(it->data, src, length);
+        it->req->sender = sender;
+        it->req->status = TORCH_UCX_REQUEST_DONE;
+        eager->posted.erase(it);
+        return UCS_OK;
+    }
+    /* watched receives are larger than any eager message */
+    for (auto it = eager->watched.begin(); it != eager->watched.end(); ++it) {
+        if ((it->req->status == TORCH_UCX_REQUEST_DONE) ||
+            !torch_ucx_tag_match(tag, it->tag, it->mask)) {
+            continue;
+        }
+        memcpy(it->data, src, length);
+        it->req->sender   = sender;
+        it->req->by_eager = true;
+        ucp_request_cancel(eager->worker, it->req);
+        eager->watched.erase(it);
+        return UCS_OK;
+    }
+
+    if (eager->slots[sender].empty()) {
+        eager->slots[sender].resize(eager->n_slots * eager->slot_size);
+        for (int i = eager->n_slots - 1; i >= 0; i--) {
+            eager->free_slots[sender].push_back(i);
+        }
+    }
+    msg.tag = tag;
+    msg.len = length;
+    if ((length <= eager->slot_size) && !eager->free_slots[sender].empty()) {
+        msg.slot = eager->free_slots[sender].back();
+        eager->free_slots[sender].pop_back();
+        memcpy(&eager->slots[sender][msg.slot * eager->slot_size], src, length);
+    } else {
+        msg.slot = -1;
+        msg.overflow.assign(src, src + length);
+    }
+    eager->unexpected.push_back(std::move(msg));
+    return UCS_OK;
+}
+
+torch_ucx_status_t torch_ucx_eager_recv(torch_ucx_comm_t *comm, void *data,
+                                        size_t size, int src_rank,
+                                        ucp_tag_t ucp_tag,
+                                        ucp_tag_t ucp_tag_mask,
+                                        torch_ucx_request_t **req)
+{
+    torch_ucx_eager_t           *eager = comm->eager;
+    std::lock_guard<std::mutex> lock(eager->mutex);
+    torch_ucx_request_t         *r;
+    int                         sender;
+
+    if (torch_ucx_eager_take(eager, data, size, ucp_tag, ucp_tag_mask,
+                             &sender)) {
+        if (src_rank != TORCH_UCX_ANY_SOURCE) {
+            *req = NULL;
+            return TORCH_UCX_OK;
+        }
+        /* the sender of an any source receive is reported by the request */
+        r         = torch_ucx_eager_request_get(eager);
+        r->peer   = src_rank;
+        r->sender = sender;
+        r->status = TORCH_UCX_REQUEST_DONE;
+        *req      = r;
+        return TORCH_UCX_OK;
+    }
+
+    r       = torch_ucx_eager_request_get(eager);
+    r->peer = src_rank;
+    eager->posted.push_back({ucp_tag, ucp_tag_mask, data, size, r});
+    *req = r;
+    return TORCH_UCX_OK;
+}
+
+/* The ucp receive is posted before the eager ring is looked at, so an
+ * eager message is either found here or matched by the handler. The lock
+ * is not held while calling into ucp from here, the handler takes it under
+ * the worker lock. */
+void torch_ucx_eager_watch(torch_ucx_comm_t *comm, torch_ucx_request_t *req,
+                           void *data, size_t size, ucp_tag_t ucp_tag,
+                           ucp_tag_t ucp_tag_mask)
+{
+    torch_ucx_eager_t            *eager = comm->eager;
+    std::unique_lock<std::mutex> lock(eager->mutex);
+    int                          sender;
+
+    if (req->status == TORCH_UCX_REQUEST_DONE) {
+        return;
+    }
+    if (!torch_ucx_eager_take(eager, data, size, ucp_tag, ucp_tag_mask,
+                              &sender)) {
+        req->watch = eager;
+        eager->n_held++;
+        eager->watched.push_back({ucp_tag, ucp_tag_mask, data, size, req});
+        return;
+    }
+    req->sender   = sender;
+    req->by_eager = true;
+    lock.unlock();
+    ucp_request_cancel(comm->worker, req);
+}
+
+static void torch_ucx_eager_send_cb(void *request, ucs_status_t status,
+                                    void *user_data)
+{
+    torch_ucx_request_t *req = static_cast<torch_ucx_request_t*>(request);
+    req->result = status;
+    req->status = TORCH_UCX_REQUEST_DONE;
+}
+
+torch_ucx_status_t torch_ucx_eager_send(torch_ucx_comm_t *comm, ucp_ep_h ep,
+                                        void *data, size_t size, int dst_rank,
+                                        ucp_tag_t ucp_tag,
+                                        torch_ucx_request_t **req)
+{
+#ifdef TORCH_UCX_HAVE_AM_EAGER
+    ucp_request_param_t param;
+    ucs_status_ptr_t    st;
+
+    param.op_attr_mask = UCP_OP_ATTR_FIELD_CALLBACK | UCP_OP_ATTR_FIELD_FLAGS;
+    param.flags        = UCP_AM_SEND_FLAG_EAGER | UCP_AM_SEND_FLAG_COPY_HEADER;
+    param.cb.send      = torch_ucx_eager_send_cb;
+    st = ucp_am_send_nbx(ep, TORCH_UCX_AM_EAGER_ID, &ucp_tag, sizeof(ucp_tag),
+                         data, size, &param);
+    if (UCS_PTR_IS_ERR(st)) {
+        fprintf(stderr, "TorchUCC: failed to send eager message: %s\n",
+                ucs_status_string(UCS_PTR_STATUS(st)));
+        torch_ucx_comm_set_error(comm, UCS_PTR_STATUS(st), dst_rank);
+        *req = NULL;
+        return TORCH_UCX_ERROR;
+    }
+    *req = reinterpret_cast<torch_ucx_request_t*>(st);
+    if (*req != NULL) {
+        (*req)->peer = dst_rank;
+    }
+    return TORCH_UCX_OK;
+#else
+    return TORCH_UCX_ERROR;
+#endif
+}
+
+static torch_ucx_status_t torch_ucx_eager_init(torch_ucx_comm_t *comm)
+{
+#ifdef TORCH_UCX_HAVE_AM_EAGER
+    torch_ucx_eager_t      *eager = new torch_ucx_eager_t;
+    ucp_am_handler_param_t param;
+
+    eager->worker    = comm->worker;
+    eager->n_held    = 0;
+    eager->closed    = false;
+    eager->slot_size = comm->eager_size;
+    eager->n_slots   = torch_ucx_get_eager_slots();
+    eager->slots.resize(comm->size);
+    eager->free_slots.resize(comm->size);
+
+    param.field_mask = UCP_AM_HANDLER_PARAM_FIELD_ID |
+                       UCP_AM_HANDLER_PARAM_FIELD_CB |
+                       UCP_AM_HANDLER_PARAM_FIELD_ARG;
+    param.id         = TORCH_UCX_AM_EAGER_ID;
+    param.cb         = torch_ucx_eager_am_cb;
+    param.arg        = eager;
+    if (ucp_worker_set_am_recv_handler(comm->worker, &param) != UCS_OK) {
+        fprintf(stderr, "TorchUCC: failed to set eager am handler\n");
+        delete eager;
+        return TORCH_UCX_ERROR;
+    }
+    comm->eager = eager;
+#endif
+    return TORCH_UCX_OK;
+}
+
+/* Works may still hold eager requests, the state is then deleted when
+ * the last of them is freed */
+static void torch_ucx_eager_finalize(torch_ucx_comm_t *comm)
+{
+    torch_ucx_eager_t            *eager = comm->eager;
+    std::unique_lock<std::mutex> lock;
+
+    if (eager == NULL) {
+        return;
+    }
+    comm->eager = NULL;
+    lock = std::unique_lock<std::mutex>(eager->mutex);
+    for (auto req: eager->free_reqs) {
+        delete req;
+    }
+    eager->free_reqs.clear();
+    eager->posted.clear();
+    eager->watched.clear();
+    eager->closed = true;
+    if (eager->n_held == 0) {
+        lock.unlock();
+        delete eager;
+    }
+}
+
+/* Closes all created eps, all closes are posted first and completed
+ * together */
+static void torch_ucx_close_eps(torch_ucx_comm_t *comm, unsigned mode)
+{
+    std::vector<ucs_status_ptr_t> close_reqs;
+    ucs_status_ptr_t              close_req;
+    ucs_status_t                  st;
+    ucp_ep_h                      ep;
+
+    for (int i = 0; i < comm->size; i++) {
+        ep = comm->eps[i].load(std::memory_order_relaxed);
+        if (ep == NULL) {
+            continue;
+        }
+        close_req = ucp_ep_close_nb(ep, mode);
+        if (UCS_PTR_IS_ERR(close_req)) {
+            fprintf(stderr, "TorchUCC: failed to close ep %d\n", i);
+            continue;
+        }
+        if (UCS_PTR_IS_PTR(close_req)) {
+            close_reqs.push_back(close_req);
+        }
+    }
+
+    while (!close_reqs.empty()) {
+        ucp_worker_progress(comm->worker);
+        for (size_t i = 0; i < close_reqs.size();) {
+            st = ucp_request_check_status(close_reqs[i]);
+            if (st == UCS_INPROGRESS) {
+                i++;
+                continue;
+            }
+            ucp_request_free(close_reqs[i]);
+            close_reqs[i] = close_reqs.back();
+            close_reqs.pop_back();
+        }
+    }
+}
+
 torch_ucx_status_t torch_ucx_comm_init(torch_ucx_comm_t **ucx_comm,
                                        int size, int rank,
                                        const std::shared_ptr<Store>& store)
@@ -32,8 +493,13 @@ torch_ucx_status_t torch_ucx_comm_init(torch_ucx_comm_t **ucx_comm,
     ucp_worker_attr_t    worker_attr;
 
     comm = new torch_ucx_comm_t;
-    comm->rank = rank;
-    comm->size = size;
+    comm->rank       = rank;
+    comm->size       = size;
+    comm->eager      = NULL;
+    comm->eager_size = torch_ucx_get_eager_size();
+    comm->timeout_ns = 0;
+    comm->error.store(UCS_OK, std::memory_order_relaxed);
+    comm->error_peer.store(-1, std::memory_order_relaxed);
 
     st = ucp_config_read("TORCH", NULL, &config);
     if (st != UCS_OK) {
@@ -50,6 +516,9 @@ torch_ucx_status_t torch_ucx_comm_init(torch_ucx_comm_t **ucx_comm,
                                UCP_PARAM_FIELD_REQUEST_CLEANUP;
     params.request_size      = sizeof(torch_ucx_request_t);
     params.features          = UCP_FEATURE_TAG;
+    if (comm->eager_size > 0) {
+        params.features |= UCP_FEATURE_AM;
+    }
     params.estimated_num_eps = size;
     params.request_init      = torch_ucx_req_init;
     params.request_cleanup   = torch_ucx_req_cleanup;
@@ -76,6 +545,11 @@ torch_ucx_status_t torch_ucx_comm_init(torch_ucx_comm_t **ucx_comm,
         fprintf(stderr, "TorchUCC: Thread mode multi is not supported");
     }
 
+    if ((comm->eager_size > 0) &&
+        (torch_ucx_eager_init(comm) != TORCH_UCX_OK)) {
+        goto close_worker;
+    }
+
     st = ucp_worker_get_address(comm->worker, &local_addr, &local_addr_len);
     if (st != UCS_OK) {
         fprintf(stderr, "TorchUCC: failed to get ucp worker address\n");
@@ -88,27 +562,29 @@ torch_ucx_status_t torch_ucx_comm_init(torch_ucx_comm_t **ucx_comm,
                                local_addr_len);
     store->set(key, val);
     ucp_worker_release_address(comm->worker, local_addr);
-    comm->eps = new ucp_ep_h[size];
-    for(int i = 0; i < size; i++) {
-        std::vector<uint8_t> peer_addr = store->get("wa"+std::to_string(i));
-        ucp_ep_params_t      ep_params;
 
-        ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
-        ep_params.address    = reinterpret_cast<ucp_address_t*>(peer_addr.data());
-        st = ucp_ep_create(comm->worker, &ep_params, &(comm->eps[i]));
-        if (st != UCS_OK) {
-            fprintf(stderr, "TorchUCC: failed to create ucp ep\n");
-            goto close_ep;
-        }
+    comm->peer_addrs.resize(size);
+    for (int i = 0; i < size; i++) {
+        comm->peer_addrs[i] = store->get("wa" + std::to_string(i));
+    }
+    comm->eps = new std::atomic<ucp_ep_h>[size];
+    for (int i = 0; i < size; i++) {
+        comm->eps[i].store(NULL, std::memory_order_relaxed);
+    }
+    if (torch_ucx_comm_warmup(comm, torch_ucx_get_ep_warmup()) != TORCH_UCX_OK) {
+        goto close_ep;
     }
 
     *ucx_comm = comm;
     return TORCH_UCX_OK;
 
 close_ep:
+    /* peers may be gone already, don't wait for them to flush */
+    torch_ucx_close_eps(comm, UCP_EP_CLOSE_MODE_FORCE);
     delete[] comm->eps;
 close_worker:
     ucp_worker_destroy(comm->worker);
+    torch_ucx_eager_finalize(comm);
 close_ctx:
     ucp_cleanup(comm->ctx);
 free_comm:
@@ -117,46 +593,160 @@ free_comm:
     return TORCH_UCX_ERROR;
 }
 
-void torch_ucx_comm_close(torch_ucx_comm_t *comm,
-                          const std::shared_ptr<Store>& store)
+torch_ucx_status_t torch_ucx_connect_peer(torch_ucx_comm_t *comm, int peer)
 {
-    ucs_status_ptr_t close_req;
-    ucs_status_t     st;
+    std::lock_guard<std::mutex> lock(comm->ep_mutex);
+    ucp_ep_params_t             ep_params;
+    ucp_ep_h                    ep;
+    ucs_status_t                st;
 
-    if (!comm) {
-        return;
+    if (comm->eps[peer].load(std::memory_order_relaxed) != NULL) {
+        return TORCH_UCX_OK;
     }
+    ep_params.field_mask = UCP_EP_PARAM_FIELD_REMOTE_ADDRESS;
+    ep_params.address    = reinterpret_cast<ucp_address_t*>(comm->peer_addrs[peer].data());
+    st = ucp_ep_create(comm->worker, &ep_params, &ep);
+    if (st != UCS_OK) {
+        fprintf(stderr, "TorchUCC: failed to create ucp ep\n");
+        return TORCH_UCX_ERROR;
+    }
+    comm->eps[peer].store(ep, std::memory_order_release);
+    return TORCH_UCX_OK;
+}
 
-    for (int i = 0; i < comm->size; i++) {
-        close_req = ucp_ep_close_nb(comm->eps[i], UCP_EP_CLOSE_MODE_FLUSH);
-        if (UCS_PTR_IS_ERR(close_req)) {
-            return;
+torch_ucx_status_t torch_ucx_comm_warmup(torch_ucx_comm_t *comm,
+                                         torch_ucx_ep_warmup_t pattern)
+{
+    int size = comm->size;
+    int rank = comm->rank;
+    std::vector<int> peers;
+
+    switch(pattern) {
+        case TORCH_UCX_EP_WARMUP_NONE:
+            break;
+        case TORCH_UCX_EP_WARMUP_RING:
+            peers.push_back((rank + 1) % size);
+            peers.push_back((rank - 1 + size) % size);
+            break;
+        case TORCH_UCX_EP_WARMUP_RECURSIVE_DOUBLING:
+            for (int dist = 1; dist < size; dist <<= 1) {
+                if ((rank ^ dist) < size) {
+                    peers.push_back(rank ^ dist);
+                }
+            }
+            break;
+        case TORCH_UCX_EP_WARMUP_ALL:
+            for (int i = 0; i < size; i++) {
+                peers.push_back(i);
+            }
+            break;
+    }
+
+    for (auto peer: peers) {
+        if (torch_ucx_connect_peer(comm, peer) != TORCH_UCX_OK) {
+            return TORCH_UCX_ERROR;
         }
-        if (UCS_PTR_IS_PTR(close_req)) {
-            do {
-                ucp_worker_progress(comm->worker);
-                st = ucp_request_check_status(close_req);
-            } while (st != UCS_OK);
-                ucp_request_free(close_req);
+    }
+    return TORCH_UCX_OK;
+}
+
+torch_ucx_status_t torch_ucx_ep_info(torch_ucx_comm_t *comm, int peer,
+                                     std::string *info)
+{
+    std::lock_guard<std::mutex> lock(comm->ep_mutex);
+    char                        *buf  = NULL;
+    size_t                      len   = 0;
+    FILE                        *f;
+    size_t                      pos, end;
+    std::string                 text;
+
+    if (comm->eps[peer].load(std::memory_order_relaxed) == NULL) {
+        return TORCH_UCX_ERROR;
+    }
+    f = open_memstream(&buf, &len);
+    if (f == NULL) {
+        return TORCH_UCX_ERROR;
+    }
+    ucp_ep_print_info(comm->eps[peer].load(std::memory_order_relaxed), f);
+    fclose(f);
+    text = std::string(buf, len);
+    free(buf);
+
+    /* keep the lane lines only, they name the transport and device */
+    info->clear();
+    for (pos = 0; pos < text.size(); pos = end + 1) {
+        end = text.find('\n', pos);
+        if (end == std::string::npos) {
+            end = text.size();
         }
+        if (text.find("lane[", pos) < end) {
+            info->append(text, pos, end - pos + 1);
+        }
+    }
+    if (info->empty()) {
+        *info = text;
     }
+    return TORCH_UCX_OK;
+}
 
-    auto key = "close" + std::to_string(comm->rank);
-    auto val = std::vector<uint8_t>{0xFF};
-    store->set(key, val);
-    std::vector<std::string> peer_keys(comm->size);
+static int torch_ucx_get_close_timeout()
+{
+    char *env;
 
-    for (int i = 0; i < comm->size; i++) {
-        peer_keys[i] = "close" + std::to_string(i);
+    env = std::getenv("TORCH_UCC_UCX_CLOSE_TIMEOUT");
+    if (env) {
+        return std::atoi(env);
     }
-    try {
-        store->wait(peer_keys, std::chrono::milliseconds(100));
+    return 1000;
+}
+
+/* Counter based barrier: every rank bumps one key and the last one to
+ * arrive publishes the release key, so the store sees O(N) operations
+ * instead of every rank waiting on every other rank's key. The worker is
+ * progressed while waiting so that peers can finish flushing to us. */
+static void torch_ucx_close_barrier(torch_ucx_comm_t *comm,
+                                    const std::shared_ptr<Store>& store,
+                                    int timeout_ms)
+{
+    std::vector<std::string> done_key = {"close_done"};
+    int                      sleep_us = 1;
+
+    if (store->add("close_cnt", 1) == comm->size) {
+        store->set(done_key[0], std::vector<uint8_t>{0xFF});
+        return;
     }
-    catch(...) {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(timeout_ms);
+    while (!store->check(done_key)) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            fprintf(stderr, "TorchUCC: rank %d timed out in close barrier\n",
+                    comm->rank);
+            return;
+        }
+        while (ucp_worker_progress(comm->worker)) {}
+        std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+        sleep_us = std::min(sleep_us * 2, 16000);
+    }
+}
+
+void torch_ucx_comm_close(torch_ucx_comm_t *comm,
+                          const std::shared_ptr<Store>& store)
+{
+    if (!comm) {
+        return;
+    }
+
+    torch_ucx_close_eps(comm, UCP_EP_CLOSE_MODE_FLUSH);
+    torch_ucx_close_barrier(comm, store, torch_ucx_get_close_timeout());
+
+    /* ucp releases requests still in flight once they complete */
+    for (auto req: comm->cancelled) {
+        torch_ucx_request_free(req);
     }
 
     delete[] comm->eps;
     ucp_worker_destroy(comm->worker);
+    torch_ucx_eager_finalize(comm);
     ucp_cleanup(comm->ctx);
     delete comm;
 }
@@ -164,12 +754,21 @@ void torch_ucx_comm_close(torch_ucx_comm_t *comm,
 void torch_ucx_send_cmpl_cb(void* request, ucs_status_t status)
 {
   torch_ucx_request_t *req = static_cast<torch_ucx_request_t*>(request);
+  req->result = status;
   req->status = TORCH_UCX_REQUEST_DONE;
 }
 
 void torch_ucx_recv_cmpl_cb(void* request, ucs_status_t status, ucp_tag_recv_info_t *info)
 {
   torch_ucx_request_t *req = static_cast<torch_ucx_request_t*>(request);
+  if (req->by_eager) {
+    req->result = UCS_OK;
+    req->status = TORCH_UCX_REQUEST_DONE;
+    return;
+  }
+  req->sender = (info->sender_tag & TORCH_UCX_RANK_MASK) >>
+                TORCH_UCX_RANK_BITS_OFFSET;
+  req->result = status;
   req->status = TORCH_UCX_REQUEST_DONE;
 }
 }
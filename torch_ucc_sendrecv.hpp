@@ -6,7 +6,11 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <string.h>
 #include <inttypes.h>
 
@@ -39,6 +43,14 @@ namespace c10d {
 #define TORCH_UCX_P2P_TAG_MASK (TORCH_UCX_MAX_P2P_TAG << TORCH_UCX_P2P_TAG_BITS_OFFSET)
 #define TORCH_UCX_OOB_TAG_MASK (TORCH_UCX_MAX_OOB_TAG << TORCH_UCX_OOB_TAG_BITS_OFFSET)
 
+/* src_rank of a receive that matches any sender */
+#define TORCH_UCX_ANY_SOURCE (-1)
+
+/* Active message eager path needs header copy on send */
+#if UCP_API_VERSION >= UCP_VERSION(1, 13)
+#define TORCH_UCX_HAVE_AM_EAGER 1
+#endif
+
 
 #define TORCH_UCX_MAKE_P2P_TAG(_tag, _rank)                    \
     ((((uint64_t) (_tag))  << TORCH_UCX_P2P_TAG_BITS_OFFSET) | \
@@ -96,26 +108,124 @@ enum torch_ucx_request_status_t {
     TORCH_UCX_REQUEST_DONE,
 };
 
+struct torch_ucx_eager_t;
+
 struct torch_ucx_request_t {
     torch_ucx_request_status_t status;
+    /* rank the message came from, set when a receive completes */
+    int                        sender;
+    /* set for eager receives, these are not allocated by ucp */
+    torch_ucx_eager_t          *eager;
+    /* status passed to the completion callback */
+    ucs_status_t               result;
+    /* peer the request was posted to, -1 for any source */
+    int                        peer;
+    /* set for p2p tag receives an eager message may complete instead */
+    torch_ucx_eager_t          *watch;
+    /* the receive was completed by an eager message, the cancel of the ucp
+     * receive is not a failure */
+    bool                       by_eager;
+};
+
+enum torch_ucx_ep_warmup_t {
+    TORCH_UCX_EP_WARMUP_NONE,
+    TORCH_UCX_EP_WARMUP_RING,
+    TORCH_UCX_EP_WARMUP_RECURSIVE_DOUBLING,
+    TORCH_UCX_EP_WARMUP_ALL
 };
 
 struct torch_ucx_comm_t {
-    int           size;
-    int           rank;
-    ucp_context_h ctx;
-    ucp_ep_h      *eps;
-    ucp_worker_h  worker;
-    uint32_t      tag;
+    int                               size;
+    int                               rank;
+    ucp_context_h                     ctx;
+    /* set once under ep_mutex, read without it */
+    std::atomic<ucp_ep_h>             *eps;
+    ucp_worker_h                      worker;
+    uint32_t                          tag;
+    /* worker addresses of all peers, eps are created from them on first use */
+    std::vector<std::vector<uint8_t>> peer_addrs;
+    std::mutex                        ep_mutex;
+    /* p2p and coll messages up to eager_size bytes are sent as active
+     * messages, NULL if the eager path is disabled */
+    torch_ucx_eager_t                 *eager;
+    size_t                            eager_size;
+    /* operations not completed within timeout_ns are cancelled, 0 waits
+     * forever */
+    uint64_t                          timeout_ns;
+    /* first failed operation, the comm is not usable after it. Set from
+     * completion callbacks, error_peer is stored after error. */
+    std::atomic<ucs_status_t>         error;
+    std::atomic<int>                  error_peer;
+    /* requests ucp could not cancel, freed at close */
+    std::mutex                        cancel_mutex;
+    std::vector<torch_ucx_request_t*> cancelled;
 };
 
+void torch_ucx_eager_request_free(torch_ucx_request_t *request);
+
+void torch_ucx_eager_unwatch(torch_ucx_request_t *request);
 
 static inline void torch_ucx_request_free(torch_ucx_request_t *request)
 {
-    request->status = TORCH_UCX_REQUEST_ACTIVE;
+    if (request->eager) {
+        torch_ucx_eager_request_free(request);
+        return;
+    }
+    if (request->watch) {
+        torch_ucx_eager_unwatch(request);
+    }
+    request->by_eager = false;
+    request->status   = TORCH_UCX_REQUEST_ACTIVE;
+    request->result = UCS_OK;
+    request->sender = -1;
     ucp_request_free(request);
 }
 
+static inline void torch_ucx_comm_set_error(torch_ucx_comm_t *comm,
+                                            ucs_status_t status, int peer)
+{
+    ucs_status_t expected = UCS_OK;
+
+    if (comm->error.compare_exchange_strong(expected, status,
+                                            std::memory_order_acq_rel)) {
+        comm->error_peer.store(peer, std::memory_order_release);
+    }
+}
+
+/* Frees a completed request, a failure is kept on the comm. Cancelled
+ * requests are not failures, they are cancelled after one. */
+static inline void torch_ucx_request_release(torch_ucx_comm_t *comm,
+                                             torch_ucx_request_t *request)
+{
+    if ((request->result != UCS_OK) && (request->result != UCS_ERR_CANCELED)) {
+        torch_ucx_comm_set_error(comm, request->result, request->peer);
+    }
+    torch_ucx_request_free(request);
+}
+
+/* Cancels a request, the caller must not use it afterwards. Sends can't
+ * be cancelled by ucp, such requests are kept in flight on the comm and
+ * freed when it is closed. */
+static inline void torch_ucx_request_cancel(torch_ucx_comm_t *comm,
+                                            torch_ucx_request_t *request)
+{
+    if (request->eager) {
+        torch_ucx_request_free(request);
+        return;
+    }
+    if (request->status != TORCH_UCX_REQUEST_DONE) {
+        ucp_request_cancel(comm->worker, request);
+        ucp_worker_progress(comm->worker);
+    }
+    if (request->status != TORCH_UCX_REQUEST_DONE) {
+        std::lock_guard<std::mutex> lock(comm->cancel_mutex);
+
+        comm->cancelled.push_back(request);
+        return;
+    }
+    torch_ucx_request_free(request);
+}
+
 void torch_ucx_send_cmpl_cb(void* request, ucs_status_t status);
 void torch_ucx_recv_cmpl_cb(void* request, ucs_status_t status,
                             ucp_tag_recv_info_t *info);
@@ -128,6 +238,59 @@ void
 torch_ucx_comm_close(torch_ucx_comm_t *comm,
                      const std::shared_ptr<Store>& store);
 
+torch_ucx_status_t
+torch_ucx_connect_peer(torch_ucx_comm_t *comm, int peer);
+
+torch_ucx_status_t
+torch_ucx_comm_warmup(torch_ucx_comm_t *comm, torch_ucx_ep_warmup_t pattern);
+
+/* Transport lanes selected for the endpoint to peer as printed by
+ * ucp_ep_print_info, fails if the peer is not connected yet */
+torch_ucx_status_t
+torch_ucx_ep_info(torch_ucx_comm_t *comm, int peer, std::string *info);
+
+static inline ucp_ep_h
+torch_ucx_get_ep(torch_ucx_comm_t *comm, int peer)
+{
+    ucp_ep_h ep = comm->eps[peer].load(std::memory_order_acquire);
+
+    if (ep == NULL) {
+        torch_ucx_connect_peer(comm, peer);
+        ep = comm->eps[peer].load(std::memory_order_acquire);
+    }
+    return ep;
+}
+
+/* Eager sends complete in place unless the transport is out of resources,
+ * eager receives take an already arrived message out of the per-peer ring
+ * without a request. The message size selects the path, collectives use
+ * the same size on both sides. */
+torch_ucx_status_t
+torch_ucx_eager_send(torch_ucx_comm_t *comm, ucp_ep_h ep, void *data,
+                     size_t size, int dst_rank, ucp_tag_t ucp_tag,
+                     torch_ucx_request_t **req);
+
+torch_ucx_status_t
+torch_ucx_eager_recv(torch_ucx_comm_t *comm, void *data, size_t size,
+                     int src_rank, ucp_tag_t ucp_tag, ucp_tag_t ucp_tag_mask,
+                     torch_ucx_request_t **req);
+
+/* A p2p receive larger than eager_size may be matched by a smaller send
+ * that went eager. Its tag receive is then completed by the eager message
+ * and the ucp receive is cancelled. */
+void
+torch_ucx_eager_watch(torch_ucx_comm_t *comm, torch_ucx_request_t *req,
+                      void *data, size_t size, ucp_tag_t ucp_tag,
+                      ucp_tag_t ucp_tag_mask);
+
+static inline bool
+torch_ucx_use_eager(torch_ucx_comm_t *comm, size_t size,
+                    torch_ucx_tag_type_t type)
+{
+    return (comm->eager != NULL) && (size <= comm->eager_size) &&
+           (type != TORCH_UCX_OOB_TAG);
+}
+
 static inline torch_ucx_status_t
 torch_ucx_send_nb(torch_ucx_comm_t *comm,
                   void *data, size_t size, int dst_rank,
@@ -139,7 +302,10 @@ torch_ucx_send_nb(torch_ucx_comm_t *comm,
     ucp_ep_h         ep;
     ucs_status_ptr_t st;
 
-    ep = comm->eps[dst_rank];
+    ep = torch_ucx_get_ep(comm, dst_rank);
+    if (ep == NULL) {
+        return TORCH_UCX_ERROR;
+    }
     dt = ucp_dt_make_contig(size);
     switch(type) {
         case TORCH_UCX_COLL_TAG:
@@ -154,10 +320,23 @@ torch_ucx_send_nb(torch_ucx_comm_t *comm,
         default:
             return TORCH_UCX_ERROR;
     };
+    if (torch_ucx_use_eager(comm, size, type)) {
+        return torch_ucx_eager_send(comm, ep, data, size, dst_rank, ucp_tag,
+                                    req);
+    }
     //fprintf(stderr, "rank %d send tag %" PRIu64 "\n", comm->rank, ucp_tag);    
     st = ucp_tag_send_nb(ep, data, 1, dt, ucp_tag, torch_ucx_send_cmpl_cb);
+    if (UCS_PTR_IS_ERR(st)) {
+        fprintf(stderr, "TorchUCC: failed to send to %d: %s\n", dst_rank,
+                ucs_status_string(UCS_PTR_STATUS(st)));
+        torch_ucx_comm_set_error(comm, UCS_PTR_STATUS(st), dst_rank);
+        *req = NULL;
+        return TORCH_UCX_ERROR;
+    }
     *req = reinterpret_cast<torch_ucx_request_t*>(st);
-    /*TODO: check request*/
+    if (*req != NULL) {
+        (*req)->peer = dst_rank;
+    }
 
     return TORCH_UCX_OK;
 }
@@ -171,27 +350,49 @@ torch_ucx_recv_nb(torch_ucx_comm_t *comm,
     ucp_tag_t      ucp_tag, ucp_tag_mask;
     ucp_datatype_t dt;
     ucs_status_ptr_t st;
+    int            rank = (src_rank == TORCH_UCX_ANY_SOURCE) ? 0 : src_rank;
 
     dt = ucp_dt_make_contig(size);
     switch(type) {
         case TORCH_UCX_COLL_TAG:
-            TORCH_UCX_MAKE_COLL_RECV_TAG(ucp_tag, ucp_tag_mask, tag, src_rank);
+            TORCH_UCX_MAKE_COLL_RECV_TAG(ucp_tag, ucp_tag_mask, tag, rank);
             break;
         case TORCH_UCX_P2P_TAG:
-            TORCH_UCX_MAKE_P2P_RECV_TAG(ucp_tag, ucp_tag_mask, tag, src_rank);
+            TORCH_UCX_MAKE_P2P_RECV_TAG(ucp_tag, ucp_tag_mask, tag, rank);
             break;
         case TORCH_UCX_OOB_TAG:
-            TORCH_UCX_MAKE_OOB_RECV_TAG(ucp_tag, ucp_tag_mask, tag, src_rank);
+            TORCH_UCX_MAKE_OOB_RECV_TAG(ucp_tag, ucp_tag_mask, tag, rank);
             break;
         default:
             return TORCH_UCX_ERROR;
     };
+    /* the sender is only encoded in the rank bits, the tag still matches */
+    if (src_rank == TORCH_UCX_ANY_SOURCE) {
+        ucp_tag_mask &= ~TORCH_UCX_RANK_MASK;
+    }
+    if (torch_ucx_use_eager(comm, size, type)) {
+        return torch_ucx_eager_recv(comm, data, size, src_rank, ucp_tag,
+                                    ucp_tag_mask, req);
+    }
 
     //fprintf(stderr, "rank %d recv tag %" PRIu64 " mask %" PRIu64 "\n", comm->rank, ucp_tag, ucp_tag_mask );
     st = ucp_tag_recv_nb(comm->worker, data, 1, dt, ucp_tag, ucp_tag_mask,
                          torch_ucx_recv_cmpl_cb);
+    if (UCS_PTR_IS_ERR(st)) {
+        fprintf(stderr, "TorchUCC: failed to receive from %d: %s\n", src_rank,
+                ucs_status_string(UCS_PTR_STATUS(st)));
+        torch_ucx_comm_set_error(comm, UCS_PTR_STATUS(st), src_rank);
+        *req = NULL;
+        return TORCH_UCX_ERROR;
+    }
     *req = reinterpret_cast<torch_ucx_request_t*>(st);
-    /*TODO: check request*/
+    if (*req != NULL) {
+        (*req)->peer = src_rank;
+        if ((comm->eager != NULL) && (type == TORCH_UCX_P2P_TAG)) {
+            torch_ucx_eager_watch(comm, *req, data, size, ucp_tag,
+                                  ucp_tag_mask);
+        }
+    }
 
     return TORCH_UCX_OK;
 }
@@ -202,6 +403,37 @@ torch_ucx_comm_progress(torch_ucx_comm_t *comm)
     return ucp_worker_progress(comm->worker);
 }
 
+/* Completion of a batch of requests posted together: the worker is
+ * progressed once per call and completed requests are released and
+ * removed, so the cost per call does not grow with finished requests.
+ * The first failure of a released request is stored in result. */
+static inline torch_ucx_status_t
+torch_ucx_batch_test(torch_ucx_comm_t *comm,
+                     std::vector<torch_ucx_request_t*> *reqs,
+                     ucs_status_t *result)
+{
+    size_t i = 0;
+
+    torch_ucx_comm_progress(comm);
+    while (i < reqs->size()) {
+        torch_ucx_request_t *req = (*reqs)[i];
+
+        if ((req != NULL) && (req->status != TORCH_UCX_REQUEST_DONE)) {
+            i++;
+            continue;
+        }
+        if (req != NULL) {
+            if ((req->result != UCS_OK) && (*result == UCS_OK)) {
+                *result = req->result;
+            }
+            torch_ucx_request_release(comm, req);
+        }
+        (*reqs)[i] = reqs->back();
+        reqs->pop_back();
+    }
+    return reqs->empty() ? TORCH_UCX_OK : TORCH_UCX_INPROGRESS;
+}
+
 static inline torch_ucx_status_t
 torch_ucx_req_test(torch_ucx_comm_t *comm, torch_ucx_request_t **reqs,
                    int n_reqs, int *completed_idx, int poll_count,
@@ -222,7 +454,7 @@ torch_ucx_req_test(torch_ucx_comm_t *comm, torch_ucx_request_t **reqs,
                 if (reqs[i]->status != TORCH_UCX_REQUEST_DONE) {
                     torch_ucx_comm_progress(comm);
                 } else {
-                    torch_ucx_request_free(reqs[i]);
+                    torch_ucx_request_release(comm, reqs[i]);
                     reqs[i] = NULL;
                     if (completed_idx) {
                         *completed_idx = i;
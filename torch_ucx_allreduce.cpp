@@ -0,0 +1,658 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <algorithm>
+#include "torch_ucx_coll.hpp"
+#include "torch_ucx_compress.hpp"
+#include "torch_ucx_reduce.hpp"
+#include "torch_ucx_shm.hpp"
+
+namespace c10d {
+
+/* Hierarchical allreduce: local ranks reduce to the node leader, leaders
+ * run recursive doubling among themselves and then broadcast the result
+ * back within the node. With one rank per node this is a flat recursive
+ * doubling, with one node it is a reduce + bcast through the leader.
+ * The intra-node stages go through the shm engine when it is available. */
+enum {
+    TORCH_UCX_ALLREDUCE_NODE_REDUCE,
+    TORCH_UCX_ALLREDUCE_LEADERS_FOLD,
+    TORCH_UCX_ALLREDUCE_LEADERS_RD,
+    TORCH_UCX_ALLREDUCE_LEADERS_UNFOLD,
+    TORCH_UCX_ALLREDUCE_LEADERS_RING,
+    TORCH_UCX_ALLREDUCE_NODE_BCAST,
+    TORCH_UCX_ALLREDUCE_DONE
+};
+
+static inline torch_ucx_topo_t* allreduce_topo(torch_ucx_coll_request_t *request)
+{
+    return request->config.topo_aware ? &request->comm->topo :
+                                        &request->comm->flat_topo;
+}
+
+static inline torch_ucx_shm_t* allreduce_shm(torch_ucx_coll_request_t *request)
+{
+    return request->config.topo_aware ? request->comm->shm : NULL;
+}
+
+/* Non power of two leader counts are folded: the first 2 * rem leaders
+ * pair up, the even one hands its data to the odd one and sits out the
+ * recursive doubling, then gets the result back. */
+static inline int rd_leader(int new_rank, int rem)
+{
+    return (new_rank < rem) ? new_rank * 2 + 1 : new_rank + rem;
+}
+
+/* Leader exchanges of fp32 SUM/MIN/MAX can go compressed over the wire.
+ * The buffer is cut into segments that are compressed and sent one by
+ * one and reduced as they arrive, receive segments are at the start of
+ * scratch and reqs, send segments follow. In recursive doubling the
+ * sender also rounds its own copy through the wire format, so both sides
+ * of an exchange end up with bit identical results. */
+static inline torch_ucx_compress_t allreduce_compress(torch_ucx_coll_request_t *request)
+{
+    if ((request->op != TORCH_UCX_OP_SUM) && (request->op != TORCH_UCX_OP_MIN) &&
+        (request->op != TORCH_UCX_OP_MAX)) {
+        return TORCH_UCX_COMPRESS_NONE;
+    }
+    return torch_ucx_coll_compress(request);
+}
+
+static inline size_t allreduce_seg_count(torch_ucx_coll_request_t *request)
+{
+    size_t seg = request->config.compress_seg / sizeof(float);
+
+    return std::max(seg / TORCH_UCX_COMPRESS_BLOCK, (size_t)1) *
+           TORCH_UCX_COMPRESS_BLOCK;
+}
+
+static inline int allreduce_n_segs(torch_ucx_coll_request_t *request)
+{
+    size_t seg = allreduce_seg_count(request);
+
+    return (request->count + seg - 1) / seg;
+}
+
+static void allreduce_cmp_post(torch_ucx_coll_request_t *request,
+                               torch_ucx_compress_t cmp, int peer,
+                               bool do_recv, bool do_send, bool round_trip)
+{
+    torch_ucx_comm_t *p2p_comm = request->comm->p2p_comm;
+    float            *dst      = (float*)request->dst_buffer;
+    size_t           seg       = allreduce_seg_count(request);
+    int              n_segs    = allreduce_n_segs(request);
+    size_t           stride    = torch_ucx_compress_size(cmp, seg);
+    char             *rstage   = (char*)request->scratch;
+    char             *sstage   = rstage + n_segs * stride;
+
+    for (int i = 0; do_recv && (i < n_segs); i++) {
+        size_t n = std::min(request->count - i * seg, seg);
+
+        torch_ucx_recv_nb(p2p_comm, rstage + i * stride,
+                          torch_ucx_compress_size(cmp, n), peer, request->tag,
+                          &request->reqs[i], TORCH_UCX_COLL_TAG);
+    }
+    for (int i = 0; do_send && (i < n_segs); i++) {
+        size_t n = std::min(request->count - i * seg, seg);
+
+        torch_ucx_compress(cmp, sstage + i * stride, dst + i * seg, n);
+        if (round_trip) {
+            torch_ucx_decompress(cmp, dst + i * seg, sstage + i * stride, n);
+        }
+        torch_ucx_send_nb(p2p_comm, sstage + i * stride,
+                          torch_ucx_compress_size(cmp, n), peer, request->tag,
+                          &request->reqs[n_segs + i], TORCH_UCX_COLL_TAG);
+    }
+    request->n_rreqs = 0;
+}
+
+/* Reduces the received segments in order as they arrive and waits for
+ * the sends, returns false while anything is still in flight. */
+static bool allreduce_cmp_reduce(torch_ucx_coll_request_t *request,
+                                 torch_ucx_compress_t cmp, double scale)
+{
+    torch_ucx_comm_t *p2p_comm = request->comm->p2p_comm;
+    float            *dst      = (float*)request->dst_buffer;
+    size_t           seg       = allreduce_seg_count(request);
+    int              n_segs    = allreduce_n_segs(request);
+    size_t           stride    = torch_ucx_compress_size(cmp, seg);
+    char             *rstage   = (char*)request->scratch;
+    int              n_polls   = 0;
+
+    while (request->n_rreqs < n_segs) {
+        torch_ucx_request_t **req = &request->reqs[request->n_rreqs];
+        size_t              n     = std::min(request->count -
+                                             request->n_rreqs * seg, seg);
+
+        if (*req != NULL) {
+            if ((*req)->status != TORCH_UCX_REQUEST_DONE) {
+                if (n_polls++ >= request->config.max_polls) {
+                    return false;
+                }
+                torch_ucx_comm_progress(p2p_comm);
+                continue;
+            }
+            torch_ucx_request_release(p2p_comm, *req);
+            *req = NULL;
+        }
+        torch_ucx_decompress_reduce(cmp, dst + request->n_rreqs * seg,
+                                    rstage + request->n_rreqs * stride, n,
+                                    request->op, scale);
+        request->n_rreqs++;
+    }
+    request->n_active = 2 * n_segs;
+    return torch_ucx_coll_wait(request);
+}
+
+/* Segmented ring among the node leaders for large buffers: reduce-scatter
+ * followed by allgather over chunks of count / n elements that move in
+ * segments. Item i = step * n_segs + seg is the i-th segment sent to the
+ * next leader and received from the previous one, all on the request tag
+ * so they match in order. Reduce-scatter segments are received into one
+ * of window staging slots and reduced by the helper thread while later
+ * segments are in flight. n_done counts the items received and reduced,
+ * in order. Item i can be sent once item i - n_segs, which produced the
+ * same chunk segment one step earlier, is done. */
+struct torch_ucx_ring_t {
+    int                               n;
+    int                               pos;
+    size_t                            chunk;
+    size_t                            seg;
+    int                               n_segs;
+    int                               n_rs_items;
+    int                               n_items;
+    int                               window;
+    int                               n_sent;
+    int                               n_posted;
+    int                               n_received;
+    std::atomic<int>                  n_done;
+    std::vector<char>                 stage;
+    std::vector<torch_ucx_request_t*> sreqs;
+    std::vector<torch_ucx_request_t*> rreqs;
+};
+
+static inline bool allreduce_use_ring(torch_ucx_coll_request_t *request,
+                                      torch_ucx_topo_t *topo,
+                                      torch_ucx_compress_t cmp)
+{
+    return (request->config.ring_thresh > 0) &&
+           (request->len >= request->config.ring_thresh) &&
+           (topo->n_nodes > 1) && !cmp;
+}
+
+static torch_ucx_ring_t* allreduce_ring_init(torch_ucx_coll_request_t *request,
+                                             torch_ucx_topo_t *topo)
+{
+    torch_ucx_ring_t *ring    = new torch_ucx_ring_t;
+    size_t           dt_size  = torch_ucx_dtype_size(request->dtype);
+
+    ring->n          = topo->n_nodes;
+    ring->pos        = topo->node_id;
+    ring->chunk      = (request->count + ring->n - 1) / ring->n;
+    ring->seg        = std::max(request->config.ring_seg / dt_size, (size_t)1);
+    ring->n_segs     = std::max((ring->chunk + ring->seg - 1) / ring->seg,
+                                (size_t)1);
+    ring->n_rs_items = (ring->n - 1) * ring->n_segs;
+    ring->n_items    = 2 * ring->n_rs_items;
+    ring->window     = request->config.ring_window;
+    ring->n_sent     = 0;
+    ring->n_posted   = 0;
+    ring->n_received = 0;
+    ring->n_done     = 0;
+    ring->stage.resize(ring->window * ring->seg * dt_size);
+    ring->sreqs.assign(ring->n_items, NULL);
+    ring->rreqs.assign(ring->n_items, NULL);
+    return ring;
+}
+
+/* element range of the segment item i sends or receives, empty segments
+ * at the end of the last chunk are skipped on both sides */
+static void allreduce_ring_item(torch_ucx_ring_t *ring, size_t count, int i,
+                                bool send, size_t *offset, size_t *len)
+{
+    int    step = i / ring->n_segs;
+    size_t end;
+    int    c;
+
+    if (step < ring->n - 1) {
+        c = ring->pos - step - (send ? 0 : 1);
+    } else {
+        step -= ring->n - 1;
+        c     = ring->pos - step + (send ? 1 : 0);
+    }
+    c       = ((c % ring->n) + ring->n) % ring->n;
+    *offset = c * ring->chunk + (i % ring->n_segs) * ring->seg;
+    end     = std::min(std::min((c + 1) * ring->chunk, count),
+                       *offset + ring->seg);
+    *len    = (end > *offset) ? end - *offset : 0;
+}
+
+static bool allreduce_ring_progress(torch_ucx_coll_request_t *request,
+                                    torch_ucx_topo_t *topo)
+{
+    torch_ucx_ring_t *ring     = request->ring;
+    torch_ucx_comm_t *p2p_comm = request->comm->p2p_comm;
+    size_t           dt_size   = torch_ucx_dtype_size(request->dtype);
+    char             *dst      = (char*)request->dst_buffer;
+    int              next      = topo->leaders[(ring->pos + 1) % ring->n];
+    int              prev      = topo->leaders[(ring->pos - 1 + ring->n) % ring->n];
+    size_t           offset, len;
+    int              i, n_done;
+
+    for (int n_polls = 0; n_polls < request->config.max_polls; n_polls++) {
+        n_done = ring->n_done.load(std::memory_order_acquire);
+        while ((ring->n_posted < ring->n_items) &&
+               (ring->n_posted < n_done + ring->window)) {
+            i = ring->n_posted++;
+            allreduce_ring_item(ring, request->count, i, false, &offset, &len);
+            if (len == 0) {
+                continue;
+            }
+            torch_ucx_recv_nb(p2p_comm, (i < ring->n_rs_items) ?
+                              &ring->stage[(i % ring->window) * ring->seg * dt_size] :
+                              dst + offset * dt_size,
+                              len * dt_size, prev, request->tag,
+                              &ring->rreqs[i], TORCH_UCX_COLL_TAG);
+        }
+        while ((ring->n_sent < ring->n_items) &&
+               (ring->n_sent - ring->n_segs < n_done)) {
+            i = ring->n_sent++;
+            allreduce_ring_item(ring, request->count, i, true, &offset, &len);
+            if (len == 0) {
+                continue;
+            }
+            torch_ucx_send_nb(p2p_comm, dst + offset * dt_size, len * dt_size,
+                              next, request->tag, &ring->sreqs[i],
+                              TORCH_UCX_COLL_TAG);
+        }
+        while (ring->n_received < ring->n_posted) {
+            torch_ucx_request_t **req = &ring->rreqs[ring->n_received];
+
+            i = ring->n_received;
+            if (*req != NULL) {
+                if ((*req)->status != TORCH_UCX_REQUEST_DONE) {
+                    break;
+                }
+                torch_ucx_request_release(p2p_comm, *req);
+                *req = NULL;
+            }
+            if (i < ring->n_rs_items) {
+                torch_ucx_reducer_task_t task;
+
+                allreduce_ring_item(ring, request->count, i, false, &offset, &len);
+                task.dst   = dst + offset * dt_size;
+                task.src   = &ring->stage[(i % ring->window) * ring->seg * dt_size];
+                task.count = len;
+                task.dtype = request->dtype;
+                task.op    = request->op;
+                task.scale = (i / ring->n_segs == ring->n - 2) ?
+                             request->post_scale : 1.0;
+                task.done  = &ring->n_done;
+                torch_ucx_reducer_submit(request->comm->reducer, &task);
+            } else {
+                /* the reducer is idle once all reduce-scatter items are done */
+                if (ring->n_done.load(std::memory_order_acquire) != i) {
+                    break;
+                }
+                ring->n_done.store(i + 1, std::memory_order_release);
+            }
+            torch_ucx_trace("ring_recv", TORCH_UCX_TRACE_POINT, request, 0,
+                            prev, request->phase, i);
+            ring->n_received++;
+        }
+        if ((ring->n_done.load(std::memory_order_acquire) == ring->n_items) &&
+            (ring->n_sent == ring->n_items) &&
+            (torch_ucx_req_test(p2p_comm, ring->sreqs.data(), ring->n_items,
+                                NULL, 1, ring->n_items) == TORCH_UCX_OK)) {
+            return true;
+        }
+        torch_ucx_comm_progress(p2p_comm);
+    }
+    return false;
+}
+
+torch_ucx_status_t torch_ucx_allreduce_progress(torch_ucx_coll_request_t *request)
+{
+    torch_ucx_coll_comm_t *comm      = request->comm;
+    torch_ucx_comm_t      *p2p_comm  = comm->p2p_comm;
+    torch_ucx_topo_t      *topo      = allreduce_topo(request);
+    torch_ucx_shm_t       *shm       = allreduce_shm(request);
+    torch_ucx_compress_t  cmp        = allreduce_compress(request);
+    size_t                data_size  = request->len;
+    char                  *dst       = (char*)request->dst_buffer;
+    char                  *scratch   = (char*)request->scratch;
+    const void            *rd_src    = scratch;
+    uint32_t              tag        = request->tag;
+    int                   node_rank  = topo->node_id;
+    int                   n_nodes    = topo->n_nodes;
+    bool                  is_leader  = (topo->local_rank == 0);
+    auto                  &local     = topo->node_ranks[node_rank];
+    int                   p2, rem, new_rank, peer, dist;
+    double                node_scale;
+
+    p2 = 1;
+    while (p2 * 2 <= n_nodes) {
+        p2 *= 2;
+    }
+    rem = n_nodes - p2;
+    /* pre_scale goes into the node reduce, post_scale into the last
+     * reduction, which is the node reduce if there are no leader steps */
+    node_scale = request->pre_scale * ((p2 == 1) ? request->post_scale : 1.0);
+
+    if (!torch_ucx_coll_wait(request)) {
+        return TORCH_UCX_OK;
+    }
+
+    for (;;) {
+        switch (request->phase) {
+        case TORCH_UCX_ALLREDUCE_NODE_REDUCE:
+            if (shm) {
+                if (torch_ucx_shm_coll_progress(shm, &request->shm_coll) ==
+                    TORCH_UCX_INPROGRESS) {
+                    return TORCH_UCX_OK;
+                }
+                request->phase = is_leader ? TORCH_UCX_ALLREDUCE_LEADERS_FOLD :
+                                             TORCH_UCX_ALLREDUCE_NODE_BCAST;
+                request->step  = 0;
+                break;
+            }
+            if (request->step == 0) {
+                if (is_leader) {
+                    for (int i = 1; i < topo->local_size; i++) {
+                        torch_ucx_recv_nb(p2p_comm, scratch + (i - 1) * data_size,
+                                          data_size, local[i], tag,
+                                          &request->reqs[i - 1],
+                                          TORCH_UCX_COLL_TAG);
+                    }
+                    request->n_active = topo->local_size - 1;
+                } else {
+                    torch_ucx_send_nb(p2p_comm, dst, data_size, local[0], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                    request->n_active = 1;
+                }
+                request->step = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            if (is_leader) {
+                std::vector<const void*> srcs(topo->local_size - 1);
+
+                for (int i = 1; i < topo->local_size; i++) {
+                    srcs[i - 1] = scratch + (i - 1) * data_size;
+                }
+                torch_ucx_reduce_n_scaled(dst, srcs.data(), srcs.size(),
+                                          request->count, request->dtype,
+                                          request->op, node_scale);
+            }
+            request->phase = is_leader ? TORCH_UCX_ALLREDUCE_LEADERS_FOLD :
+                                         TORCH_UCX_ALLREDUCE_NODE_BCAST;
+            request->step  = 0;
+            break;
+        case TORCH_UCX_ALLREDUCE_LEADERS_FOLD:
+            if (request->ring) {
+                request->phase = TORCH_UCX_ALLREDUCE_LEADERS_RING;
+                break;
+            }
+            if (node_rank >= 2 * rem) {
+                request->phase = TORCH_UCX_ALLREDUCE_LEADERS_RD;
+                break;
+            }
+            if ((request->step == 0) && cmp) {
+                peer = topo->leaders[node_rank ^ 1];
+                allreduce_cmp_post(request, cmp, peer, node_rank % 2,
+                                   node_rank % 2 == 0, false);
+                request->n_active = (node_rank % 2 == 0) ?
+                                    2 * allreduce_n_segs(request) : 0;
+                request->step     = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            if (request->step == 0) {
+                if (node_rank % 2 == 0) {
+                    torch_ucx_send_nb(p2p_comm, dst, data_size,
+                                      topo->leaders[node_rank + 1], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                } else {
+                    torch_ucx_recv_nb(p2p_comm, scratch, data_size,
+                                      topo->leaders[node_rank - 1], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                }
+                request->n_active = 1;
+                request->step     = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            if (node_rank % 2 == 0) {
+                request->phase = TORCH_UCX_ALLREDUCE_LEADERS_UNFOLD;
+            } else {
+                if (cmp) {
+                    if (!allreduce_cmp_reduce(request, cmp, 1.0)) {
+                        return TORCH_UCX_OK;
+                    }
+                } else {
+                    torch_ucx_reduce(dst, scratch, request->count,
+                                     request->dtype, request->op);
+                }
+                request->phase = TORCH_UCX_ALLREDUCE_LEADERS_RD;
+            }
+            request->step = 0;
+            break;
+        case TORCH_UCX_ALLREDUCE_LEADERS_RD:
+            new_rank = (node_rank < 2 * rem) ? node_rank / 2 : node_rank - rem;
+            dist     = 1 << (request->step / 2);
+            if (dist >= p2) {
+                request->phase = TORCH_UCX_ALLREDUCE_LEADERS_UNFOLD;
+                request->step  = 0;
+                break;
+            }
+            if ((request->step % 2 == 0) && cmp) {
+                peer = topo->leaders[rd_leader(new_rank ^ dist, rem)];
+                allreduce_cmp_post(request, cmp, peer, true, true, true);
+                request->step++;
+            }
+            if (request->step % 2 == 0) {
+                peer = topo->leaders[rd_leader(new_rank ^ dist, rem)];
+                torch_ucx_recv_nb(p2p_comm, scratch, data_size, peer, tag,
+                                  &request->reqs[0], TORCH_UCX_COLL_TAG);
+                torch_ucx_send_nb(p2p_comm, dst, data_size, peer, tag,
+                                  &request->reqs[1], TORCH_UCX_COLL_TAG);
+                request->n_active = 2;
+                request->step++;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            if (cmp) {
+                if (!allreduce_cmp_reduce(request, cmp, (2 * dist >= p2) ?
+                                          request->post_scale : 1.0)) {
+                    return TORCH_UCX_OK;
+                }
+            } else {
+                torch_ucx_reduce_n_scaled(dst, &rd_src, 1,
+                                          request->count, request->dtype,
+                                          request->op, (2 * dist >= p2) ?
+                                          request->post_scale : 1.0);
+            }
+            request->step++;
+            break;
+        case TORCH_UCX_ALLREDUCE_LEADERS_UNFOLD:
+            if ((node_rank < 2 * rem) && (request->step == 0)) {
+                if (node_rank % 2 == 0) {
+                    torch_ucx_recv_nb(p2p_comm, dst, data_size,
+                                      topo->leaders[node_rank + 1], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                } else {
+                    torch_ucx_send_nb(p2p_comm, dst, data_size,
+                                      topo->leaders[node_rank - 1], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                }
+                request->n_active = 1;
+                request->step     = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            request->phase = TORCH_UCX_ALLREDUCE_NODE_BCAST;
+            request->step  = 0;
+            break;
+        case TORCH_UCX_ALLREDUCE_LEADERS_RING:
+            if (!allreduce_ring_progress(request, topo)) {
+                return TORCH_UCX_OK;
+            }
+            request->phase = TORCH_UCX_ALLREDUCE_NODE_BCAST;
+            request->step  = 0;
+            break;
+        case TORCH_UCX_ALLREDUCE_NODE_BCAST:
+            if (shm) {
+                if (request->step == 0) {
+                    torch_ucx_shm_coll_init(&request->shm_coll,
+                                            request->shm_coll.seq + 1,
+                                            TORCH_UCX_SHM_BCAST, 0, dst, dst,
+                                            data_size, request->dtype,
+                                            request->op);
+                    request->step = 1;
+                }
+                if (torch_ucx_shm_coll_progress(shm, &request->shm_coll) ==
+                    TORCH_UCX_INPROGRESS) {
+                    return TORCH_UCX_OK;
+                }
+                request->phase = TORCH_UCX_ALLREDUCE_DONE;
+                break;
+            }
+            if (request->step == 0) {
+                if (is_leader) {
+                    for (int i = 1; i < topo->local_size; i++) {
+                        torch_ucx_send_nb(p2p_comm, dst, data_size, local[i], tag,
+                                          &request->reqs[i - 1],
+                                          TORCH_UCX_COLL_TAG);
+                    }
+                    request->n_active = topo->local_size - 1;
+                } else {
+                    torch_ucx_recv_nb(p2p_comm, dst, data_size, local[0], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                    request->n_active = 1;
+                }
+                request->step = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            request->phase = TORCH_UCX_ALLREDUCE_DONE;
+            break;
+        case TORCH_UCX_ALLREDUCE_DONE:
+            delete[] request->reqs;
+            delete[] scratch;
+            delete request->ring;
+            request->ring    = NULL;
+            request->scratch = NULL;
+            torch_ucx_metrics_record(&request->comm->metrics,
+                                     TORCH_UCX_METRICS_ALLREDUCE, request->len,
+                                     request->start_ns);
+            torch_ucx_trace("allreduce", TORCH_UCX_TRACE_END, request);
+            request->status  = TORCH_UCX_OK;
+            return TORCH_UCX_OK;
+        }
+    }
+}
+
+torch_ucx_status_t torch_ucx_allreduce_start_tag(torch_ucx_coll_comm_t *comm,
+                                                 torch_ucx_coll_request_t *request,
+                                                 uint32_t tag)
+{
+    torch_ucx_topo_t     *topo;
+    torch_ucx_shm_t      *shm;
+    torch_ucx_compress_t cmp;
+    int                  n_reqs;
+    size_t               data_size = request->len;
+    size_t               cmp_size  = 0;
+
+    torch_ucx_trace("allreduce", TORCH_UCX_TRACE_BEGIN, request, request->len);
+    torch_ucx_coll_begin(comm, request, "allreduce");
+    request->comm     = comm;
+    topo              = allreduce_topo(request);
+    shm               = allreduce_shm(request);
+    cmp               = allreduce_compress(request);
+    n_reqs            = std::max(topo->local_size, 2);
+    if (cmp && (topo->n_nodes > 1)) {
+        n_reqs   = std::max(n_reqs, 2 * allreduce_n_segs(request));
+        cmp_size = 2 * allreduce_n_segs(request) *
+                   torch_ucx_compress_size(cmp, allreduce_seg_count(request));
+    }
+
+    if (request->src_buffer != request->dst_buffer) {
+        memcpy(request->dst_buffer, request->src_buffer, data_size);
+    }
+    request->reqs     = new torch_ucx_request_t*[n_reqs];
+    request->max_reqs = n_reqs;
+    for (int i = 0; i < n_reqs; i++) {
+        request->reqs[i] = NULL;
+    }
+    if (shm) {
+        torch_ucx_shm_coll_init(&request->shm_coll,
+                                torch_ucx_shm_reserve(shm, 2),
+                                TORCH_UCX_SHM_REDUCE, 0,
+                                request->dst_buffer, request->dst_buffer,
+                                data_size, request->dtype, request->op);
+        request->shm_coll.scale = request->pre_scale *
+                                  ((topo->n_nodes == 1) ? request->post_scale : 1.0);
+    }
+    request->ring = NULL;
+    if ((topo->local_rank == 0) && allreduce_use_ring(request, topo, cmp)) {
+        request->ring = allreduce_ring_init(request, topo);
+    }
+    /* the ring reduces in place, leaders only receive node peers into
+     * scratch if there is no shm */
+    if ((topo->local_rank != 0) ||
+        (request->ring && (shm || (topo->local_size == 1)))) {
+        request->scratch = NULL;
+    } else if (request->ring) {
+        request->scratch = new char[(topo->local_size - 1) * data_size];
+    } else if (shm) {
+        request->scratch = new char[std::max(data_size, cmp_size)];
+    } else {
+        request->scratch = new char[std::max(std::max(topo->local_size - 1, 1) *
+                                             data_size, cmp_size)];
+    }
+
+    request->tag      = tag;
+    request->n_active = 0;
+    request->phase    = TORCH_UCX_ALLREDUCE_NODE_REDUCE;
+    request->step     = 0;
+    request->status   = TORCH_UCX_INPROGRESS;
+    request->progress = torch_ucx_allreduce_progress;
+
+    return torch_ucx_allreduce_progress(request);
+}
+
+void torch_ucx_allreduce_pending(torch_ucx_coll_request_t *request,
+                                 std::vector<torch_ucx_request_t**> *reqs)
+{
+    torch_ucx_ring_t *ring = request->ring;
+
+    if (ring == NULL) {
+        return;
+    }
+    for (int i = 0; i < ring->n_items; i++) {
+        if (ring->sreqs[i] != NULL) {
+            reqs->push_back(&ring->sreqs[i]);
+        }
+        if (ring->rreqs[i] != NULL) {
+            reqs->push_back(&ring->rreqs[i]);
+        }
+    }
+}
+
+torch_ucx_status_t torch_ucx_allreduce_start(torch_ucx_coll_comm_t *comm,
+                                             torch_ucx_coll_request_t *request)
+{
+    return torch_ucx_allreduce_start_tag(comm, request,
+                                         torch_ucx_coll_next_tag(comm));
+}
+
+}
@@ -4,7 +4,11 @@
  * * See file LICENSE for terms.
  * */
 
+#include <algorithm>
+#include <chrono>
 #include "torch_ucx_coll.hpp"
+#include "torch_ucx_compress.hpp"
+#include "torch_ucx_shm.hpp"
 
 namespace c10d {
 
@@ -70,9 +74,9 @@ torch_ucx_status_t torch_ucx_alltoall_progress(torch_ucx_coll_request_t *request
     size_t            data_size  = request->len;
     ptrdiff_t         sbuf       = (ptrdiff_t)request->src_buffer;
     ptrdiff_t         rbuf       = (ptrdiff_t)request->dst_buffer;
-    bool              reverse    = request->comm->config.reverse;
-    int               max_polls  = request->comm->config.max_polls;
-    int               chunk      = request->comm->config.chunk;
+    bool              reverse    = request->config.reverse;
+    int               max_polls  = request->config.max_polls;
+    int               chunk      = request->config.chunk;
     uint32_t          tag        = request->tag;
 
     int total_reqs, n_polls, released_slot;
@@ -129,11 +133,516 @@ torch_ucx_status_t torch_ucx_alltoall_progress(torch_ucx_coll_request_t *request
     }
     sync_stream(request->dst_buf_mtype, request->src_buf_mtype, request->comm->stream);
     delete[] request->reqs;
+    torch_ucx_metrics_record(&request->comm->metrics,
+                             TORCH_UCX_METRICS_ALLTOALL,
+                             request->len * request->comm->p2p_comm->size,
+                             request->start_ns);
+    torch_ucx_trace("alltoall", TORCH_UCX_TRACE_END, request);
     request->status = TORCH_UCX_OK;
 
     return TORCH_UCX_OK;
 }
 
+/* Adaptive window: receives and sends are kept in flight up to a window
+ * that is adjusted after every window's worth of completions. If most of
+ * them took more than TORCH_UCX_FLOW_CONGESTED times the EWMA latency of
+ * their peer the window is halved, if the completion rate dropped by
+ * more than 10% since the last adjustment it shrinks by one, otherwise
+ * it grows by one. The final window seeds the next call of the same
+ * block size class. With compression the blocks exchanged with other
+ * nodes are compressed into a per slot staging buffer right before they
+ * are sent and decompressed as soon as they arrive. */
+#define TORCH_UCX_FLOW_CONGESTED 2.0
+
+static const size_t flow_class_max_len[TORCH_UCX_FLOW_N_CLASSES - 1] = {
+    4096, 65536, 1 << 20
+};
+
+static const int flow_default_window[TORCH_UCX_FLOW_N_CLASSES] = {
+    4, 8, 16, 32
+};
+
+enum {
+    TORCH_UCX_FLOW_RECV,
+    TORCH_UCX_FLOW_SEND
+};
+
+struct torch_ucx_alltoall_flow_t {
+    int                  cls;
+    int                  window;
+    int                  n_out[2];
+    std::vector<int>     free_slots[2];
+    std::vector<int>     active;
+    std::vector<double>  post_time;
+    std::vector<int>     slot_peer;
+    int                  n_epoch;
+    int                  n_congested;
+    double               epoch_start;
+    double               prev_rate;
+    torch_ucx_compress_t cmp;
+    size_t               wire_len;
+    std::vector<char>    stage;
+};
+
+static inline bool flow_peer_cmp(torch_ucx_coll_request_t *request,
+                                 torch_ucx_alltoall_flow_t *fr, int peer)
+{
+    torch_ucx_topo_t *topo = &request->comm->topo;
+
+    return fr->cmp && (topo->rank_node[peer] != topo->node_id);
+}
+
+static inline double flow_now()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline int flow_class(size_t len)
+{
+    int cls = 0;
+
+    while ((cls < TORCH_UCX_FLOW_N_CLASSES - 1) &&
+           (len > flow_class_max_len[cls])) {
+        cls++;
+    }
+    return cls;
+}
+
+static void flow_complete(torch_ucx_coll_request_t *request,
+                          torch_ucx_alltoall_flow_t *fr, int slot, double now)
+{
+    torch_ucx_flow_t *flow = &request->comm->flow;
+    int              cap   = request->comm->p2p_comm->size - 1;
+    int              dir   = (slot < cap) ? TORCH_UCX_FLOW_RECV :
+                                            TORCH_UCX_FLOW_SEND;
+    double           lat   = now - fr->post_time[slot];
+    double           &ref  = flow->peer_lat[fr->cls][fr->slot_peer[slot]];
+    double           rate;
+
+    if ((ref > 0) && (lat > TORCH_UCX_FLOW_CONGESTED * ref)) {
+        fr->n_congested++;
+    }
+    ref = (ref == 0) ? lat : ref + (lat - ref) / 8;
+    fr->free_slots[dir].push_back(slot);
+    fr->n_out[dir]--;
+
+    if (++fr->n_epoch < fr->window) {
+        return;
+    }
+    rate = fr->n_epoch / std::max(now - fr->epoch_start, 1e-9);
+    if (2 * fr->n_congested > fr->n_epoch) {
+        fr->window = std::max(fr->window / 2, 1);
+    } else if (rate < 0.9 * fr->prev_rate) {
+        fr->window = std::max(fr->window - 1, 1);
+    } else {
+        fr->window = std::min(fr->window + 1, cap);
+    }
+    fr->prev_rate   = rate;
+    fr->n_epoch     = 0;
+    fr->n_congested = 0;
+    fr->epoch_start = now;
+}
+
+torch_ucx_status_t torch_ucx_alltoall_flow_progress(torch_ucx_coll_request_t *request)
+{
+    torch_ucx_comm_t          *p2p_comm  = request->comm->p2p_comm;
+    int                       group_size = p2p_comm->size;
+    int                       group_rank = p2p_comm->rank;
+    int                       cap        = group_size - 1;
+    size_t                    data_size  = request->len;
+    ptrdiff_t                 sbuf       = (ptrdiff_t)request->src_buffer;
+    ptrdiff_t                 rbuf       = (ptrdiff_t)request->dst_buffer;
+    bool                      reverse    = request->config.reverse;
+    int                       max_polls  = request->config.max_polls;
+    uint32_t                  tag        = request->tag;
+    torch_ucx_request_t       **reqs     = request->reqs;
+    torch_ucx_alltoall_flow_t *fr;
+    int                       n_polls, slot, peer;
+    double                    now;
+
+    fr      = static_cast<torch_ucx_alltoall_flow_t*>(request->scratch);
+    n_polls = 0;
+    while (n_polls++ < max_polls) {
+        now = flow_now();
+        for (size_t i = 0; i < fr->active.size();) {
+            slot = fr->active[i];
+            if (reqs[slot] != NULL) {
+                if (reqs[slot]->status != TORCH_UCX_REQUEST_DONE) {
+                    i++;
+                    continue;
+                }
+                torch_ucx_request_release(p2p_comm, reqs[slot]);
+                reqs[slot] = NULL;
+            }
+            peer = fr->slot_peer[slot];
+            if ((slot < cap) && flow_peer_cmp(request, fr, peer)) {
+                torch_ucx_decompress(fr->cmp, (float*)(rbuf + peer * data_size),
+                                     &fr->stage[slot * fr->wire_len],
+                                     data_size / sizeof(float));
+            }
+            torch_ucx_trace((slot < cap) ? "recv" : "send",
+                            TORCH_UCX_TRACE_POINT, request, data_size, peer);
+            flow_complete(request, fr, slot, now);
+            fr->active[i] = fr->active.back();
+            fr->active.pop_back();
+            n_polls = 0;
+        }
+        while ((fr->n_out[TORCH_UCX_FLOW_RECV] < fr->window) &&
+               (request->n_rreqs < cap)) {
+            slot = fr->free_slots[TORCH_UCX_FLOW_RECV].back();
+            fr->free_slots[TORCH_UCX_FLOW_RECV].pop_back();
+            peer = get_recv_peer(group_rank, group_size, request->n_rreqs,
+                                 reverse);
+            if (flow_peer_cmp(request, fr, peer)) {
+                torch_ucx_recv_nb(p2p_comm, &fr->stage[slot * fr->wire_len],
+                                  fr->wire_len, peer, tag, &reqs[slot],
+                                  TORCH_UCX_COLL_TAG);
+            } else {
+                torch_ucx_recv_nb(p2p_comm, (void*)(rbuf + peer * data_size),
+                                  data_size, peer, tag, &reqs[slot],
+                                  TORCH_UCX_COLL_TAG);
+            }
+            fr->post_time[slot] = now;
+            fr->slot_peer[slot] = peer;
+            fr->active.push_back(slot);
+            fr->n_out[TORCH_UCX_FLOW_RECV]++;
+            request->n_rreqs++;
+        }
+        while ((fr->n_out[TORCH_UCX_FLOW_SEND] < fr->window) &&
+               (request->n_sreqs < cap)) {
+            slot = fr->free_slots[TORCH_UCX_FLOW_SEND].back();
+            fr->free_slots[TORCH_UCX_FLOW_SEND].pop_back();
+            peer = get_send_peer(group_rank, group_size, request->n_sreqs,
+                                 reverse);
+            if (flow_peer_cmp(request, fr, peer)) {
+                torch_ucx_compress(fr->cmp, &fr->stage[slot * fr->wire_len],
+                                   (float*)(sbuf + peer * data_size),
+                                   data_size / sizeof(float));
+                torch_ucx_send_nb(p2p_comm, &fr->stage[slot * fr->wire_len],
+                                  fr->wire_len, peer, tag, &reqs[slot],
+                                  TORCH_UCX_COLL_TAG);
+            } else {
+                torch_ucx_send_nb(p2p_comm, (void*)(sbuf + peer * data_size),
+                                  data_size, peer, tag, &reqs[slot],
+                                  TORCH_UCX_COLL_TAG);
+            }
+            fr->post_time[slot] = now;
+            fr->slot_peer[slot] = peer;
+            fr->active.push_back(slot);
+            fr->n_out[TORCH_UCX_FLOW_SEND]++;
+            request->n_sreqs++;
+        }
+        if (fr->active.empty()) {
+            break;
+        }
+        torch_ucx_comm_progress(p2p_comm);
+    }
+
+    if (!fr->active.empty() || (request->n_rreqs != cap) ||
+        (request->n_sreqs != cap)) {
+        return TORCH_UCX_OK;
+    }
+    sync_stream(request->dst_buf_mtype, request->src_buf_mtype, request->comm->stream);
+    request->comm->flow.window[fr->cls] = fr->window;
+    delete fr;
+    delete[] request->reqs;
+    request->scratch = NULL;
+    torch_ucx_metrics_record(&request->comm->metrics,
+                             TORCH_UCX_METRICS_ALLTOALL,
+                             request->len * request->comm->p2p_comm->size,
+                             request->start_ns);
+    torch_ucx_trace("alltoall", TORCH_UCX_TRACE_END, request);
+    request->status  = TORCH_UCX_OK;
+
+    return TORCH_UCX_OK;
+}
+
+static torch_ucx_status_t torch_ucx_alltoall_flow_start(torch_ucx_coll_comm_t *comm,
+                                                        torch_ucx_coll_request_t *request)
+{
+    int                       group_size = comm->p2p_comm->size;
+    int                       group_rank = comm->p2p_comm->rank;
+    int                       cap        = group_size - 1;
+    size_t                    data_size  = request->len;
+    ptrdiff_t                 sbuf       = (ptrdiff_t)request->src_buffer;
+    ptrdiff_t                 rbuf       = (ptrdiff_t)request->dst_buffer;
+    torch_ucx_alltoall_flow_t *fr;
+
+    fr = new torch_ucx_alltoall_flow_t;
+    fr->cls    = flow_class(data_size);
+    fr->window = comm->flow.window[fr->cls];
+    if (fr->window == 0) {
+        fr->window = flow_default_window[fr->cls];
+    }
+    fr->window = std::max(std::min(fr->window, cap), 1);
+    for (int dir = 0; dir < 2; dir++) {
+        fr->n_out[dir] = 0;
+        for (int i = cap - 1; i >= 0; i--) {
+            fr->free_slots[dir].push_back(dir * cap + i);
+        }
+    }
+    fr->post_time.resize(2 * cap);
+    fr->slot_peer.resize(2 * cap);
+    fr->n_epoch     = 0;
+    fr->n_congested = 0;
+    fr->epoch_start = flow_now();
+    fr->prev_rate   = 0;
+    fr->cmp         = torch_ucx_coll_compress(request);
+    if (data_size % sizeof(float) != 0) {
+        fr->cmp = TORCH_UCX_COMPRESS_NONE;
+    }
+    fr->wire_len    = torch_ucx_compress_size(fr->cmp, data_size / sizeof(float));
+    if (fr->cmp) {
+        fr->stage.resize(2 * cap * fr->wire_len);
+    }
+
+    torch_ucx_memcpy((void*)(rbuf+data_size*group_rank), request->dst_buf_mtype,
+                     (void*)(sbuf+data_size*group_rank), request->src_buf_mtype,
+                     data_size, &comm->stream);
+    request->reqs     = new torch_ucx_request_t*[std::max(2 * cap, 1)];
+    request->max_reqs = std::max(2 * cap, 1);
+    for (int i = 0; i < request->max_reqs; i++) {
+        request->reqs[i] = NULL;
+    }
+    request->scratch  = fr;
+    request->tag      = torch_ucx_coll_next_tag(comm);
+    request->comm     = comm;
+    request->n_rreqs  = 0;
+    request->n_sreqs  = 0;
+    request->status   = TORCH_UCX_INPROGRESS;
+    request->progress = torch_ucx_alltoall_flow_progress;
+
+    return torch_ucx_alltoall_flow_progress(request);
+}
+
+
+/* Node aggregated alltoall: the leader gathers the send buffers of its
+ * node, exchanges one packed message with every other node leader and
+ * scatters the unpacked receive buffers back. Leader scratch holds the
+ * gathered buffers, the packed send and receive buffers for all remote
+ * nodes and the unpacked receive buffers of the node. */
+enum {
+    TORCH_UCX_ALLTOALL_HIER_GATHER,
+    TORCH_UCX_ALLTOALL_HIER_EXCHANGE,
+    TORCH_UCX_ALLTOALL_HIER_SCATTER,
+    TORCH_UCX_ALLTOALL_HIER_DONE
+};
+
+torch_ucx_status_t torch_ucx_alltoall_hier_progress(torch_ucx_coll_request_t *request)
+{
+    torch_ucx_coll_comm_t *comm       = request->comm;
+    torch_ucx_comm_t      *p2p_comm   = comm->p2p_comm;
+    torch_ucx_topo_t      *topo       = &comm->topo;
+    torch_ucx_shm_t       *shm        = comm->shm;
+    int                   group_size  = p2p_comm->size;
+    int                   local_size  = topo->local_size;
+    bool                  is_leader   = (topo->local_rank == 0);
+    auto                  &local      = topo->node_ranks[topo->node_id];
+    size_t                data_size   = request->len;
+    size_t                rank_len    = group_size * data_size;
+    size_t                remote_len  = local_size * (group_size - local_size) *
+                                        data_size;
+    char                  *sbuf       = (char*)request->src_buffer;
+    char                  *rbuf       = (char*)request->dst_buffer;
+    char                  *gathered   = (char*)request->scratch;
+    char                  *send_pack  = gathered + local_size * rank_len;
+    char                  *recv_pack  = send_pack + remote_len;
+    char                  *unpacked   = recv_pack + remote_len;
+    uint32_t              tag         = request->tag;
+    size_t                offset;
+    int                   n_reqs;
+
+    if (!torch_ucx_coll_wait(request)) {
+        return TORCH_UCX_OK;
+    }
+
+    for (;;) {
+        switch (request->phase) {
+        case TORCH_UCX_ALLTOALL_HIER_GATHER:
+            if (shm) {
+                if (torch_ucx_shm_coll_progress(shm, &request->shm_coll) ==
+                    TORCH_UCX_INPROGRESS) {
+                    return TORCH_UCX_OK;
+                }
+            } else if (request->step == 0) {
+                if (is_leader) {
+                    memcpy(gathered, sbuf, rank_len);
+                    for (int i = 1; i < local_size; i++) {
+                        torch_ucx_recv_nb(p2p_comm, gathered + i * rank_len,
+                                          rank_len, local[i], tag,
+                                          &request->reqs[i - 1],
+                                          TORCH_UCX_COLL_TAG);
+                    }
+                    request->n_active = local_size - 1;
+                } else {
+                    torch_ucx_send_nb(p2p_comm, sbuf, rank_len, local[0], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                    request->n_active = 1;
+                }
+                request->step = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            request->phase = is_leader ? TORCH_UCX_ALLTOALL_HIER_EXCHANGE :
+                                         TORCH_UCX_ALLTOALL_HIER_SCATTER;
+            request->step  = 0;
+            break;
+        case TORCH_UCX_ALLTOALL_HIER_EXCHANGE:
+            if (request->step == 0) {
+                n_reqs = 0;
+                offset = 0;
+                for (int node = 0; node < topo->n_nodes; node++) {
+                    auto   &remote     = topo->node_ranks[node];
+                    int    remote_size = remote.size();
+                    size_t pair_len    = local_size * remote_size * data_size;
+
+                    if (node == topo->node_id) {
+                        continue;
+                    }
+                    for (int i = 0; i < local_size; i++) {
+                        for (int j = 0; j < remote_size; j++) {
+                            memcpy(send_pack + offset +
+                                   (i * remote_size + j) * data_size,
+                                   gathered + i * rank_len + remote[j] * data_size,
+                                   data_size);
+                        }
+                    }
+                    torch_ucx_recv_nb(p2p_comm, recv_pack + offset, pair_len,
+                                      topo->leaders[node], tag,
+                                      &request->reqs[n_reqs++],
+                                      TORCH_UCX_COLL_TAG);
+                    torch_ucx_send_nb(p2p_comm, send_pack + offset, pair_len,
+                                      topo->leaders[node], tag,
+                                      &request->reqs[n_reqs++],
+                                      TORCH_UCX_COLL_TAG);
+                    offset += pair_len;
+                }
+                request->n_active = n_reqs;
+                request->step     = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            for (int i = 0; i < local_size; i++) {
+                char *out = unpacked + i * rank_len;
+
+                for (int j = 0; j < local_size; j++) {
+                    memcpy(out + local[j] * data_size,
+                           gathered + j * rank_len + local[i] * data_size,
+                           data_size);
+                }
+                offset = 0;
+                for (int node = 0; node < topo->n_nodes; node++) {
+                    auto &remote     = topo->node_ranks[node];
+                    int  remote_size = remote.size();
+
+                    if (node == topo->node_id) {
+                        continue;
+                    }
+                    for (int j = 0; j < remote_size; j++) {
+                        memcpy(out + remote[j] * data_size,
+                               recv_pack + offset + (j * local_size + i) * data_size,
+                               data_size);
+                    }
+                    offset += local_size * remote_size * data_size;
+                }
+            }
+            request->phase = TORCH_UCX_ALLTOALL_HIER_SCATTER;
+            request->step  = 0;
+            break;
+        case TORCH_UCX_ALLTOALL_HIER_SCATTER:
+            if (shm) {
+                if (request->step == 0) {
+                    torch_ucx_shm_coll_init(&request->shm_coll,
+                                            request->shm_coll.seq + 1,
+                                            TORCH_UCX_SHM_SCATTER, 0,
+                                            unpacked, rbuf, rank_len,
+                                            TORCH_UCX_DT_UINT8, TORCH_UCX_OP_SUM);
+                    request->step = 1;
+                }
+                if (torch_ucx_shm_coll_progress(shm, &request->shm_coll) ==
+                    TORCH_UCX_INPROGRESS) {
+                    return TORCH_UCX_OK;
+                }
+            } else if (request->step == 0) {
+                if (is_leader) {
+                    memcpy(rbuf, unpacked, rank_len);
+                    for (int i = 1; i < local_size; i++) {
+                        torch_ucx_send_nb(p2p_comm, unpacked + i * rank_len,
+                                          rank_len, local[i], tag,
+                                          &request->reqs[i - 1],
+                                          TORCH_UCX_COLL_TAG);
+                    }
+                    request->n_active = local_size - 1;
+                } else {
+                    torch_ucx_recv_nb(p2p_comm, rbuf, rank_len, local[0], tag,
+                                      &request->reqs[0], TORCH_UCX_COLL_TAG);
+                    request->n_active = 1;
+                }
+                request->step = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            request->phase = TORCH_UCX_ALLTOALL_HIER_DONE;
+            break;
+        case TORCH_UCX_ALLTOALL_HIER_DONE:
+            delete[] request->reqs;
+            delete[] gathered;
+            request->scratch = NULL;
+            torch_ucx_metrics_record(&request->comm->metrics,
+                                     TORCH_UCX_METRICS_ALLTOALL,
+                                     request->len * request->comm->p2p_comm->size,
+                                     request->start_ns);
+            torch_ucx_trace("alltoall", TORCH_UCX_TRACE_END, request);
+            request->status  = TORCH_UCX_OK;
+            return TORCH_UCX_OK;
+        }
+    }
+}
+
+static torch_ucx_status_t torch_ucx_alltoall_hier_start(torch_ucx_coll_comm_t *comm,
+                                                        torch_ucx_coll_request_t *request)
+{
+    torch_ucx_topo_t *topo       = &comm->topo;
+    int              group_size  = comm->p2p_comm->size;
+    int              local_size  = topo->local_size;
+    int              n_reqs      = std::max(2 * topo->n_nodes, local_size);
+    size_t           rank_len    = group_size * request->len;
+
+    request->reqs     = new torch_ucx_request_t*[n_reqs];
+    request->max_reqs = n_reqs;
+    for (int i = 0; i < n_reqs; i++) {
+        request->reqs[i] = NULL;
+    }
+    if (topo->local_rank == 0) {
+        /* gathered + unpacked buffers and packed send + recv buffers */
+        request->scratch = new char[2 * local_size * rank_len +
+                                    2 * local_size * (group_size - local_size) *
+                                    request->len];
+    } else {
+        request->scratch = NULL;
+    }
+    if (comm->shm) {
+        torch_ucx_shm_coll_init(&request->shm_coll,
+                                torch_ucx_shm_reserve(comm->shm, 2),
+                                TORCH_UCX_SHM_GATHER, 0,
+                                request->src_buffer, request->scratch,
+                                rank_len, TORCH_UCX_DT_UINT8, TORCH_UCX_OP_SUM);
+    }
+
+    request->tag      = torch_ucx_coll_next_tag(comm);
+    request->comm     = comm;
+    request->n_active = 0;
+    request->phase    = TORCH_UCX_ALLTOALL_HIER_GATHER;
+    request->step     = 0;
+    request->status   = TORCH_UCX_INPROGRESS;
+    request->progress = torch_ucx_alltoall_hier_progress;
+
+    return torch_ucx_alltoall_hier_progress(request);
+}
 
 torch_ucx_status_t torch_ucx_alltoall_start(torch_ucx_coll_comm_t *comm,
                                             torch_ucx_coll_request_t *request)
@@ -144,17 +653,34 @@ torch_ucx_status_t torch_ucx_alltoall_start(torch_ucx_coll_comm_t *comm,
     size_t            data_size  = request->len;
     ptrdiff_t         sbuf       = (ptrdiff_t)request->src_buffer;
     ptrdiff_t         rbuf       = (ptrdiff_t)request->dst_buffer;
-    bool              reverse    = comm->config.reverse;
-    uint32_t          tag        = comm->last_tag;
+    bool              reverse    = request->config.reverse;
+    uint32_t          tag;
     int total_reqs;
 
-    if ((comm->config.chunk > group_size - 1) || (comm->config.chunk <= 0)) {
+    torch_ucx_trace("alltoall", TORCH_UCX_TRACE_BEGIN, request, data_size);
+    torch_ucx_coll_begin(comm, request, "alltoall");
+    if ((request->config.alltoall_hier_thresh > 0) &&
+        (data_size <= request->config.alltoall_hier_thresh) &&
+        (comm->topo.n_nodes > 1) && (comm->topo.n_nodes < group_size) &&
+        (request->src_buf_mtype == TORCH_UCX_HOST) &&
+        (request->dst_buf_mtype == TORCH_UCX_HOST)) {
+        return torch_ucx_alltoall_hier_start(comm, request);
+    }
+    /* compression is only implemented in the adaptive path */
+    if ((request->config.chunk == TORCH_UCX_CHUNK_AUTO) ||
+        torch_ucx_coll_compress(request)) {
+        return torch_ucx_alltoall_flow_start(comm, request);
+    }
+    tag = torch_ucx_coll_next_tag(comm);
+
+    if ((request->config.chunk > group_size - 1) || (request->config.chunk <= 0)) {
         total_reqs = group_size - 1;
     } else {
-        total_reqs = comm->config.chunk;
+        total_reqs = request->config.chunk;
     }
-    request->reqs = new torch_ucx_request_t*[2*(total_reqs+1)];
-    memset(request->reqs, 0, total_reqs * sizeof(torch_ucx_request_t));
+    request->reqs     = new torch_ucx_request_t*[2*(total_reqs+1)];
+    request->max_reqs = 2*(total_reqs+1);
+    memset(request->reqs, 0, 2*(total_reqs+1) * sizeof(torch_ucx_request_t*));
 
 
 
@@ -184,7 +710,6 @@ torch_ucx_status_t torch_ucx_alltoall_start(torch_ucx_coll_comm_t *comm,
     request->status   = TORCH_UCX_INPROGRESS;
     request->progress = torch_ucx_alltoall_progress;
 
-    comm->last_tag++;
     return TORCH_UCX_OK;
 }
 
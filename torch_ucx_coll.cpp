@@ -4,8 +4,17 @@
  * * See file LICENSE for terms.
  * */
 
+#include <algorithm>
 #include <cstdlib>
+#include <fstream>
+#include <map>
+#include <unistd.h>
 #include "torch_ucx_coll.hpp"
+#include "torch_ucx_compress.hpp"
+#include "torch_ucx_reduce.hpp"
+#include "torch_ucx_shm.hpp"
+#include "torch_ucx_sparse.hpp"
+#include "torch_ucx_tune.hpp"
 
 namespace c10d {
 
@@ -13,9 +22,20 @@ static void torch_ucx_get_coll_config(torch_ucx_coll_config_t *config)
 {
     char *env;
 
-    config->chunk     = 1;
-    config->reverse   = 0;
-    config->max_polls = 10;
+    config->chunk                = TORCH_UCX_CHUNK_AUTO;
+    config->reverse              = 0;
+    config->max_polls            = 10;
+    config->topo_aware           = true;
+    config->enable_shm           = true;
+    config->shm_slot_size        = 1 << 20;
+    config->alltoall_hier_thresh = 1024;
+    config->compress             = TORCH_UCX_COMPRESS_NONE;
+    config->compress_min         = 64 << 10;
+    config->compress_seg         = 256 << 10;
+    config->ring_thresh          = 16 << 20;
+    config->ring_seg             = 1 << 20;
+    config->ring_window          = 4;
+    config->watchdog_ns          = 0;
  
     env = std::getenv("TORCH_UCC_UCX_CHUNK");
     if (env) {
@@ -29,36 +49,388 @@ static void torch_ucx_get_coll_config(torch_ucx_coll_config_t *config)
     if (env) {
         config->max_polls = std::atoi(env);
     }
+    env = std::getenv("TORCH_UCC_UCX_TOPO_AWARE");
+    if (env) {
+        config->topo_aware = std::atoi(env);
+    }
+    env = std::getenv("TORCH_UCC_UCX_SHM");
+    if (env) {
+        config->enable_shm = std::atoi(env);
+    }
+    env = std::getenv("TORCH_UCC_UCX_SHM_SLOT");
+    if (env) {
+        config->shm_slot_size = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_UCX_ALLTOALL_HIER_THRESH");
+    if (env) {
+        config->alltoall_hier_thresh = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_UCX_COMPRESS");
+    if (env) {
+        config->compress = torch_ucx_compress_parse(env);
+    }
+    env = std::getenv("TORCH_UCC_UCX_COMPRESS_MIN");
+    if (env) {
+        config->compress_min = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_UCX_COMPRESS_SEG");
+    if (env) {
+        config->compress_seg = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_UCX_RING_THRESH");
+    if (env) {
+        config->ring_thresh = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_UCX_RING_SEG");
+    if (env) {
+        config->ring_seg = std::strtoull(env, NULL, 10);
+    }
+    env = std::getenv("TORCH_UCC_UCX_RING_WINDOW");
+    if (env) {
+        config->ring_window = std::max(std::atoi(env), 1);
+    }
+    env = std::getenv("TORCH_UCC_WATCHDOG");
+    if (env) {
+        config->watchdog_ns = std::max(std::atof(env), 0.0) * 1e9;
+    }
+}
+
+/* TORCH_UCC_HOST_ID replaces the node identity, so that node layouts can
+ * be emulated on one host */
+static std::string torch_ucx_get_host_id()
+{
+    char          hostname[256];
+    std::string   boot_id;
+    std::ifstream boot_id_file("/proc/sys/kernel/random/boot_id");
+    char          *env = std::getenv("TORCH_UCC_HOST_ID");
+
+    if (env) {
+        return env;
+    }
+    if (gethostname(hostname, sizeof(hostname)) != 0) {
+        hostname[0] = '\0';
+    }
+    hostname[sizeof(hostname) - 1] = '\0';
+    if (boot_id_file) {
+        std::getline(boot_id_file, boot_id);
+    }
+    return std::string(hostname) + ":" + boot_id;
+}
+
+static void torch_ucx_topo_init(torch_ucx_topo_t *topo, int size, int rank,
+                                const std::shared_ptr<Store>& store,
+                                bool topo_aware)
+{
+    std::map<std::string, int> host_to_node;
+    std::string                host_id;
+
+    if (topo_aware) {
+        host_id = torch_ucx_get_host_id();
+        store->set("host" + std::to_string(rank),
+                   std::vector<uint8_t>(host_id.begin(), host_id.end()));
+    }
+
+    topo->rank_node.resize(size);
+    topo->node_ranks.clear();
+    for (int i = 0; i < size; i++) {
+        int node;
+
+        if (topo_aware) {
+            auto peer_host = store->get("host" + std::to_string(i));
+            auto it = host_to_node.emplace(std::string(peer_host.begin(),
+                                                       peer_host.end()),
+                                           (int)topo->node_ranks.size());
+            node = it.first->second;
+        } else {
+            node = i;
+        }
+        if (node == (int)topo->node_ranks.size()) {
+            topo->node_ranks.emplace_back();
+        }
+        topo->rank_node[i] = node;
+        topo->node_ranks[node].push_back(i);
+    }
+
+    topo->n_nodes    = topo->node_ranks.size();
+    topo->node_id    = topo->rank_node[rank];
+    topo->local_size = topo->node_ranks[topo->node_id].size();
+    topo->local_rank = std::find(topo->node_ranks[topo->node_id].begin(),
+                                 topo->node_ranks[topo->node_id].end(), rank) -
+                       topo->node_ranks[topo->node_id].begin();
+    topo->leaders.resize(topo->n_nodes);
+    for (int i = 0; i < topo->n_nodes; i++) {
+        topo->leaders[i] = topo->node_ranks[i][0];
+    }
 }
 
 torch_ucx_status_t torch_ucx_coll_comm_init(torch_ucx_comm_t *p2p_comm,
+                                            const std::shared_ptr<Store>& store,
                                             torch_ucx_coll_comm_t **comm)
 {
     torch_ucx_coll_comm_t *coll_comm;
 
+    torch_ucx_trace_init();
     coll_comm = new torch_ucx_coll_comm_t;
     torch_ucx_get_coll_config(&coll_comm->config);
+    torch_ucx_topo_init(&coll_comm->topo, p2p_comm->size, p2p_comm->rank,
+                        store, coll_comm->config.topo_aware);
+    torch_ucx_topo_init(&coll_comm->flat_topo, p2p_comm->size, p2p_comm->rank,
+                        store, false);
+    coll_comm->shm = NULL;
+    if (coll_comm->config.enable_shm && (coll_comm->topo.local_size > 1)) {
+        if (torch_ucx_shm_init(&coll_comm->shm, &coll_comm->topo,
+                               p2p_comm->rank, store,
+                               coll_comm->config.shm_slot_size) != TORCH_UCX_OK) {
+            fprintf(stderr, "TorchUCC: failed to init shm, using ucx "
+                    "for intra-node transfers\n");
+            coll_comm->shm = NULL;
+        }
+    }
     coll_comm->p2p_comm = p2p_comm;
     coll_comm->last_tag = 0;
     coll_comm->stream   = 0;
+    coll_comm->tune     = NULL;
+    coll_comm->reducer  = NULL;
+    if ((coll_comm->config.ring_thresh > 0) &&
+        (torch_ucx_reducer_init(&coll_comm->reducer) != TORCH_UCX_OK)) {
+        fprintf(stderr, "TorchUCC: failed to start reduction thread, "
+                "reducing inline\n");
+        coll_comm->reducer = NULL;
+    }
+    for (int i = 0; i < TORCH_UCX_FLOW_N_CLASSES; i++) {
+        coll_comm->flow.window[i] = 0;
+        coll_comm->flow.peer_lat[i].assign(p2p_comm->size, 0);
+    }
+    torch_ucx_tune_init(coll_comm, store);
+    /* tuning runs are not counted */
+    torch_ucx_metrics_reset(&coll_comm->metrics);
+    coll_comm->metrics.queue_depth = 0;
+    coll_comm->metrics.queue_max   = 0;
 
     *comm = coll_comm;
     return TORCH_UCX_OK;
 }
 
+void torch_ucx_coll_get_config(torch_ucx_coll_comm_t *comm,
+                               torch_ucx_coll_type_t coll, size_t len,
+                               torch_ucx_coll_config_t *config)
+{
+    torch_ucx_tune_entry_t entry;
+
+    *config = comm->config;
+    if (torch_ucx_tune_lookup(comm, coll, len, &entry)) {
+        torch_ucx_tune_apply(&entry, config);
+    }
+}
+
+static void torch_ucx_coll_pending(torch_ucx_coll_request_t *request,
+                                   std::vector<torch_ucx_request_t**> *reqs)
+{
+    for (int i = 0; i < request->max_reqs; i++) {
+        if (request->reqs[i] != NULL) {
+            reqs->push_back(&request->reqs[i]);
+        }
+    }
+    if (request->progress == torch_ucx_allreduce_progress) {
+        torch_ucx_allreduce_pending(request, reqs);
+    }
+    if (request->progress == torch_ucx_sparse_progress) {
+        torch_ucx_sparse_pending(request, reqs);
+    }
+}
+
+/* first peer a message in flight is waiting on, -1 if there is none */
+static int torch_ucx_coll_first_peer(torch_ucx_coll_request_t *request)
+{
+    std::vector<torch_ucx_request_t**> reqs;
+
+    torch_ucx_coll_pending(request, &reqs);
+    for (auto req: reqs) {
+        if ((*req)->status != TORCH_UCX_REQUEST_DONE) {
+            return (*req)->peer;
+        }
+    }
+    return -1;
+}
+
+/* "<name> (tag t, phase p, step s) <what> after x s, waiting on peers ..." */
+static std::string torch_ucx_coll_describe(torch_ucx_coll_request_t *request,
+                                           const char *what, uint64_t now)
+{
+    std::vector<torch_ucx_request_t**> reqs;
+    std::vector<int>                   peers;
+    char                               buf[256];
+    std::string                        desc;
+
+    torch_ucx_coll_pending(request, &reqs);
+    for (auto req: reqs) {
+        if ((*req)->status != TORCH_UCX_REQUEST_DONE) {
+            peers.push_back((*req)->peer);
+        }
+    }
+    std::sort(peers.begin(), peers.end());
+    peers.erase(std::unique(peers.begin(), peers.end()), peers.end());
+
+    snprintf(buf, sizeof(buf), "%s (tag %u, phase %d, step %d) %s after %.1f s",
+             request->name, request->tag, request->phase, request->step, what,
+             (now - request->start_ns) / 1e9);
+    desc = buf;
+    if (peers.empty()) {
+        return desc + ", no messages in flight";
+    }
+    desc += ", waiting on peers";
+    for (auto peer: peers) {
+        desc += (peer < 0) ? " any" : " " + std::to_string(peer);
+    }
+    return desc;
+}
+
+/* Cancels what can be cancelled and fails the request. Its buffers stay
+ * allocated: sends ucp can't cancel and the reduction thread may still
+ * use them. */
+static void torch_ucx_coll_abort(torch_ucx_coll_request_t *request,
+                                 const std::string &reason)
+{
+    torch_ucx_comm_t                   *p2p_comm = request->comm->p2p_comm;
+    std::vector<torch_ucx_request_t**> reqs;
+
+    fprintf(stderr, "TorchUCC: rank %d %s\n", p2p_comm->rank, reason.c_str());
+    torch_ucx_coll_pending(request, &reqs);
+    for (auto req: reqs) {
+        torch_ucx_request_cancel(p2p_comm, *req);
+        *req = NULL;
+    }
+    request->error  = reason;
+    request->status = TORCH_UCX_ERROR;
+}
+
+/* Runs before every progress of a collective in flight: fails it once the
+ * comm has failed or the comm timeout expired, and reports it every
+ * watchdog period. */
+static void torch_ucx_coll_check(torch_ucx_coll_request_t *request)
+{
+    torch_ucx_comm_t *p2p_comm = request->comm->p2p_comm;
+    ucs_status_t     error     = p2p_comm->error.load(std::memory_order_acquire);
+    uint64_t         now;
+    std::string      what;
+
+    if (error != UCS_OK) {
+        what = "failed (peer " +
+               std::to_string(p2p_comm->error_peer.load(std::memory_order_acquire)) +
+               ": " + ucs_status_string(error) + ")";
+        torch_ucx_coll_abort(request,
+                             torch_ucx_coll_describe(request, what.c_str(),
+                                                     torch_ucx_metrics_now()));
+        return;
+    }
+    if ((p2p_comm->timeout_ns == 0) && (request->config.watchdog_ns == 0)) {
+        return;
+    }
+    now = torch_ucx_metrics_now();
+    if ((p2p_comm->timeout_ns > 0) &&
+        (now - request->start_ns > p2p_comm->timeout_ns)) {
+        /* later collectives would only wait for their turn behind this one,
+         * they fail right away instead */
+        torch_ucx_comm_set_error(p2p_comm, UCS_ERR_TIMED_OUT,
+                                 torch_ucx_coll_first_peer(request));
+        torch_ucx_coll_abort(request, torch_ucx_coll_describe(request,
+                                                              "timed out", now));
+        return;
+    }
+    if ((request->config.watchdog_ns > 0) &&
+        (now - request->report_ns >= request->config.watchdog_ns)) {
+        request->report_ns = now;
+        fprintf(stderr, "TorchUCC: rank %d %s\n", p2p_comm->rank,
+                torch_ucx_coll_describe(request, "in flight", now).c_str());
+    }
+}
+
+static void torch_ucx_coll_unlist(torch_ucx_coll_comm_t *comm,
+                                  torch_ucx_coll_request_t *request)
+{
+    std::lock_guard<std::mutex> lock(comm->outstanding_mutex);
+    auto it = std::find(comm->outstanding.begin(), comm->outstanding.end(),
+                        request);
+
+    if (it != comm->outstanding.end()) {
+        comm->outstanding.erase(it);
+    }
+}
+
 torch_ucx_status_t torch_ucx_coll_test(torch_ucx_coll_request_t *request)
 {
+    if (request->status == TORCH_UCX_INPROGRESS) {
+        torch_ucx_coll_check(request);
+    }
     if (request->status == TORCH_UCX_INPROGRESS) {
         request->progress(request);
     }
+    if (request->status != TORCH_UCX_INPROGRESS) {
+        torch_ucx_coll_unlist(request->comm, request);
+    }
     return request->status;
 }
 
+torch_ucx_status_t torch_ucx_coll_test_ordered(torch_ucx_coll_request_t *request)
+{
+    torch_ucx_coll_comm_t                  *comm = request->comm;
+    std::vector<torch_ucx_coll_request_t*> earlier;
+
+    if (request->status != TORCH_UCX_INPROGRESS) {
+        return torch_ucx_coll_test(request);
+    }
+    {
+        std::lock_guard<std::mutex> lock(comm->outstanding_mutex);
+
+        for (auto r: comm->outstanding) {
+            if (r == request) {
+                break;
+            }
+            earlier.push_back(r);
+        }
+    }
+    for (auto r: earlier) {
+        torch_ucx_coll_test(r);
+    }
+    return torch_ucx_coll_test(request);
+}
+
+void torch_ucx_coll_drain(torch_ucx_coll_comm_t *comm)
+{
+    torch_ucx_coll_request_t *last;
+
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(comm->outstanding_mutex);
+
+            if (comm->outstanding.empty()) {
+                return;
+            }
+            last = comm->outstanding.back();
+        }
+        torch_ucx_coll_test_ordered(last);
+    }
+}
+
+void torch_ucx_coll_release(torch_ucx_coll_request_t *request)
+{
+    if (request->comm == NULL) {
+        return;
+    }
+    torch_ucx_coll_unlist(request->comm, request);
+    if (request->progress == torch_ucx_sparse_progress) {
+        torch_ucx_coll_unlist(request->comm, &request->sparse->dense_req);
+    }
+}
+
 void torch_ucx_coll_comm_close(torch_ucx_coll_comm_t *comm)
 {
     if (comm->stream != 0) {
         cudaStreamDestroy(comm->stream);
     }
+    torch_ucx_tune_close(comm);
+    torch_ucx_reducer_close(comm->reducer);
+    torch_ucx_shm_close(comm->shm);
     delete comm;
 }
 
@@ -7,7 +7,12 @@
 #pragma once
 
 #include <cuda_runtime.h>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "torch_ucc_sendrecv.hpp"
+#include "torch_ucx_metrics.hpp"
+#include "torch_ucx_trace.hpp"
 
 namespace c10d {
 
@@ -19,21 +24,144 @@ enum torch_ucx_memtype_t {
     TORCH_UCX_CUDA
 };
 
+enum torch_ucx_dtype_t {
+    TORCH_UCX_DT_INT8,
+    TORCH_UCX_DT_UINT8,
+    TORCH_UCX_DT_INT32,
+    TORCH_UCX_DT_INT64,
+    TORCH_UCX_DT_FLOAT32,
+    TORCH_UCX_DT_FLOAT64,
+    TORCH_UCX_DT_INT16,
+    TORCH_UCX_DT_FLOAT16,
+    TORCH_UCX_DT_BFLOAT16,
+    TORCH_UCX_DT_BOOL,
+    TORCH_UCX_DT_COMPLEX64,
+    TORCH_UCX_DT_COMPLEX128,
+    TORCH_UCX_DT_LAST
+};
+
+enum torch_ucx_reduce_op_t {
+    TORCH_UCX_OP_SUM,
+    TORCH_UCX_OP_PROD,
+    TORCH_UCX_OP_MIN,
+    TORCH_UCX_OP_MAX,
+    TORCH_UCX_OP_BAND,
+    TORCH_UCX_OP_BOR,
+    TORCH_UCX_OP_BXOR,
+    TORCH_UCX_OP_LAST
+};
+
+/* wire format of fp32 data sent between nodes */
+enum torch_ucx_compress_t {
+    TORCH_UCX_COMPRESS_NONE,
+    TORCH_UCX_COMPRESS_BF16,
+    TORCH_UCX_COMPRESS_FP16,
+    TORCH_UCX_COMPRESS_INT8
+};
+
+/* chunk value that lets the alltoall adapt its window */
+#define TORCH_UCX_CHUNK_AUTO     (-1)
+#define TORCH_UCX_FLOW_N_CLASSES 4
+
 struct torch_ucx_coll_config_t {
-    int  chunk;
-    bool reverse;
-    int  max_polls;
+    int                  chunk;
+    bool                 reverse;
+    int                  max_polls;
+    bool                 topo_aware;
+    bool                 enable_shm;
+    size_t               shm_slot_size;
+    size_t               alltoall_hier_thresh;
+    torch_ucx_compress_t compress;
+    /* smallest message (per peer block for alltoall) worth compressing */
+    size_t               compress_min;
+    /* fp32 bytes per pipelined allreduce segment */
+    size_t               compress_seg;
+    /* segmented ring among node leaders for allreduces of ring_thresh
+     * bytes and more, 0 disables it */
+    size_t               ring_thresh;
+    size_t               ring_seg;
+    int                  ring_window;
+    /* collectives in flight for longer are reported every period, 0 is off */
+    uint64_t             watchdog_ns;
+};
+
+/* Ranks grouped by host, nodes and the ranks within a node are ordered
+ * by the lowest rank, the first rank of a node is its leader. */
+struct torch_ucx_topo_t {
+    int                           node_id;
+    int                           n_nodes;
+    int                           local_rank;
+    int                           local_size;
+    std::vector<int>              rank_node;
+    std::vector<std::vector<int>> node_ranks;
+    std::vector<int>              leaders;
+};
+
+enum torch_ucx_coll_type_t {
+    TORCH_UCX_COLL_ALLTOALL,
+    TORCH_UCX_COLL_ALLREDUCE,
+    TORCH_UCX_COLL_LAST
+};
+
+enum torch_ucx_shm_coll_type_t {
+    TORCH_UCX_SHM_REDUCE,
+    TORCH_UCX_SHM_BCAST,
+    TORCH_UCX_SHM_GATHER,
+    TORCH_UCX_SHM_SCATTER
+};
+
+/* State of one intra-node collective run by the shared memory engine,
+ * blocks of len bytes are moved through the segment slots in chunks. */
+struct torch_ucx_shm_coll_t {
+    torch_ucx_shm_coll_type_t type;
+    uint64_t                  seq;
+    int                       root;
+    void                      *sbuf;
+    void                      *rbuf;
+    size_t                    len;
+    size_t                    offset;
+    torch_ucx_dtype_t         dtype;
+    torch_ucx_reduce_op_t     op;
+    double                    scale;
+    uint64_t                  token;
+    int                       step;
 };
 
+/* Alltoall flow control state learned across calls per block size class:
+ * the last window (0 until first used) and the EWMA completion latency
+ * of every peer in seconds (0 until first measured). */
+struct torch_ucx_flow_t {
+    int                 window[TORCH_UCX_FLOW_N_CLASSES];
+    std::vector<double> peer_lat[TORCH_UCX_FLOW_N_CLASSES];
+};
+
+struct torch_ucx_shm_t;
+struct torch_ucx_tune_t;
+struct torch_ucx_sparse_t;
+struct torch_ucx_reducer_t;
+struct torch_ucx_ring_t;
+
 struct torch_ucx_coll_comm_t {
     torch_ucx_comm_t        *p2p_comm;
     torch_ucx_coll_config_t config;
+    torch_ucx_topo_t        topo;
+    /* every rank is its own node, used when topology is switched off per call */
+    torch_ucx_topo_t        flat_topo;
+    torch_ucx_shm_t         *shm;
+    torch_ucx_tune_t        *tune;
+    torch_ucx_reducer_t     *reducer;
+    torch_ucx_flow_t        flow;
+    torch_ucx_metrics_t     metrics;
     uint32_t                last_tag;
     cudaStream_t            stream;
+    /* started collectives in start order, which is also their shm order */
+    std::mutex                             outstanding_mutex;
+    std::vector<torch_ucx_coll_request_t*> outstanding;
 };
 
 struct torch_ucx_coll_request_t {
     torch_ucx_coll_comm_t   *comm;
+    torch_ucx_coll_config_t config;
     uint32_t                tag;
     torch_ucx_status_t      status;
     torch_ucx_progress_p    progress;
@@ -42,21 +170,154 @@ struct torch_ucx_coll_request_t {
     torch_ucx_memtype_t     dst_buf_mtype;
     void                    *dst_buffer;
     size_t                  len;
+    torch_ucx_dtype_t       dtype;
+    torch_ucx_reduce_op_t   op;
+    /* allreduce result = post_scale * op(pre_scale * inputs), SUM only */
+    double                  pre_scale;
+    double                  post_scale;
+    size_t                  count;
+    /* progress thread order, higher first */
+    int                     priority;
     torch_ucx_request_t     **reqs;
+    /* length of reqs, NULL entries are not in flight */
+    int                     max_reqs;
     int                     n_sreqs;
     int                     n_rreqs;
+    int                     n_active;
+    int                     phase;
+    int                     step;
+    void                    *scratch;
+    torch_ucx_shm_coll_t    shm_coll;
+    torch_ucx_sparse_t      *sparse;
+    torch_ucx_ring_t        *ring;
+    const char              *name;
+    uint64_t                start_ns;
+    uint64_t                report_ns;
+    /* why the collective failed when status is TORCH_UCX_ERROR */
+    std::string             error;
 };
 
+/* Called by every collective when it starts, latency, watchdog and
+ * timeout are measured from here */
+static inline void torch_ucx_coll_begin(torch_ucx_coll_comm_t *comm,
+                                        torch_ucx_coll_request_t *request,
+                                        const char *name)
+{
+    request->name      = name;
+    request->start_ns  = torch_ucx_metrics_now();
+    request->report_ns = request->start_ns;
+    request->error.clear();
+
+    std::lock_guard<std::mutex> lock(comm->outstanding_mutex);
+    comm->outstanding.push_back(request);
+}
+
+static inline uint32_t torch_ucx_coll_next_tag(torch_ucx_coll_comm_t *comm)
+{
+    uint32_t tag = comm->last_tag;
+
+    comm->last_tag = (comm->last_tag + 1) & TORCH_UCX_MAX_COL_TAG;
+    return tag;
+}
+
+/* Waits for the n_active requests a multi-phase collective has posted,
+ * returns false while some of them are still in flight. */
+static inline bool torch_ucx_coll_wait(torch_ucx_coll_request_t *request)
+{
+    torch_ucx_status_t st;
+
+    if (request->n_active == 0) {
+        return true;
+    }
+    st = torch_ucx_req_test(request->comm->p2p_comm, request->reqs,
+                            request->n_active, NULL,
+                            request->config.max_polls,
+                            request->n_active);
+    if (st == TORCH_UCX_INPROGRESS) {
+        return false;
+    }
+    torch_ucx_trace("step", TORCH_UCX_TRACE_POINT, request, 0, -1,
+                    request->phase, request->step);
+    request->n_active = 0;
+    return true;
+}
+
+static inline size_t torch_ucx_dtype_size(torch_ucx_dtype_t dtype)
+{
+    switch(dtype) {
+        case TORCH_UCX_DT_INT8:
+        case TORCH_UCX_DT_UINT8:
+        case TORCH_UCX_DT_BOOL:
+            return 1;
+        case TORCH_UCX_DT_INT16:
+        case TORCH_UCX_DT_FLOAT16:
+        case TORCH_UCX_DT_BFLOAT16:
+            return 2;
+        case TORCH_UCX_DT_INT32:
+        case TORCH_UCX_DT_FLOAT32:
+            return 4;
+        case TORCH_UCX_DT_INT64:
+        case TORCH_UCX_DT_FLOAT64:
+        case TORCH_UCX_DT_COMPLEX64:
+            return 8;
+        case TORCH_UCX_DT_COMPLEX128:
+            return 16;
+        default:
+            break;
+    }
+    return 0;
+}
+
 torch_ucx_status_t torch_ucx_coll_comm_init(torch_ucx_comm_t *p2p_comm,
+                                            const std::shared_ptr<Store>& store,
                                             torch_ucx_coll_comm_t **comm);
 
 torch_ucx_status_t torch_ucx_coll_test(torch_ucx_coll_request_t *request);
 
+/* Tests all collectives started before request first. A collective may
+ * wait for an earlier one, e.g. for its shm turn, so without a progress
+ * thread waiting on a later collective has to progress the earlier ones. */
+torch_ucx_status_t torch_ucx_coll_test_ordered(torch_ucx_coll_request_t *request);
+
+/* Completes all started collectives, only for the thread that progresses
+ * them */
+void torch_ucx_coll_drain(torch_ucx_coll_comm_t *comm);
+
+/* Forgets a collective released before it completed */
+void torch_ucx_coll_release(torch_ucx_coll_request_t *request);
+
+/* Fills the algorithm parameters for a collective of len bytes (per peer
+ * block for alltoall) from the tuning table or the comm defaults. */
+void torch_ucx_coll_get_config(torch_ucx_coll_comm_t *comm,
+                               torch_ucx_coll_type_t coll, size_t len,
+                               torch_ucx_coll_config_t *config);
+
 torch_ucx_status_t torch_ucx_alltoall_start(torch_ucx_coll_comm_t *comm,
                                             torch_ucx_coll_request_t *request);
 
 torch_ucx_status_t torch_ucx_alltoall_progress(torch_ucx_coll_request_t *request);
 
+torch_ucx_status_t torch_ucx_alltoall_flow_progress(torch_ucx_coll_request_t *request);
+
+torch_ucx_status_t torch_ucx_alltoall_hier_progress(torch_ucx_coll_request_t *request);
+
+torch_ucx_status_t torch_ucx_allreduce_start(torch_ucx_coll_comm_t *comm,
+                                             torch_ucx_coll_request_t *request);
+
+/* Starts an allreduce with a tag reserved earlier, so that it can be
+ * started from the progress of another collective. Shm sequence numbers
+ * can't be reserved that way, such allreduces have to run with
+ * topo_aware off. */
+torch_ucx_status_t torch_ucx_allreduce_start_tag(torch_ucx_coll_comm_t *comm,
+                                                 torch_ucx_coll_request_t *request,
+                                                 uint32_t tag);
+
+torch_ucx_status_t torch_ucx_allreduce_progress(torch_ucx_coll_request_t *request);
+
+/* Adds the requests in flight kept outside of request->reqs */
+void torch_ucx_allreduce_pending(torch_ucx_coll_request_t *request,
+                                 std::vector<torch_ucx_request_t**> *reqs);
+
 void torch_ucx_coll_comm_close(torch_ucx_coll_comm_t *comm);
 
 }
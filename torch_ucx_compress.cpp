@@ -0,0 +1,202 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "torch_ucx_compress.hpp"
+#include "torch_ucx_reduce.hpp"
+
+namespace c10d {
+
+/* fp32 elements decompressed on the stack per reduction pass */
+#define TORCH_UCX_COMPRESS_TILE 1024
+
+static inline size_t int8_n_blocks(size_t count)
+{
+    return (count + TORCH_UCX_COMPRESS_BLOCK - 1) / TORCH_UCX_COMPRESS_BLOCK;
+}
+
+size_t torch_ucx_compress_size(torch_ucx_compress_t cmp, size_t count)
+{
+    switch (cmp) {
+    case TORCH_UCX_COMPRESS_BF16:
+    case TORCH_UCX_COMPRESS_FP16:
+        return count * sizeof(uint16_t);
+    case TORCH_UCX_COMPRESS_INT8:
+        return int8_n_blocks(count) * sizeof(float) + count;
+    default:
+        break;
+    }
+    return count * sizeof(float);
+}
+
+/* Blocks with Inf or NaN have a negative scale, their finite values use
+ * codes up to INT8_SPECIAL - 1 and the codes from it up are the
+ * non-finite values, so an overflow still shows after the allreduce. */
+#define INT8_SPECIAL 126
+#define INT8_POS_INF INT8_SPECIAL
+#define INT8_NEG_INF (-INT8_SPECIAL)
+#define INT8_NAN     (-128)
+
+static inline int8_t int8_special(float v)
+{
+    if (std::isnan(v)) {
+        return INT8_NAN;
+    }
+    return (v > 0) ? INT8_POS_INF : INT8_NEG_INF;
+}
+
+static inline float int8_value(int8_t q, float scale)
+{
+    if (!std::signbit(scale)) {
+        return q * scale;
+    }
+    switch (q) {
+    case INT8_POS_INF:
+        return INFINITY;
+    case INT8_NEG_INF:
+        return -INFINITY;
+    case INT8_NAN:
+        return NAN;
+    default:
+        return -q * scale;
+    }
+}
+
+/* symmetric quantization, the block maximum maps to 127 */
+static void compress_int8(void *dst, const float *src, size_t count)
+{
+    float  *scales = (float*)dst;
+    int8_t *q      = (int8_t*)(scales + int8_n_blocks(count));
+
+    for (size_t b = 0; b < int8_n_blocks(count); b++) {
+        size_t start   = b * TORCH_UCX_COMPRESS_BLOCK;
+        size_t n       = std::min(count - start, (size_t)TORCH_UCX_COMPRESS_BLOCK);
+        float  amax    = 0;
+        float  qmax    = 127.0f;
+        bool   special = false;
+        float  inv;
+
+        for (size_t i = 0; i < n; i++) {
+            if (!std::isfinite(src[start + i])) {
+                special = true;
+                continue;
+            }
+            amax = std::max(amax, std::fabs(src[start + i]));
+        }
+        if (special) {
+            qmax = INT8_SPECIAL - 1;
+        }
+        scales[b] = special ? -amax / qmax : amax / qmax;
+        inv       = (amax > 0) ? qmax / amax : 0.0f;
+        for (size_t i = 0; i < n; i++) {
+            float v = src[start + i];
+
+            if (!std::isfinite(v)) {
+                q[start + i] = int8_special(v);
+                continue;
+            }
+            v            = std::nearbyint(v * inv);
+            q[start + i] = (int8_t)std::max(std::min(v, qmax), -qmax);
+        }
+    }
+}
+
+void torch_ucx_compress(torch_ucx_compress_t cmp, void *dst, const float *src,
+                        size_t count)
+{
+    uint16_t *d16 = (uint16_t*)dst;
+
+    switch (cmp) {
+    case TORCH_UCX_COMPRESS_BF16:
+        for (size_t i = 0; i < count; i++) {
+            d16[i] = torch_ucx_float_to_bf16(src[i]);
+        }
+        break;
+    case TORCH_UCX_COMPRESS_FP16:
+        for (size_t i = 0; i < count; i++) {
+            d16[i] = torch_ucx_float_to_half(src[i]);
+        }
+        break;
+    case TORCH_UCX_COMPRESS_INT8:
+        compress_int8(dst, src, count);
+        break;
+    default:
+        memcpy(dst, src, count * sizeof(float));
+        break;
+    }
+}
+
+/* decompresses elements [offset, offset + n) of a message of count elements */
+static void decompress_range(torch_ucx_compress_t cmp, float *dst,
+                             const void *src, size_t count, size_t offset,
+                             size_t n)
+{
+    const uint16_t *s16    = (const uint16_t*)src + offset;
+    const float    *scales = (const float*)src;
+    const int8_t   *q      = (const int8_t*)(scales + int8_n_blocks(count));
+
+    switch (cmp) {
+    case TORCH_UCX_COMPRESS_BF16:
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = torch_ucx_bf16_to_float(s16[i]);
+        }
+        break;
+    case TORCH_UCX_COMPRESS_FP16:
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = torch_ucx_half_to_float(s16[i]);
+        }
+        break;
+    case TORCH_UCX_COMPRESS_INT8:
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = int8_value(q[offset + i],
+                                scales[(offset + i) / TORCH_UCX_COMPRESS_BLOCK]);
+        }
+        break;
+    default:
+        memcpy(dst, (const float*)src + offset, n * sizeof(float));
+        break;
+    }
+}
+
+void torch_ucx_decompress(torch_ucx_compress_t cmp, float *dst, const void *src,
+                          size_t count)
+{
+    decompress_range(cmp, dst, src, count, 0, count);
+}
+
+void torch_ucx_decompress_reduce(torch_ucx_compress_t cmp, float *dst,
+                                 const void *src, size_t count,
+                                 torch_ucx_reduce_op_t op, double scale)
+{
+    float      tile[TORCH_UCX_COMPRESS_TILE];
+    const void *tile_src = tile;
+
+    for (size_t i = 0; i < count; i += TORCH_UCX_COMPRESS_TILE) {
+        size_t n = std::min(count - i, (size_t)TORCH_UCX_COMPRESS_TILE);
+
+        decompress_range(cmp, tile, src, count, i, n);
+        torch_ucx_reduce_n_scaled(dst + i, &tile_src, 1, n,
+                                  TORCH_UCX_DT_FLOAT32, op, scale);
+    }
+}
+
+torch_ucx_compress_t torch_ucx_compress_parse(const char *name)
+{
+    if (!strcmp(name, "bf16")) {
+        return TORCH_UCX_COMPRESS_BF16;
+    } else if (!strcmp(name, "fp16")) {
+        return TORCH_UCX_COMPRESS_FP16;
+    } else if (!strcmp(name, "int8")) {
+        return TORCH_UCX_COMPRESS_INT8;
+    } else if (strcmp(name, "none") && strcmp(name, "0")) {
+        fprintf(stderr, "TorchUCC: unknown compression %s, using none\n", name);
+    }
+    return TORCH_UCX_COMPRESS_NONE;
+}
+
+}
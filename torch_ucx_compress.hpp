@@ -0,0 +1,48 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include "torch_ucx_coll.hpp"
+
+namespace c10d {
+
+/* fp32 elements sharing one scale in the int8 format, segment lengths
+ * are multiples of it so every segment is an independent message */
+#define TORCH_UCX_COMPRESS_BLOCK 256
+
+/* Wire formats of fp32 data: bf16 and fp16 halve the bytes, int8 keeps
+ * one fp32 scale per block followed by the quantized values. Inf and NaN
+ * survive all formats. */
+size_t torch_ucx_compress_size(torch_ucx_compress_t cmp, size_t count);
+
+void torch_ucx_compress(torch_ucx_compress_t cmp, void *dst, const float *src,
+                        size_t count);
+
+void torch_ucx_decompress(torch_ucx_compress_t cmp, float *dst, const void *src,
+                          size_t count);
+
+/* dst = scale * op(dst, decompress(src)) */
+void torch_ucx_decompress_reduce(torch_ucx_compress_t cmp, float *dst,
+                                 const void *src, size_t count,
+                                 torch_ucx_reduce_op_t op, double scale);
+
+torch_ucx_compress_t torch_ucx_compress_parse(const char *name);
+
+/* Compression used for the inter-node messages of a request, only host
+ * fp32 data of at least compress_min bytes is compressed. */
+static inline torch_ucx_compress_t torch_ucx_coll_compress(torch_ucx_coll_request_t *request)
+{
+    if ((request->dtype != TORCH_UCX_DT_FLOAT32) ||
+        (request->src_buf_mtype != TORCH_UCX_HOST) ||
+        (request->dst_buf_mtype != TORCH_UCX_HOST) ||
+        (request->len < request->config.compress_min)) {
+        return TORCH_UCX_COMPRESS_NONE;
+    }
+    return request->config.compress;
+}
+
+}
@@ -0,0 +1,79 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include "torch_ucx_metrics.hpp"
+
+namespace c10d {
+
+const char *torch_ucx_metrics_coll_names[TORCH_UCX_METRICS_LAST] = {
+    "allreduce",
+    "alltoall",
+    "sparse",
+    "reduce",
+    "broadcast",
+    "allgather",
+    "barrier",
+    "send",
+    "recv"
+};
+
+void torch_ucx_metrics_reset(torch_ucx_metrics_t *metrics)
+{
+    for (int c = 0; c < TORCH_UCX_METRICS_LAST; c++) {
+        torch_ucx_coll_metrics_t *cm = &metrics->coll[c];
+
+        cm->ops   = 0;
+        cm->bytes = 0;
+        for (int i = 0; i < TORCH_UCX_METRICS_N_SIZES; i++) {
+            for (int j = 0; j < TORCH_UCX_METRICS_N_LATS; j++) {
+                cm->lat[i][j] = 0;
+            }
+        }
+    }
+    metrics->queue_max = metrics->queue_depth.load();
+    metrics->busy_ns   = 0;
+}
+
+size_t torch_ucx_metrics_size_bound(int bucket)
+{
+    return ((size_t)1024) << (2 * bucket);
+}
+
+double torch_ucx_metrics_lat_bound_us(int bucket)
+{
+    return 8.0 * (1 << bucket);
+}
+
+void torch_ucx_metrics_count(torch_ucx_metrics_t *metrics,
+                             torch_ucx_metrics_coll_t coll, size_t bytes)
+{
+    torch_ucx_coll_metrics_t *cm = &metrics->coll[coll];
+
+    cm->ops.fetch_add(1, std::memory_order_relaxed);
+    cm->bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void torch_ucx_metrics_record(torch_ucx_metrics_t *metrics,
+                              torch_ucx_metrics_coll_t coll, size_t bytes,
+                              uint64_t start_ns)
+{
+    torch_ucx_coll_metrics_t *cm  = &metrics->coll[coll];
+    double                   lat  = (torch_ucx_metrics_now() - start_ns) / 1e3;
+    int                      size = 0;
+    int                      bin  = 0;
+
+    while ((size < TORCH_UCX_METRICS_N_SIZES - 1) &&
+           (bytes > torch_ucx_metrics_size_bound(size))) {
+        size++;
+    }
+    while ((bin < TORCH_UCX_METRICS_N_LATS - 1) &&
+           (lat > torch_ucx_metrics_lat_bound_us(bin))) {
+        bin++;
+    }
+    cm->lat[size][bin].fetch_add(1, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,79 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace c10d {
+
+/* size bucket i holds collectives up to 1K << 2*i bytes, the last one
+ * everything larger */
+#define TORCH_UCX_METRICS_N_SIZES 8
+/* latency bucket j holds latencies up to 8us << j, the last one everything
+ * larger */
+#define TORCH_UCX_METRICS_N_LATS  16
+
+enum torch_ucx_metrics_coll_t {
+    TORCH_UCX_METRICS_ALLREDUCE,
+    TORCH_UCX_METRICS_ALLTOALL,
+    TORCH_UCX_METRICS_SPARSE,
+    TORCH_UCX_METRICS_REDUCE,
+    TORCH_UCX_METRICS_BROADCAST,
+    TORCH_UCX_METRICS_ALLGATHER,
+    TORCH_UCX_METRICS_BARRIER,
+    TORCH_UCX_METRICS_SEND,
+    TORCH_UCX_METRICS_RECV,
+    TORCH_UCX_METRICS_LAST
+};
+
+/* ops and bytes count every op of the group as it is posted, whatever the
+ * backend. Latencies are only known for the ops run by the UCX
+ * collectives (allreduce, alltoall and sparse), the histograms of the
+ * others stay empty. */
+struct torch_ucx_coll_metrics_t {
+    std::atomic<uint64_t> ops;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> lat[TORCH_UCX_METRICS_N_SIZES][TORCH_UCX_METRICS_N_LATS];
+};
+
+/* Updated with relaxed atomics from whichever thread completes the
+ * collective, readers see a consistent value per counter only. */
+struct torch_ucx_metrics_t {
+    torch_ucx_coll_metrics_t coll[TORCH_UCX_METRICS_LAST];
+    /* progress thread queue, busy is the time spent progressing */
+    std::atomic<uint64_t>    queue_depth;
+    std::atomic<uint64_t>    queue_max;
+    std::atomic<uint64_t>    busy_ns;
+};
+
+extern const char *torch_ucx_metrics_coll_names[TORCH_UCX_METRICS_LAST];
+
+static inline uint64_t torch_ucx_metrics_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void torch_ucx_metrics_reset(torch_ucx_metrics_t *metrics);
+
+void torch_ucx_metrics_count(torch_ucx_metrics_t *metrics,
+                             torch_ucx_metrics_coll_t coll, size_t bytes);
+
+/* latency of a completed UCX collective, the op was counted when posted */
+void torch_ucx_metrics_record(torch_ucx_metrics_t *metrics,
+                              torch_ucx_metrics_coll_t coll, size_t bytes,
+                              uint64_t start_ns);
+
+/* upper bounds of the buckets, the last one is unbounded */
+size_t torch_ucx_metrics_size_bound(int bucket);
+
+double torch_ucx_metrics_lat_bound_us(int bucket);
+
+}
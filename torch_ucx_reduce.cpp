@@ -0,0 +1,523 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <algorithm>
+#include <complex>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <ATen/Parallel.h>
+#include "torch_ucx_reduce.hpp"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace c10d {
+
+/* elements reduced per pass over the sources, fp16/bf16 tiles are
+ * accumulated in fp32 on the stack */
+#define TORCH_UCX_REDUCE_TILE 1024
+
+#define TORCH_UCX_REDUCE_INLINE inline __attribute__((always_inline))
+
+typedef void (*torch_ucx_reduce_fn_t)(void *dst, const void * const *srcs,
+                                      int n_srcs, size_t count, double scale);
+
+enum torch_ucx_reduce_isa_t {
+    TORCH_UCX_REDUCE_ISA_GENERIC,
+    TORCH_UCX_REDUCE_ISA_AVX2,
+    TORCH_UCX_REDUCE_ISA_AVX512
+};
+
+static torch_ucx_reduce_fn_t reduce_table[TORCH_UCX_DT_LAST][TORCH_UCX_OP_LAST];
+static size_t                reduce_par_thresh;
+static std::once_flag        reduce_init_flag;
+
+struct reduce_sum {
+    template <typename T>
+    static TORCH_UCX_REDUCE_INLINE T apply(T a, T b) { return a + b; }
+};
+
+struct reduce_prod {
+    template <typename T>
+    static TORCH_UCX_REDUCE_INLINE T apply(T a, T b) { return a * b; }
+};
+
+struct reduce_min {
+    template <typename T>
+    static TORCH_UCX_REDUCE_INLINE T apply(T a, T b) { return std::min(a, b); }
+};
+
+struct reduce_max {
+    template <typename T>
+    static TORCH_UCX_REDUCE_INLINE T apply(T a, T b) { return std::max(a, b); }
+};
+
+/* bool tensors hold 0 or 1, so the logical ops are the bitwise ones */
+struct reduce_land {
+    template <typename T>
+    static TORCH_UCX_REDUCE_INLINE T apply(T a, T b) { return a & b; }
+};
+
+struct reduce_lor {
+    template <typename T>
+    static TORCH_UCX_REDUCE_INLINE T apply(T a, T b) { return a | b; }
+};
+
+struct reduce_xor {
+    template <typename T>
+    static TORCH_UCX_REDUCE_INLINE T apply(T a, T b) { return a ^ b; }
+};
+
+struct cvt_bf16 {
+    static TORCH_UCX_REDUCE_INLINE void load(float *dst, const uint16_t *src,
+                                             size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = torch_ucx_bf16_to_float(src[i]);
+        }
+    }
+
+    static TORCH_UCX_REDUCE_INLINE void store(uint16_t *dst, const float *src,
+                                              size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = torch_ucx_float_to_bf16(src[i]);
+        }
+    }
+};
+
+struct cvt_half {
+    static TORCH_UCX_REDUCE_INLINE void load(float *dst, const uint16_t *src,
+                                             size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = torch_ucx_half_to_float(src[i]);
+        }
+    }
+
+    static TORCH_UCX_REDUCE_INLINE void store(uint16_t *dst, const float *src,
+                                              size_t n)
+    {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = torch_ucx_float_to_half(src[i]);
+        }
+    }
+};
+
+/* The result of every tile is scaled while it is still in cache */
+template <typename T, typename Op>
+static TORCH_UCX_REDUCE_INLINE void reduce_kernel(void *dst,
+                                                  const void * const *srcs,
+                                                  int n_srcs, size_t count,
+                                                  double scale)
+{
+    for (size_t off = 0; off < count; off += TORCH_UCX_REDUCE_TILE) {
+        size_t n = std::min((size_t)TORCH_UCX_REDUCE_TILE, count - off);
+        T * __restrict__ out = (T*)dst + off;
+
+        for (int s = 0; s < n_srcs; s++) {
+            const T * __restrict__ in = (const T*)srcs[s] + off;
+
+            for (size_t i = 0; i < n; i++) {
+                out[i] = Op::apply(out[i], in[i]);
+            }
+        }
+        if (scale != 1.0) {
+            for (size_t i = 0; i < n; i++) {
+                out[i] = out[i] * (T)scale;
+            }
+        }
+    }
+}
+
+template <typename Cvt, typename Op>
+static TORCH_UCX_REDUCE_INLINE void reduce_kernel_f16(void *dst,
+                                                      const void * const *srcs,
+                                                      int n_srcs, size_t count,
+                                                      double scale)
+{
+    float acc[TORCH_UCX_REDUCE_TILE];
+    float tmp[TORCH_UCX_REDUCE_TILE];
+
+    for (size_t off = 0; off < count; off += TORCH_UCX_REDUCE_TILE) {
+        size_t n = std::min((size_t)TORCH_UCX_REDUCE_TILE, count - off);
+
+        Cvt::load(acc, (const uint16_t*)dst + off, n);
+        for (int s = 0; s < n_srcs; s++) {
+            Cvt::load(tmp, (const uint16_t*)srcs[s] + off, n);
+            for (size_t i = 0; i < n; i++) {
+                acc[i] = Op::apply(acc[i], tmp[i]);
+            }
+        }
+        if (scale != 1.0) {
+            for (size_t i = 0; i < n; i++) {
+                acc[i] *= (float)scale;
+            }
+        }
+        Cvt::store((uint16_t*)dst + off, acc, n);
+    }
+}
+
+template <typename T, typename Op>
+static void reduce_generic(void *dst, const void * const *srcs, int n_srcs,
+                           size_t count, double scale)
+{
+    reduce_kernel<T, Op>(dst, srcs, n_srcs, count, scale);
+}
+
+template <typename Cvt, typename Op>
+static void reduce_generic_f16(void *dst, const void * const *srcs,
+                               int n_srcs, size_t count, double scale)
+{
+    reduce_kernel_f16<Cvt, Op>(dst, srcs, n_srcs, count, scale);
+}
+
+#if defined(__x86_64__)
+/* The same kernels compiled for wider vectors. fp16 conversion uses the
+ * hardware instructions when the CPU has F16C, they are kept out of the
+ * kernels so these run without it. */
+#define TORCH_UCX_TARGET_AVX2   __attribute__((target("avx2,fma")))
+#define TORCH_UCX_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx2,fma")))
+#define TORCH_UCX_TARGET_F16C   __attribute__((target("avx2,f16c")))
+#define TORCH_UCX_TARGET_AVX512_F16C \
+    __attribute__((target("avx512f,avx512bw,avx512vl,avx2,f16c")))
+
+struct cvt_half_avx2 {
+    static TORCH_UCX_TARGET_F16C
+    void load(float *dst, const uint16_t *src, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(
+                _mm_loadu_si128((const __m128i*)(src + i))));
+        }
+        cvt_half::load(dst + i, src + i, n - i);
+    }
+
+    static TORCH_UCX_TARGET_F16C
+    void store(uint16_t *dst, const float *src, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 8 <= n; i += 8) {
+            _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(
+                _mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+        cvt_half::store(dst + i, src + i, n - i);
+    }
+};
+
+struct cvt_half_avx512 {
+    static TORCH_UCX_TARGET_AVX512_F16C
+    void load(float *dst, const uint16_t *src, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16) {
+            _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(
+                _mm256_loadu_si256((const __m256i*)(src + i))));
+        }
+        cvt_half_avx2::load(dst + i, src + i, n - i);
+    }
+
+    static TORCH_UCX_TARGET_AVX512_F16C
+    void store(uint16_t *dst, const float *src, size_t n)
+    {
+        size_t i = 0;
+
+        for (; i + 16 <= n; i += 16) {
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm512_cvtps_ph(
+                _mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+        cvt_half_avx2::store(dst + i, src + i, n - i);
+    }
+};
+
+template <typename T, typename Op>
+TORCH_UCX_TARGET_AVX2
+static void reduce_avx2(void *dst, const void * const *srcs, int n_srcs,
+                        size_t count, double scale)
+{
+    reduce_kernel<T, Op>(dst, srcs, n_srcs, count, scale);
+}
+
+template <typename Cvt, typename Op>
+TORCH_UCX_TARGET_AVX2
+static void reduce_avx2_f16(void *dst, const void * const *srcs, int n_srcs,
+                            size_t count, double scale)
+{
+    reduce_kernel_f16<Cvt, Op>(dst, srcs, n_srcs, count, scale);
+}
+
+template <typename T, typename Op>
+TORCH_UCX_TARGET_AVX512
+static void reduce_avx512(void *dst, const void * const *srcs, int n_srcs,
+                          size_t count, double scale)
+{
+    reduce_kernel<T, Op>(dst, srcs, n_srcs, count, scale);
+}
+
+template <typename Cvt, typename Op>
+TORCH_UCX_TARGET_AVX512
+static void reduce_avx512_f16(void *dst, const void * const *srcs, int n_srcs,
+                              size_t count, double scale)
+{
+    reduce_kernel_f16<Cvt, Op>(dst, srcs, n_srcs, count, scale);
+}
+#endif
+
+#define TORCH_UCX_REDUCE_SET(_fn, _dt, _T)                                   \
+    do {                                                                     \
+        reduce_table[_dt][TORCH_UCX_OP_SUM]  = _fn<_T, reduce_sum>;          \
+        reduce_table[_dt][TORCH_UCX_OP_PROD] = _fn<_T, reduce_prod>;         \
+        reduce_table[_dt][TORCH_UCX_OP_MIN]  = _fn<_T, reduce_min>;          \
+        reduce_table[_dt][TORCH_UCX_OP_MAX]  = _fn<_T, reduce_max>;          \
+    } while (0)
+
+#define TORCH_UCX_REDUCE_SET_BITWISE(_fn, _dt, _T)                           \
+    do {                                                                     \
+        reduce_table[_dt][TORCH_UCX_OP_BAND] = _fn<_T, reduce_land>;         \
+        reduce_table[_dt][TORCH_UCX_OP_BOR]  = _fn<_T, reduce_lor>;          \
+        reduce_table[_dt][TORCH_UCX_OP_BXOR] = _fn<_T, reduce_xor>;          \
+    } while (0)
+
+/* min and max are not defined for complex numbers */
+#define TORCH_UCX_REDUCE_FILL(_fn, _fn_f16, _cvt_half)                       \
+    do {                                                                     \
+        TORCH_UCX_REDUCE_SET(_fn, TORCH_UCX_DT_INT8, int8_t);                \
+        TORCH_UCX_REDUCE_SET(_fn, TORCH_UCX_DT_UINT8, uint8_t);              \
+        TORCH_UCX_REDUCE_SET(_fn, TORCH_UCX_DT_INT16, int16_t);              \
+        TORCH_UCX_REDUCE_SET(_fn, TORCH_UCX_DT_INT32, int32_t);              \
+        TORCH_UCX_REDUCE_SET(_fn, TORCH_UCX_DT_INT64, int64_t);              \
+        TORCH_UCX_REDUCE_SET(_fn, TORCH_UCX_DT_FLOAT32, float);              \
+        TORCH_UCX_REDUCE_SET(_fn, TORCH_UCX_DT_FLOAT64, double);             \
+        TORCH_UCX_REDUCE_SET(_fn_f16, TORCH_UCX_DT_FLOAT16, _cvt_half);      \
+        TORCH_UCX_REDUCE_SET(_fn_f16, TORCH_UCX_DT_BFLOAT16, cvt_bf16);      \
+        TORCH_UCX_REDUCE_SET_BITWISE(_fn, TORCH_UCX_DT_INT8, int8_t);        \
+        TORCH_UCX_REDUCE_SET_BITWISE(_fn, TORCH_UCX_DT_UINT8, uint8_t);      \
+        TORCH_UCX_REDUCE_SET_BITWISE(_fn, TORCH_UCX_DT_INT16, int16_t);      \
+        TORCH_UCX_REDUCE_SET_BITWISE(_fn, TORCH_UCX_DT_INT32, int32_t);      \
+        TORCH_UCX_REDUCE_SET_BITWISE(_fn, TORCH_UCX_DT_INT64, int64_t);      \
+        TORCH_UCX_REDUCE_SET_BITWISE(_fn, TORCH_UCX_DT_BOOL, uint8_t);       \
+        reduce_table[TORCH_UCX_DT_BOOL][TORCH_UCX_OP_SUM]  =                 \
+            _fn<uint8_t, reduce_lor>;                                        \
+        reduce_table[TORCH_UCX_DT_BOOL][TORCH_UCX_OP_PROD] =                 \
+            _fn<uint8_t, reduce_land>;                                       \
+        reduce_table[TORCH_UCX_DT_BOOL][TORCH_UCX_OP_MIN]  =                 \
+            _fn<uint8_t, reduce_land>;                                       \
+        reduce_table[TORCH_UCX_DT_BOOL][TORCH_UCX_OP_MAX]  =                 \
+            _fn<uint8_t, reduce_lor>;                                        \
+        reduce_table[TORCH_UCX_DT_COMPLEX64][TORCH_UCX_OP_SUM]  =            \
+            _fn<std::complex<float>, reduce_sum>;                            \
+        reduce_table[TORCH_UCX_DT_COMPLEX64][TORCH_UCX_OP_PROD] =            \
+            _fn<std::complex<float>, reduce_prod>;                           \
+        reduce_table[TORCH_UCX_DT_COMPLEX128][TORCH_UCX_OP_SUM]  =           \
+            _fn<std::complex<double>, reduce_sum>;                           \
+        reduce_table[TORCH_UCX_DT_COMPLEX128][TORCH_UCX_OP_PROD] =           \
+            _fn<std::complex<double>, reduce_prod>;                          \
+    } while (0)
+
+/* Widest ISA the CPU has, TORCH_UCC_UCX_REDUCE_ISA=generic|avx2|avx512
+ * can only lower it. */
+static torch_ucx_reduce_isa_t torch_ucx_reduce_get_isa()
+{
+    torch_ucx_reduce_isa_t isa = TORCH_UCX_REDUCE_ISA_GENERIC;
+    char                   *env;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl")) {
+        isa = TORCH_UCX_REDUCE_ISA_AVX512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        isa = TORCH_UCX_REDUCE_ISA_AVX2;
+    }
+#endif
+    env = std::getenv("TORCH_UCC_UCX_REDUCE_ISA");
+    if (env) {
+        if (std::string(env) == "generic") {
+            isa = TORCH_UCX_REDUCE_ISA_GENERIC;
+        } else if ((std::string(env) == "avx2") &&
+                   (isa == TORCH_UCX_REDUCE_ISA_AVX512)) {
+            isa = TORCH_UCX_REDUCE_ISA_AVX2;
+        }
+    }
+    return isa;
+}
+
+#if defined(__x86_64__)
+static bool torch_ucx_reduce_has_f16c()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_F16C) != 0;
+}
+#endif
+
+static void torch_ucx_reduce_init()
+{
+    char *env;
+
+    reduce_par_thresh = 1 << 20;
+    env = std::getenv("TORCH_UCC_UCX_REDUCE_PAR_THRESH");
+    if (env) {
+        reduce_par_thresh = std::strtoull(env, NULL, 10);
+    }
+
+    switch (torch_ucx_reduce_get_isa()) {
+#if defined(__x86_64__)
+    case TORCH_UCX_REDUCE_ISA_AVX512:
+        if (torch_ucx_reduce_has_f16c()) {
+            TORCH_UCX_REDUCE_FILL(reduce_avx512, reduce_avx512_f16,
+                                  cvt_half_avx512);
+        } else {
+            TORCH_UCX_REDUCE_FILL(reduce_avx512, reduce_avx512_f16, cvt_half);
+        }
+        break;
+    case TORCH_UCX_REDUCE_ISA_AVX2:
+        if (torch_ucx_reduce_has_f16c()) {
+            TORCH_UCX_REDUCE_FILL(reduce_avx2, reduce_avx2_f16, cvt_half_avx2);
+        } else {
+            TORCH_UCX_REDUCE_FILL(reduce_avx2, reduce_avx2_f16, cvt_half);
+        }
+        break;
+#endif
+    default:
+        TORCH_UCX_REDUCE_FILL(reduce_generic, reduce_generic_f16, cvt_half);
+        break;
+    }
+}
+
+static inline torch_ucx_reduce_fn_t torch_ucx_reduce_get_fn(torch_ucx_dtype_t dtype,
+                                                            torch_ucx_reduce_op_t op)
+{
+    std::call_once(reduce_init_flag, torch_ucx_reduce_init);
+    if ((dtype >= TORCH_UCX_DT_LAST) || (op >= TORCH_UCX_OP_LAST)) {
+        return NULL;
+    }
+    return reduce_table[dtype][op];
+}
+
+bool torch_ucx_reduce_supported(torch_ucx_dtype_t dtype,
+                                torch_ucx_reduce_op_t op)
+{
+    return torch_ucx_reduce_get_fn(dtype, op) != NULL;
+}
+
+void torch_ucx_reduce_n_scaled(void *dst, const void * const *srcs, int n_srcs,
+                               size_t count, torch_ucx_dtype_t dtype,
+                               torch_ucx_reduce_op_t op, double scale)
+{
+    torch_ucx_reduce_fn_t fn      = torch_ucx_reduce_get_fn(dtype, op);
+    size_t                dt_size = torch_ucx_dtype_size(dtype);
+
+    if (fn == NULL) {
+        fprintf(stderr, "TorchUCC: unsupported reduction dtype %d op %d\n",
+                dtype, op);
+        return;
+    }
+    if ((n_srcs == 0) && (scale == 1.0)) {
+        return;
+    }
+    if ((count * dt_size < reduce_par_thresh) || (at::get_num_threads() == 1)) {
+        fn(dst, srcs, n_srcs, count, scale);
+        return;
+    }
+    at::parallel_for(0, count, std::max(reduce_par_thresh / 4 / dt_size, (size_t)1),
+                     [&](int64_t begin, int64_t end) {
+        std::vector<const void*> part(n_srcs);
+
+        for (int s = 0; s < n_srcs; s++) {
+            part[s] = (const char*)srcs[s] + begin * dt_size;
+        }
+        fn((char*)dst + begin * dt_size, part.data(), n_srcs, end - begin,
+           scale);
+    });
+}
+
+void torch_ucx_reduce_n(void *dst, const void * const *srcs, int n_srcs,
+                        size_t count, torch_ucx_dtype_t dtype,
+                        torch_ucx_reduce_op_t op)
+{
+    torch_ucx_reduce_n_scaled(dst, srcs, n_srcs, count, dtype, op, 1.0);
+}
+
+void torch_ucx_reduce(void *dst, const void *src, size_t count,
+                      torch_ucx_dtype_t dtype, torch_ucx_reduce_op_t op)
+{
+    torch_ucx_reduce_n(dst, &src, 1, count, dtype, op);
+}
+
+static void torch_ucx_reducer_run_task(const torch_ucx_reducer_task_t *task)
+{
+    torch_ucx_reduce_n_scaled(task->dst, &task->src, 1, task->count,
+                              task->dtype, task->op, task->scale);
+    task->done->fetch_add(1, std::memory_order_release);
+}
+
+static void torch_ucx_reducer_loop(torch_ucx_reducer_t *reducer)
+{
+    std::unique_lock<std::mutex> lock(reducer->mutex);
+    torch_ucx_reducer_task_t     task;
+
+    while (!reducer->stop) {
+        if (reducer->queue.empty()) {
+            reducer->cv.wait(lock);
+            continue;
+        }
+        task = reducer->queue.front();
+        reducer->queue.pop_front();
+        lock.unlock();
+        torch_ucx_reducer_run_task(&task);
+        lock.lock();
+    }
+}
+
+torch_ucx_status_t torch_ucx_reducer_init(torch_ucx_reducer_t **reducer)
+{
+    torch_ucx_reducer_t *r = new torch_ucx_reducer_t;
+
+    r->stop   = false;
+    r->thread = std::thread(torch_ucx_reducer_loop, r);
+    *reducer  = r;
+    return TORCH_UCX_OK;
+}
+
+void torch_ucx_reducer_submit(torch_ucx_reducer_t *reducer,
+                              const torch_ucx_reducer_task_t *task)
+{
+    if (reducer == NULL) {
+        torch_ucx_reducer_run_task(task);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(reducer->mutex);
+    reducer->queue.push_back(*task);
+    lock.unlock();
+    reducer->cv.notify_one();
+}
+
+/* pending tasks are dropped, no collective may be in flight */
+void torch_ucx_reducer_close(torch_ucx_reducer_t *reducer)
+{
+    if (reducer == NULL) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(reducer->mutex);
+    reducer->stop = true;
+    lock.unlock();
+    reducer->cv.notify_all();
+    reducer->thread.join();
+    delete reducer;
+}
+
+}
@@ -0,0 +1,156 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "torch_ucx_coll.hpp"
+
+namespace c10d {
+
+static inline float torch_ucx_bf16_to_float(uint16_t v)
+{
+    uint32_t bits = (uint32_t)v << 16;
+    float    f;
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/* round to nearest even, NaNs stay quiet NaNs */
+static inline uint16_t torch_ucx_float_to_bf16(float f)
+{
+    uint32_t bits;
+
+    memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return (bits >> 16) | 0x40;
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+static inline float torch_ucx_half_to_float(uint16_t v)
+{
+    uint32_t sign = (uint32_t)(v & 0x8000) << 16;
+    uint32_t exp  = (v >> 10) & 0x1f;
+    uint32_t man  = v & 0x3ff;
+    uint32_t bits;
+    float    f;
+
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (man << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (man << 13);
+    } else if (man == 0) {
+        bits = sign;
+    } else {
+        /* subnormal half is a normal float */
+        exp = 113;
+        while (!(man & 0x400)) {
+            man <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((man & 0x3ff) << 13);
+    }
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/* round to nearest even with overflow to infinity */
+static inline uint16_t torch_ucx_float_to_half(float f)
+{
+    uint32_t bits, sign, man;
+    int      exp;
+
+    memcpy(&bits, &f, sizeof(bits));
+    sign = (bits >> 16) & 0x8000;
+    exp  = (int)((bits >> 23) & 0xff) - 112;
+    man  = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (man ? 0x200 : 0);
+    }
+    if (exp >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    if (exp <= 0) {
+        if (exp < -10) {
+            return sign;
+        }
+        man |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half  = man >> shift;
+        uint32_t rem   = man & ((1u << shift) - 1);
+        uint32_t mid   = 1u << (shift - 1);
+        if ((rem > mid) || ((rem == mid) && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = ((uint32_t)exp << 10) | (man >> 13);
+    uint32_t rem  = man & 0x1fff;
+    if ((rem > 0x1000) || ((rem == 0x1000) && (half & 1))) {
+        half++;
+    }
+    return sign | half;
+}
+
+/* dst = op(dst, src) elementwise */
+void torch_ucx_reduce(void *dst, const void *src, size_t count,
+                      torch_ucx_dtype_t dtype, torch_ucx_reduce_op_t op);
+
+/* dst = op(dst, srcs[0], ..., srcs[n_srcs - 1]) elementwise. fp16 and
+ * bf16 are accumulated in fp32 and rounded once. Large buffers are split
+ * across the intra-op thread pool. */
+void torch_ucx_reduce_n(void *dst, const void * const *srcs, int n_srcs,
+                        size_t count, torch_ucx_dtype_t dtype,
+                        torch_ucx_reduce_op_t op);
+
+/* Same as torch_ucx_reduce_n with the result multiplied by scale, which
+ * is only meaningful for floating point and complex dtypes. */
+void torch_ucx_reduce_n_scaled(void *dst, const void * const *srcs, int n_srcs,
+                               size_t count, torch_ucx_dtype_t dtype,
+                               torch_ucx_reduce_op_t op, double scale);
+
+bool torch_ucx_reduce_supported(torch_ucx_dtype_t dtype,
+                                torch_ucx_reduce_op_t op);
+
+/* dst = scale * op(dst, src), done is incremented once it is finished */
+struct torch_ucx_reducer_task_t {
+    void                  *dst;
+    const void            *src;
+    size_t                count;
+    torch_ucx_dtype_t     dtype;
+    torch_ucx_reduce_op_t op;
+    double                scale;
+    std::atomic<int>      *done;
+};
+
+/* Helper thread running reductions in submission order, so that the
+ * thread progressing a collective keeps the network busy meanwhile. */
+struct torch_ucx_reducer_t {
+    std::thread                          thread;
+    std::mutex                           mutex;
+    std::condition_variable              cv;
+    std::deque<torch_ucx_reducer_task_t> queue;
+    bool                                 stop;
+};
+
+torch_ucx_status_t torch_ucx_reducer_init(torch_ucx_reducer_t **reducer);
+
+/* runs the task inline if there is no reducer */
+void torch_ucx_reducer_submit(torch_ucx_reducer_t *reducer,
+                              const torch_ucx_reducer_task_t *task);
+
+void torch_ucx_reducer_close(torch_ucx_reducer_t *reducer);
+
+}
@@ -0,0 +1,298 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "torch_ucx_reduce.hpp"
+#include "torch_ucx_shm.hpp"
+
+namespace c10d {
+
+static std::atomic<int> torch_ucx_shm_seg_id(0);
+
+/* The node leader creates the segment and publishes its name through the
+ * store. All local ranks report whether they could map it, so either the
+ * whole node uses shm or none of it does. The name is unlinked as soon as
+ * everybody is attached. */
+torch_ucx_status_t torch_ucx_shm_init(torch_ucx_shm_t **shm_p,
+                                      torch_ucx_topo_t *topo, int rank,
+                                      const std::shared_ptr<Store>& store,
+                                      size_t slot_size)
+{
+    int             leader = topo->node_ranks[topo->node_id][0];
+    std::string     key    = "shm" + std::to_string(leader);
+    bool            failed = false;
+    int             fd     = -1;
+    torch_ucx_shm_t *shm;
+    std::string     name;
+
+    shm = new torch_ucx_shm_t;
+    shm->local_rank  = topo->local_rank;
+    shm->local_size  = topo->local_size;
+    shm->slot_size   = std::max((slot_size + TORCH_UCX_SHM_CACHE_LINE - 1) &
+                                ~((size_t)TORCH_UCX_SHM_CACHE_LINE - 1),
+                                (size_t)TORCH_UCX_SHM_CACHE_LINE);
+    shm->seg_size    = shm->local_size * (sizeof(torch_ucx_shm_flags_t) +
+                                          shm->slot_size);
+    shm->seg         = MAP_FAILED;
+    shm->token       = 0;
+    shm->n_issued    = 0;
+    shm->n_completed = 0;
+
+    if (shm->local_rank == 0) {
+        name = "/torch_ucc_" + std::to_string(getpid()) + "_" +
+               std::to_string(torch_ucx_shm_seg_id++);
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if ((fd < 0) || (ftruncate(fd, shm->seg_size) != 0)) {
+            failed = true;
+        }
+        store->set(key, failed ? std::vector<uint8_t>() :
+                   std::vector<uint8_t>(name.begin(), name.end()));
+    } else {
+        auto val = store->get(key);
+        name = std::string(val.begin(), val.end());
+        if (name.empty()) {
+            failed = true;
+        } else {
+            fd = shm_open(name.c_str(), O_RDWR, 0600);
+            failed = (fd < 0);
+        }
+    }
+    if (!failed) {
+        shm->seg = mmap(NULL, shm->seg_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+        failed = (shm->seg == MAP_FAILED);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (failed) {
+        store->add(key + "_err", 1);
+    }
+    store->add(key + "_att", 1);
+    while (store->add(key + "_att", 0) < shm->local_size) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    failed = (store->add(key + "_err", 0) != 0);
+    if ((shm->local_rank == 0) && (fd >= 0)) {
+        shm_unlink(name.c_str());
+    }
+    if (failed) {
+        if (shm->seg != MAP_FAILED) {
+            munmap(shm->seg, shm->seg_size);
+        }
+        delete shm;
+        *shm_p = NULL;
+        return TORCH_UCX_ERROR;
+    }
+
+    /* ftruncate zero fills the segment so all flags start at 0 */
+    shm->flags = static_cast<torch_ucx_shm_flags_t*>(shm->seg);
+    shm->slots = (char*)shm->seg +
+                 shm->local_size * sizeof(torch_ucx_shm_flags_t);
+    *shm_p = shm;
+    return TORCH_UCX_OK;
+}
+
+void torch_ucx_shm_close(torch_ucx_shm_t *shm)
+{
+    if (!shm) {
+        return;
+    }
+    munmap(shm->seg, shm->seg_size);
+    delete shm;
+}
+
+void torch_ucx_shm_coll_init(torch_ucx_shm_coll_t *coll, uint64_t seq,
+                             torch_ucx_shm_coll_type_t type, int root,
+                             void *sbuf, void *rbuf, size_t len,
+                             torch_ucx_dtype_t dtype,
+                             torch_ucx_reduce_op_t op)
+{
+    coll->type   = type;
+    coll->seq    = seq;
+    coll->root   = root;
+    coll->sbuf   = sbuf;
+    coll->rbuf   = rbuf;
+    coll->len    = len;
+    coll->offset = 0;
+    coll->dtype  = dtype;
+    coll->op     = op;
+    coll->scale  = 1.0;
+    coll->token  = 0;
+    coll->step   = 0;
+}
+
+static inline char* shm_slot(torch_ucx_shm_t *shm, int local_rank)
+{
+    return shm->slots + local_rank * shm->slot_size;
+}
+
+static inline bool shm_all_done(torch_ucx_shm_t *shm, uint64_t token)
+{
+    for (int i = 0; i < shm->local_size; i++) {
+        if (shm->flags[i].done.load(std::memory_order_acquire) < token) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool shm_ready(torch_ucx_shm_t *shm, int local_rank,
+                             uint64_t token)
+{
+    return shm->flags[local_rank].ready.load(std::memory_order_acquire) >= token;
+}
+
+static inline bool shm_all_ready(torch_ucx_shm_t *shm, int root,
+                                 uint64_t token)
+{
+    for (int i = 0; i < shm->local_size; i++) {
+        if ((i != root) && !shm_ready(shm, i, token)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Every chunk is one stage identified by a token. Writers copy their
+ * chunk into a slot once all ranks are done with the previous stage and
+ * raise ready, readers consume the slots straight from the segment and
+ * raise done. */
+torch_ucx_status_t torch_ucx_shm_coll_progress(torch_ucx_shm_t *shm,
+                                               torch_ucx_shm_coll_t *coll)
+{
+    int    me      = shm->local_rank;
+    int    n       = shm->local_size;
+    int    root    = coll->root;
+    bool   is_root = (me == root);
+    char   *sbuf   = (char*)coll->sbuf;
+    char   *rbuf   = (char*)coll->rbuf;
+    size_t len     = coll->len;
+    bool   is_writer, is_reader;
+    size_t off, chunk;
+
+    if (shm->n_completed != coll->seq) {
+        return TORCH_UCX_INPROGRESS;
+    }
+
+    switch (coll->type) {
+    case TORCH_UCX_SHM_REDUCE:
+    case TORCH_UCX_SHM_GATHER:
+        is_writer = !is_root;
+        is_reader = is_root;
+        break;
+    default:
+        is_writer = is_root;
+        is_reader = !is_root;
+        break;
+    }
+
+    while (coll->offset < len) {
+        off   = coll->offset;
+        chunk = std::min(shm->slot_size, len - off);
+        if (coll->step == 0) {
+            coll->token = ++shm->token;
+            coll->step  = 1;
+        }
+        if (coll->step == 1) {
+            if (is_writer) {
+                if (!shm_all_done(shm, coll->token - 1)) {
+                    return TORCH_UCX_INPROGRESS;
+                }
+                switch (coll->type) {
+                case TORCH_UCX_SHM_REDUCE:
+                case TORCH_UCX_SHM_GATHER:
+                case TORCH_UCX_SHM_BCAST:
+                    memcpy(shm_slot(shm, me), sbuf + off, chunk);
+                    break;
+                case TORCH_UCX_SHM_SCATTER:
+                    for (int i = 0; i < n; i++) {
+                        if (i != root) {
+                            memcpy(shm_slot(shm, i), sbuf + i * len + off, chunk);
+                        }
+                    }
+                    break;
+                }
+                shm->flags[me].ready.store(coll->token, std::memory_order_release);
+            }
+            if (is_root) {
+                switch (coll->type) {
+                case TORCH_UCX_SHM_REDUCE:
+                case TORCH_UCX_SHM_BCAST:
+                    if (sbuf != rbuf) {
+                        memcpy(rbuf + off, sbuf + off, chunk);
+                    }
+                    break;
+                case TORCH_UCX_SHM_GATHER:
+                    memcpy(rbuf + root * len + off, sbuf + off, chunk);
+                    break;
+                case TORCH_UCX_SHM_SCATTER:
+                    memcpy(rbuf + off, sbuf + root * len + off, chunk);
+                    break;
+                }
+            }
+            coll->step = 2;
+        }
+        if (is_reader) {
+            switch (coll->type) {
+            case TORCH_UCX_SHM_REDUCE:
+                if (!shm_all_ready(shm, root, coll->token)) {
+                    return TORCH_UCX_INPROGRESS;
+                }
+                {
+                    std::vector<const void*> srcs;
+
+                    for (int i = 0; i < n; i++) {
+                        if (i != root) {
+                            srcs.push_back(shm_slot(shm, i));
+                        }
+                    }
+                    torch_ucx_reduce_n_scaled(rbuf + off, srcs.data(),
+                                              srcs.size(),
+                                              chunk / torch_ucx_dtype_size(coll->dtype),
+                                              coll->dtype, coll->op, coll->scale);
+                }
+                break;
+            case TORCH_UCX_SHM_GATHER:
+                if (!shm_all_ready(shm, root, coll->token)) {
+                    return TORCH_UCX_INPROGRESS;
+                }
+                for (int i = 0; i < n; i++) {
+                    if (i != root) {
+                        memcpy(rbuf + i * len + off, shm_slot(shm, i), chunk);
+                    }
+                }
+                break;
+            case TORCH_UCX_SHM_BCAST:
+                if (!shm_ready(shm, root, coll->token)) {
+                    return TORCH_UCX_INPROGRESS;
+                }
+                memcpy(rbuf + off, shm_slot(shm, root), chunk);
+                break;
+            case TORCH_UCX_SHM_SCATTER:
+                if (!shm_ready(shm, root, coll->token)) {
+                    return TORCH_UCX_INPROGRESS;
+                }
+                memcpy(rbuf + off, shm_slot(shm, me), chunk);
+                break;
+            }
+        }
+        shm->flags[me].done.store(coll->token, std::memory_order_release);
+        coll->offset += chunk;
+        coll->step    = 0;
+    }
+
+    shm->n_completed++;
+    return TORCH_UCX_OK;
+}
+
+}
@@ -0,0 +1,63 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include <atomic>
+#include "torch_ucx_coll.hpp"
+
+namespace c10d {
+
+#define TORCH_UCX_SHM_CACHE_LINE 64
+
+/* Each local rank owns one cache line with its flags: ready is the last
+ * stage it has published data for, done the last stage it has finished. */
+struct alignas(TORCH_UCX_SHM_CACHE_LINE) torch_ucx_shm_flags_t {
+    std::atomic<uint64_t> ready;
+    std::atomic<uint64_t> done;
+};
+
+struct torch_ucx_shm_t {
+    int                   local_rank;
+    int                   local_size;
+    size_t                slot_size;
+    size_t                seg_size;
+    void                  *seg;
+    torch_ucx_shm_flags_t *flags;
+    char                  *slots;
+    uint64_t              token;
+    uint64_t              n_issued;
+    uint64_t              n_completed;
+};
+
+torch_ucx_status_t torch_ucx_shm_init(torch_ucx_shm_t **shm,
+                                      torch_ucx_topo_t *topo, int rank,
+                                      const std::shared_ptr<Store>& store,
+                                      size_t slot_size);
+
+void torch_ucx_shm_close(torch_ucx_shm_t *shm);
+
+/* Collectives are reserved in program order when they are started, so
+ * that every local rank runs the shm stages in the same sequence no
+ * matter in which order outstanding requests are progressed. */
+static inline uint64_t torch_ucx_shm_reserve(torch_ucx_shm_t *shm, int n_colls)
+{
+    uint64_t seq = shm->n_issued;
+
+    shm->n_issued += n_colls;
+    return seq;
+}
+
+void torch_ucx_shm_coll_init(torch_ucx_shm_coll_t *coll, uint64_t seq,
+                             torch_ucx_shm_coll_type_t type, int root,
+                             void *sbuf, void *rbuf, size_t len,
+                             torch_ucx_dtype_t dtype,
+                             torch_ucx_reduce_op_t op);
+
+torch_ucx_status_t torch_ucx_shm_coll_progress(torch_ucx_shm_t *shm,
+                                               torch_ucx_shm_coll_t *coll);
+
+}
@@ -0,0 +1,231 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include "torch_ucx_reduce.hpp"
+#include "torch_ucx_sparse.hpp"
+
+namespace c10d {
+
+enum {
+    TORCH_UCX_SPARSE_NNZ,
+    TORCH_UCX_SPARSE_GATHER,
+    TORCH_UCX_SPARSE_DENSE,
+    TORCH_UCX_SPARSE_DONE
+};
+
+static int64_t sparse_n_rows(torch_ucx_sparse_t *sp)
+{
+    int64_t rows = 1;
+
+    for (auto size: sp->sizes) {
+        rows *= size;
+    }
+    return rows;
+}
+
+/* adds every local row to its place in the dense buffer */
+static void sparse_densify(torch_ucx_sparse_t *sp)
+{
+    size_t row_bytes = sp->row_len * torch_ucx_dtype_size(sp->dtype);
+
+    sp->dense.assign(sparse_n_rows(sp) * row_bytes, 0);
+    for (int64_t i = 0; i < sp->nnz; i++) {
+        const int64_t *idx = sp->indices + i * sp->sparse_dim;
+        int64_t       row  = 0;
+
+        for (int d = 0; d < sp->sparse_dim; d++) {
+            row = row * sp->sizes[d] + idx[d];
+        }
+        torch_ucx_reduce(&sp->dense[row * row_bytes],
+                         (const char*)sp->values + i * row_bytes, sp->row_len,
+                         sp->dtype, TORCH_UCX_OP_SUM);
+    }
+}
+
+torch_ucx_status_t torch_ucx_sparse_progress(torch_ucx_coll_request_t *request)
+{
+    torch_ucx_coll_comm_t *comm      = request->comm;
+    torch_ucx_comm_t      *p2p_comm  = comm->p2p_comm;
+    torch_ucx_sparse_t    *sp        = request->sparse;
+    int                   size       = p2p_comm->size;
+    int                   rank       = p2p_comm->rank;
+    size_t                idx_bytes  = sp->sparse_dim * sizeof(int64_t);
+    size_t                row_bytes  = sp->row_len * torch_ucx_dtype_size(sp->dtype);
+    uint32_t              tag        = request->tag;
+    int64_t               total, offset;
+    int                   n_reqs;
+
+    if (!torch_ucx_coll_wait(request)) {
+        return TORCH_UCX_OK;
+    }
+
+    for (;;) {
+        switch (request->phase) {
+        case TORCH_UCX_SPARSE_NNZ:
+            if (request->step == 0) {
+                sp->nnzs.assign(size, 0);
+                sp->nnzs[rank] = sp->nnz;
+                n_reqs = 0;
+                for (int peer = 0; peer < size; peer++) {
+                    if (peer == rank) {
+                        continue;
+                    }
+                    torch_ucx_recv_nb(p2p_comm, &sp->nnzs[peer], sizeof(int64_t),
+                                      peer, tag, &request->reqs[n_reqs++],
+                                      TORCH_UCX_COLL_TAG);
+                    torch_ucx_send_nb(p2p_comm, &sp->nnz, sizeof(int64_t),
+                                      peer, tag, &request->reqs[n_reqs++],
+                                      TORCH_UCX_COLL_TAG);
+                }
+                request->n_active = n_reqs;
+                request->step     = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            /* same decision on all ranks, it only depends on the nnzs */
+            total        = std::accumulate(sp->nnzs.begin(), sp->nnzs.end(),
+                                           (int64_t)0);
+            sp->is_dense = (sp->dense_thresh > 0) &&
+                           (total >= sp->dense_thresh * sparse_n_rows(sp));
+            request->phase = sp->is_dense ? TORCH_UCX_SPARSE_DENSE :
+                                            TORCH_UCX_SPARSE_GATHER;
+            request->step  = 0;
+            break;
+        case TORCH_UCX_SPARSE_GATHER:
+            if (request->step == 0) {
+                total = std::accumulate(sp->nnzs.begin(), sp->nnzs.end(),
+                                        (int64_t)0);
+                sp->out_indices.resize(total * sp->sparse_dim);
+                sp->out_values.resize(total * row_bytes);
+                n_reqs = 0;
+                offset = 0;
+                for (int peer = 0; peer < size; peer++) {
+                    char *idx_dst = (char*)sp->out_indices.data() +
+                                    offset * idx_bytes;
+                    char *val_dst = sp->out_values.data() + offset * row_bytes;
+
+                    offset += sp->nnzs[peer];
+                    if (peer == rank) {
+                        memcpy(idx_dst, sp->indices, sp->nnz * idx_bytes);
+                        memcpy(val_dst, sp->values, sp->nnz * row_bytes);
+                        continue;
+                    }
+                    if (sp->nnzs[peer] > 0) {
+                        torch_ucx_recv_nb(p2p_comm, idx_dst,
+                                          sp->nnzs[peer] * idx_bytes, peer, tag,
+                                          &request->reqs[n_reqs++],
+                                          TORCH_UCX_COLL_TAG);
+                        torch_ucx_recv_nb(p2p_comm, val_dst,
+                                          sp->nnzs[peer] * row_bytes, peer, tag,
+                                          &request->reqs[n_reqs++],
+                                          TORCH_UCX_COLL_TAG);
+                    }
+                    if (sp->nnz > 0) {
+                        torch_ucx_send_nb(p2p_comm, (void*)sp->indices,
+                                          sp->nnz * idx_bytes, peer, tag,
+                                          &request->reqs[n_reqs++],
+                                          TORCH_UCX_COLL_TAG);
+                        torch_ucx_send_nb(p2p_comm, (void*)sp->values,
+                                          sp->nnz * row_bytes, peer, tag,
+                                          &request->reqs[n_reqs++],
+                                          TORCH_UCX_COLL_TAG);
+                    }
+                }
+                request->n_active = n_reqs;
+                request->step     = 1;
+                if (!torch_ucx_coll_wait(request)) {
+                    return TORCH_UCX_OK;
+                }
+            }
+            request->phase = TORCH_UCX_SPARSE_DONE;
+            break;
+        case TORCH_UCX_SPARSE_DENSE:
+            if (request->step == 0) {
+                torch_ucx_coll_request_t *dense_req = &sp->dense_req;
+
+                sparse_densify(sp);
+                dense_req->config            = request->config;
+                dense_req->config.topo_aware = false;
+                dense_req->src_buf_mtype     = TORCH_UCX_HOST;
+                dense_req->dst_buf_mtype     = TORCH_UCX_HOST;
+                dense_req->src_buffer        = sp->dense.data();
+                dense_req->dst_buffer        = sp->dense.data();
+                dense_req->len               = sp->dense.size();
+                dense_req->count             = sparse_n_rows(sp) * sp->row_len;
+                dense_req->dtype             = sp->dtype;
+                dense_req->op                = TORCH_UCX_OP_SUM;
+                dense_req->pre_scale         = 1.0;
+                dense_req->post_scale        = 1.0;
+                torch_ucx_allreduce_start_tag(comm, dense_req, sp->dense_tag);
+                request->step = 1;
+            }
+            if (torch_ucx_coll_test(&sp->dense_req) == TORCH_UCX_INPROGRESS) {
+                return TORCH_UCX_OK;
+            }
+            request->phase = TORCH_UCX_SPARSE_DONE;
+            break;
+        case TORCH_UCX_SPARSE_DONE:
+            delete[] request->reqs;
+            torch_ucx_metrics_record(&comm->metrics, TORCH_UCX_METRICS_SPARSE,
+                                     sp->nnz * (idx_bytes + row_bytes),
+                                     request->start_ns);
+            torch_ucx_trace("sparse", TORCH_UCX_TRACE_END, request);
+            request->status = TORCH_UCX_OK;
+            return TORCH_UCX_OK;
+        }
+    }
+}
+
+torch_ucx_status_t torch_ucx_sparse_start(torch_ucx_coll_comm_t *comm,
+                                          torch_ucx_coll_request_t *request)
+{
+    int n_reqs = 4 * std::max(comm->p2p_comm->size - 1, 1);
+
+    torch_ucx_trace("sparse", TORCH_UCX_TRACE_BEGIN, request,
+                    request->sparse->nnz);
+    torch_ucx_coll_begin(comm, request, "sparse_allreduce");
+    request->reqs     = new torch_ucx_request_t*[n_reqs];
+    request->max_reqs = n_reqs;
+    for (int i = 0; i < n_reqs; i++) {
+        request->reqs[i] = NULL;
+    }
+    /* both tags are taken now so that the dense fallback, which starts
+     * from the progress, matches on all ranks */
+    request->tag               = torch_ucx_coll_next_tag(comm);
+    request->sparse->dense_tag = torch_ucx_coll_next_tag(comm);
+    request->sparse->is_dense  = false;
+    request->comm              = comm;
+    request->n_active          = 0;
+    request->phase             = TORCH_UCX_SPARSE_NNZ;
+    request->step              = 0;
+    request->status            = TORCH_UCX_INPROGRESS;
+    request->progress          = torch_ucx_sparse_progress;
+
+    return torch_ucx_sparse_progress(request);
+}
+
+void torch_ucx_sparse_pending(torch_ucx_coll_request_t *request,
+                              std::vector<torch_ucx_request_t**> *reqs)
+{
+    torch_ucx_coll_request_t *dense_req = &request->sparse->dense_req;
+
+    if ((request->phase != TORCH_UCX_SPARSE_DENSE) || (request->step != 1) ||
+        (dense_req->status != TORCH_UCX_INPROGRESS)) {
+        return;
+    }
+    for (int i = 0; i < dense_req->max_reqs; i++) {
+        if (dense_req->reqs[i] != NULL) {
+            reqs->push_back(&dense_req->reqs[i]);
+        }
+    }
+    torch_ucx_allreduce_pending(dense_req, reqs);
+}
+
+}
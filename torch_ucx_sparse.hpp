@@ -0,0 +1,53 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include "torch_ucx_coll.hpp"
+
+namespace c10d {
+
+/* Sparse COO collective arguments and results, owned by the caller and
+ * attached to the request. Indices are nnz rows of sparse_dim entries,
+ * values are nnz rows of row_len elements. */
+struct torch_ucx_sparse_t {
+    const int64_t            *indices;
+    const void               *values;
+    int64_t                  nnz;
+    int                      sparse_dim;
+    /* sizes of the sparse dimensions */
+    std::vector<int64_t>     sizes;
+    size_t                   row_len;
+    torch_ucx_dtype_t        dtype;
+    /* densify when the summed nnz reaches this fraction of the rows,
+     * 0 never densifies */
+    double                   dense_thresh;
+    /* nnz of every rank and their concatenated indices and values */
+    std::vector<int64_t>     nnzs;
+    std::vector<int64_t>     out_indices;
+    std::vector<char>        out_values;
+    /* allreduced dense buffer of all rows when densified */
+    bool                     is_dense;
+    std::vector<char>        dense;
+    uint32_t                 dense_tag;
+    torch_ucx_coll_request_t dense_req;
+};
+
+/* The nnz of all ranks are exchanged first, then the indices and values
+ * are allgathered, so the traffic scales with the nnz. If the summed nnz
+ * reaches dense_thresh of the rows the local part is densified and a
+ * dense SUM allreduce runs instead. Duplicates are not combined, the
+ * caller coalesces the result. */
+torch_ucx_status_t torch_ucx_sparse_start(torch_ucx_coll_comm_t *comm,
+                                          torch_ucx_coll_request_t *request);
+
+torch_ucx_status_t torch_ucx_sparse_progress(torch_ucx_coll_request_t *request);
+
+/* Adds the requests of the dense fallback allreduce in flight */
+void torch_ucx_sparse_pending(torch_ucx_coll_request_t *request,
+                              std::vector<torch_ucx_request_t**> *reqs);
+
+}
@@ -0,0 +1,157 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include "torch_ucx_trace.hpp"
+
+namespace c10d {
+
+bool torch_ucx_trace_on = false;
+
+struct torch_ucx_trace_buf_t {
+    std::vector<torch_ucx_trace_event_t> events;
+    /* written by the owner thread only, read by the dump */
+    std::atomic<size_t>                  count;
+    std::atomic<size_t>                  dropped;
+    /* events already dumped, the owner drops them from the buffer on its
+     * next record under trace_mutex */
+    std::atomic<size_t>                  dumped;
+    int                                  tid;
+};
+
+static std::mutex                          trace_mutex;
+static std::vector<torch_ucx_trace_buf_t*> trace_bufs;
+static size_t                              trace_capacity = 65536;
+
+void torch_ucx_trace_init()
+{
+    static std::once_flag once;
+
+    std::call_once(once, [] {
+        char *env;
+
+        env = std::getenv("TORCH_UCC_TRACE");
+        if (env) {
+            torch_ucx_trace_on = std::atoi(env);
+        }
+        env = std::getenv("TORCH_UCC_TRACE_EVENTS");
+        if (env) {
+            trace_capacity = std::max(std::atol(env), 1L);
+        }
+    });
+}
+
+static uint64_t torch_ucx_trace_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* buffers are never freed, the dump may run after their thread exited */
+static torch_ucx_trace_buf_t* torch_ucx_trace_get_buf()
+{
+    static thread_local torch_ucx_trace_buf_t *buf = NULL;
+
+    if (buf == NULL) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+
+        buf = new torch_ucx_trace_buf_t;
+        buf->events.resize(trace_capacity);
+        buf->count   = 0;
+        buf->dropped = 0;
+        buf->dumped  = 0;
+        buf->tid     = trace_bufs.size();
+        trace_bufs.push_back(buf);
+    }
+    return buf;
+}
+
+void torch_ucx_trace_record(const char *name, torch_ucx_trace_phase_t ph,
+                            const void *id, size_t len, int peer, int phase,
+                            int step)
+{
+    torch_ucx_trace_buf_t   *buf = torch_ucx_trace_get_buf();
+    size_t                  n    = buf->count.load(std::memory_order_relaxed);
+    torch_ucx_trace_event_t *ev;
+    size_t                  d;
+
+    if (buf->dumped.load(std::memory_order_relaxed) != 0) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+
+        d = buf->dumped;
+        std::move(buf->events.begin() + d, buf->events.begin() + n,
+                  buf->events.begin());
+        n -= d;
+        buf->count.store(n, std::memory_order_relaxed);
+        buf->dumped = 0;
+    }
+    if (n == buf->events.size()) {
+        buf->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    ev        = &buf->events[n];
+    ev->name  = name;
+    ev->ph    = (char)ph;
+    ev->ts    = torch_ucx_trace_now();
+    ev->id    = (uint64_t)(uintptr_t)id;
+    ev->len   = len;
+    ev->peer  = peer;
+    ev->phase = phase;
+    ev->step  = step;
+    buf->count.store(n + 1, std::memory_order_release);
+}
+
+bool torch_ucx_trace_dump(const char *file, int rank)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    const char                  *sep = "";
+    size_t                      dropped = 0;
+    FILE                        *f;
+
+    if (!torch_ucx_trace_on) {
+        return true;
+    }
+    f = fopen(file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "TorchUCC: failed to open trace file %s\n", file);
+        return false;
+    }
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (auto buf: trace_bufs) {
+        size_t n = buf->count.load(std::memory_order_acquire);
+
+        for (size_t i = buf->dumped; i < n; i++) {
+            const torch_ucx_trace_event_t *ev = &buf->events[i];
+
+            fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"ucc\",\"ph\":\"%c\","
+                    "\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"id\":\"0x%llx\","
+                    "\"args\":{\"len\":%zu,\"peer\":%d,\"phase\":%d,"
+                    "\"step\":%d}}",
+                    sep, ev->name, ev->ph, ev->ts / 1000.0, rank, buf->tid,
+                    (unsigned long long)ev->id, ev->len, ev->peer, ev->phase,
+                    ev->step);
+            sep = ",\n";
+        }
+        buf->dumped = n;
+        dropped += buf->dropped.exchange(0, std::memory_order_relaxed);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    if (dropped > 0) {
+        fprintf(stderr, "TorchUCC: trace dropped %zu events, "
+                "increase TORCH_UCC_TRACE_EVENTS\n", dropped);
+    }
+    return true;
+}
+
+}
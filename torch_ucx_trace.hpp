@@ -0,0 +1,61 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace c10d {
+
+/* Chrome trace phases: async begin/end spanning threads and instants */
+enum torch_ucx_trace_phase_t {
+    TORCH_UCX_TRACE_BEGIN = 'b',
+    TORCH_UCX_TRACE_END   = 'e',
+    TORCH_UCX_TRACE_POINT = 'n'
+};
+
+/* name has to be a string literal, id ties async begin and end together,
+ * peer, phase and step are -1 when they don't apply */
+struct torch_ucx_trace_event_t {
+    const char *name;
+    char       ph;
+    uint64_t   ts;
+    uint64_t   id;
+    size_t     len;
+    int        peer;
+    int        phase;
+    int        step;
+};
+
+extern bool torch_ucx_trace_on;
+
+/* Reads TORCH_UCC_TRACE once, the first process group to init decides */
+void torch_ucx_trace_init();
+
+void torch_ucx_trace_record(const char *name, torch_ucx_trace_phase_t ph,
+                            const void *id, size_t len, int peer, int phase,
+                            int step);
+
+/* Writes the events of all threads recorded since the previous dump as
+ * Chrome trace JSON, pid is the rank. Dumped events are dropped from the
+ * buffers. */
+bool torch_ucx_trace_dump(const char *file, int rank);
+
+/* Each thread appends to its own fixed size buffer without locking, events
+ * past TORCH_UCC_TRACE_EVENTS per thread are dropped and counted. */
+static inline void torch_ucx_trace(const char *name,
+                                   torch_ucx_trace_phase_t ph,
+                                   const void *id, size_t len = 0,
+                                   int peer = -1, int phase = -1,
+                                   int step = -1)
+{
+    if (torch_ucx_trace_on) {
+        torch_ucx_trace_record(name, ph, id, len, peer, phase, step);
+    }
+}
+
+}
@@ -0,0 +1,337 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include "torch_ucx_tune.hpp"
+
+namespace c10d {
+
+static const char *torch_ucx_coll_names[TORCH_UCX_COLL_LAST] = {
+    "alltoall",
+    "allreduce"
+};
+
+static void torch_ucx_get_tune_config(torch_ucx_tune_t *tune)
+{
+    char *env;
+
+    tune->mode     = TORCH_UCX_TUNE_OFF;
+    tune->iters    = 5;
+    tune->max_size = 16 << 20;
+
+    env = std::getenv("TORCH_UCC_UCX_TUNE");
+    if (env) {
+        tune->mode = static_cast<torch_ucx_tune_mode_t>(std::atoi(env));
+    }
+    env = std::getenv("TORCH_UCC_UCX_TUNE_FILE");
+    if (env) {
+        tune->file = env;
+    }
+    env = std::getenv("TORCH_UCC_UCX_TUNE_ITERS");
+    if (env) {
+        tune->iters = std::max(std::atoi(env), 1);
+    }
+    env = std::getenv("TORCH_UCC_UCX_TUNE_MAX_SIZE");
+    if (env) {
+        tune->max_size = std::strtoull(env, NULL, 10);
+    }
+}
+
+static int torch_ucx_tune_bucket(size_t len)
+{
+    int bucket = 0;
+
+    while (((size_t)1 << bucket) < len) {
+        bucket++;
+    }
+    return bucket;
+}
+
+/* One entry per line: coll bucket group_size chunk reverse alltoall_hier topo_aware */
+static void torch_ucx_tune_parse(torch_ucx_tune_t *tune, const std::string &text)
+{
+    std::istringstream in(text);
+    std::string        line;
+
+    while (std::getline(in, line)) {
+        std::istringstream     fields(line);
+        std::string            coll;
+        int                    bucket, group_size, reverse, hier, topo_aware;
+        torch_ucx_tune_entry_t entry;
+
+        if (line.empty() || (line[0] == '#')) {
+            continue;
+        }
+        if (!(fields >> coll >> bucket >> group_size >> entry.chunk >>
+              reverse >> hier >> topo_aware)) {
+            fprintf(stderr, "TorchUCC: skipping bad tuning line: %s\n",
+                    line.c_str());
+            continue;
+        }
+        entry.reverse       = reverse;
+        entry.alltoall_hier = hier;
+        entry.topo_aware    = topo_aware;
+        for (int i = 0; i < TORCH_UCX_COLL_LAST; i++) {
+            if (coll == torch_ucx_coll_names[i]) {
+                tune->table[std::make_tuple(i, bucket, group_size)] = entry;
+            }
+        }
+    }
+}
+
+static void torch_ucx_tune_write(torch_ucx_tune_t *tune)
+{
+    std::ofstream out(tune->file);
+
+    if (!out) {
+        fprintf(stderr, "TorchUCC: failed to write tuning file %s\n",
+                tune->file.c_str());
+        return;
+    }
+    out << "# coll bucket group_size chunk reverse alltoall_hier topo_aware\n";
+    for (auto &it: tune->table) {
+        out << torch_ucx_coll_names[std::get<0>(it.first)] << " "
+            << std::get<1>(it.first) << " " << std::get<2>(it.first) << " "
+            << it.second.chunk << " " << it.second.reverse << " "
+            << it.second.alltoall_hier << " " << it.second.topo_aware << "\n";
+    }
+}
+
+void torch_ucx_tune_apply(const torch_ucx_tune_entry_t *entry,
+                          torch_ucx_coll_config_t *config)
+{
+    config->chunk                = entry->chunk;
+    config->reverse              = entry->reverse;
+    config->alltoall_hier_thresh = entry->alltoall_hier ? SIZE_MAX : 0;
+    config->topo_aware           = entry->topo_aware;
+}
+
+static void torch_ucx_coll_run(torch_ucx_coll_request_t *request)
+{
+    while (torch_ucx_coll_test(request) == TORCH_UCX_INPROGRESS) {}
+}
+
+/* Candidate lists only depend on global properties of the group so that
+ * all ranks benchmark the same set in the same order. */
+static std::vector<torch_ucx_tune_entry_t>
+torch_ucx_tune_candidates(torch_ucx_coll_comm_t *comm, torch_ucx_coll_type_t coll)
+{
+    std::vector<torch_ucx_tune_entry_t> candidates;
+    torch_ucx_coll_config_t             *config = &comm->config;
+    int                                 size    = comm->p2p_comm->size;
+    bool                                hier    = (comm->topo.n_nodes > 1) &&
+                                                  (comm->topo.n_nodes < size);
+
+    switch (coll) {
+    case TORCH_UCX_COLL_ALLTOALL:
+        for (int chunk: {TORCH_UCX_CHUNK_AUTO, 1, 4, 16, 0}) {
+            if ((chunk != 0) && (chunk >= size - 1)) {
+                continue;
+            }
+            for (bool reverse: {false, true}) {
+                candidates.push_back({chunk, reverse, false, config->topo_aware});
+            }
+        }
+        if (hier) {
+            candidates.push_back({config->chunk, config->reverse, true,
+                                  config->topo_aware});
+        }
+        break;
+    case TORCH_UCX_COLL_ALLREDUCE:
+        candidates.push_back({config->chunk, config->reverse, false,
+                              config->topo_aware});
+        if (config->topo_aware && (comm->topo.n_nodes < size)) {
+            candidates.push_back({config->chunk, config->reverse, false, false});
+        }
+        break;
+    default:
+        break;
+    }
+    return candidates;
+}
+
+/* Every candidate is timed locally, the per candidate maximum over ranks
+ * is found with an allreduce and the fastest one wins everywhere. */
+static torch_ucx_tune_entry_t torch_ucx_tune_bucket_run(torch_ucx_coll_comm_t *comm,
+                                                        torch_ucx_coll_type_t coll,
+                                                        int bucket)
+{
+    torch_ucx_tune_t                    *tune = comm->tune;
+    int                                 size  = comm->p2p_comm->size;
+    size_t                              len   = (size_t)1 << bucket;
+    std::vector<torch_ucx_tune_entry_t> candidates;
+    std::vector<char>                   sbuf, rbuf;
+    std::vector<double>                 times;
+    torch_ucx_coll_request_t            request;
+
+    candidates = torch_ucx_tune_candidates(comm, coll);
+    if (candidates.size() == 1) {
+        return candidates[0];
+    }
+    if (coll == TORCH_UCX_COLL_ALLTOALL) {
+        sbuf.resize(len * size);
+        rbuf.resize(len * size);
+    } else {
+        len = std::max(len, sizeof(float));
+        sbuf.resize(len);
+    }
+
+    times.resize(candidates.size(), 0);
+    for (size_t c = 0; c < candidates.size(); c++) {
+        /* first iteration is a warmup */
+        for (int it = 0; it <= tune->iters; it++) {
+            request.config = comm->config;
+            torch_ucx_tune_apply(&candidates[c], &request.config);
+            request.src_buf_mtype = TORCH_UCX_HOST;
+            request.dst_buf_mtype = TORCH_UCX_HOST;
+            request.src_buffer    = sbuf.data();
+            request.len           = len;
+            auto start = std::chrono::steady_clock::now();
+            if (coll == TORCH_UCX_COLL_ALLTOALL) {
+                request.dst_buffer = rbuf.data();
+                request.dtype      = TORCH_UCX_DT_UINT8;
+                torch_ucx_alltoall_start(comm, &request);
+            } else {
+                request.dst_buffer = sbuf.data();
+                request.count      = len / sizeof(float);
+                request.dtype      = TORCH_UCX_DT_FLOAT32;
+                request.op         = TORCH_UCX_OP_SUM;
+                request.pre_scale  = 1.0;
+                request.post_scale = 1.0;
+                torch_ucx_allreduce_start(comm, &request);
+            }
+            torch_ucx_coll_run(&request);
+            if (it > 0) {
+                times[c] += std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            }
+        }
+    }
+
+    request.config        = comm->config;
+    request.src_buf_mtype = TORCH_UCX_HOST;
+    request.dst_buf_mtype = TORCH_UCX_HOST;
+    request.src_buffer    = times.data();
+    request.dst_buffer    = times.data();
+    request.len           = times.size() * sizeof(double);
+    request.count         = times.size();
+    request.dtype         = TORCH_UCX_DT_FLOAT64;
+    request.op            = TORCH_UCX_OP_MAX;
+    request.pre_scale     = 1.0;
+    request.post_scale    = 1.0;
+    torch_ucx_allreduce_start(comm, &request);
+    torch_ucx_coll_run(&request);
+
+    return candidates[std::min_element(times.begin(), times.end()) -
+                      times.begin()];
+}
+
+bool torch_ucx_tune_needed(torch_ucx_coll_comm_t *comm,
+                           torch_ucx_coll_type_t coll, size_t len)
+{
+    torch_ucx_tune_t     *tune = comm->tune;
+    torch_ucx_tune_key_t key;
+
+    if (!tune || (tune->mode == TORCH_UCX_TUNE_OFF) || (len > tune->max_size)) {
+        return false;
+    }
+    key = std::make_tuple((int)coll, torch_ucx_tune_bucket(len),
+                          comm->p2p_comm->size);
+    return tune->table.find(key) == tune->table.end();
+}
+
+bool torch_ucx_tune_lookup(torch_ucx_coll_comm_t *comm,
+                           torch_ucx_coll_type_t coll, size_t len,
+                           torch_ucx_tune_entry_t *entry)
+{
+    torch_ucx_tune_t     *tune = comm->tune;
+    int                  bucket;
+    torch_ucx_tune_key_t key;
+
+    if (!tune) {
+        return false;
+    }
+    bucket = torch_ucx_tune_bucket(len);
+    key    = std::make_tuple((int)coll, bucket, comm->p2p_comm->size);
+    auto it = tune->table.find(key);
+    if (it != tune->table.end()) {
+        *entry = it->second;
+        return true;
+    }
+    if ((tune->mode == TORCH_UCX_TUNE_OFF) || (len > tune->max_size)) {
+        return false;
+    }
+    /* the benchmarks would wait for their shm turn behind collectives
+     * nobody progresses meanwhile */
+    torch_ucx_coll_drain(comm);
+    *entry = torch_ucx_tune_bucket_run(comm, coll, bucket);
+    tune->table[key] = *entry;
+    tune->dirty      = true;
+    return true;
+}
+
+/* Rank 0 reads the table and shares it through the store so that all
+ * ranks start from the same table even if the file is not on a shared
+ * file system. */
+torch_ucx_status_t torch_ucx_tune_init(torch_ucx_coll_comm_t *comm,
+                                       const std::shared_ptr<Store>& store)
+{
+    torch_ucx_tune_t       *tune = new torch_ucx_tune_t;
+    torch_ucx_tune_entry_t entry;
+    std::string            text;
+
+    torch_ucx_get_tune_config(tune);
+    tune->dirty = false;
+    comm->tune  = tune;
+
+    if (!tune->file.empty()) {
+        if (comm->p2p_comm->rank == 0) {
+            std::ifstream      in(tune->file);
+            std::ostringstream content;
+
+            if (in) {
+                content << in.rdbuf();
+                text = content.str();
+            }
+            store->set("tune_table", std::vector<uint8_t>(text.begin(), text.end()));
+        } else {
+            auto val = store->get("tune_table");
+            text = std::string(val.begin(), val.end());
+        }
+        torch_ucx_tune_parse(tune, text);
+    }
+
+    if (tune->mode == TORCH_UCX_TUNE_INIT) {
+        for (int coll = 0; coll < TORCH_UCX_COLL_LAST; coll++) {
+            for (int bucket = 0; bucket <= torch_ucx_tune_bucket(tune->max_size);
+                 bucket++) {
+                torch_ucx_tune_lookup(comm, static_cast<torch_ucx_coll_type_t>(coll),
+                                      (size_t)1 << bucket, &entry);
+            }
+        }
+    }
+    return TORCH_UCX_OK;
+}
+
+void torch_ucx_tune_close(torch_ucx_coll_comm_t *comm)
+{
+    torch_ucx_tune_t *tune = comm->tune;
+
+    if (!tune) {
+        return;
+    }
+    if (tune->dirty && !tune->file.empty() && (comm->p2p_comm->rank == 0)) {
+        torch_ucx_tune_write(tune);
+    }
+    delete tune;
+    comm->tune = NULL;
+}
+
+}
@@ -0,0 +1,62 @@
+/**
+ * * Copyright (C) Mellanox Technologies Ltd. 2001-2020.  ALL RIGHTS RESERVED.
+ * *
+ * * See file LICENSE for terms.
+ * */
+
+#pragma once
+
+#include <map>
+#include <tuple>
+#include "torch_ucx_coll.hpp"
+
+namespace c10d {
+
+enum torch_ucx_tune_mode_t {
+    TORCH_UCX_TUNE_OFF,
+    TORCH_UCX_TUNE_FIRST_USE,
+    TORCH_UCX_TUNE_INIT
+};
+
+/* (collective, log2 size bucket, group size) */
+typedef std::tuple<int, int, int> torch_ucx_tune_key_t;
+
+struct torch_ucx_tune_entry_t {
+    int  chunk;
+    bool reverse;
+    bool alltoall_hier;
+    bool topo_aware;
+};
+
+struct torch_ucx_tune_t {
+    torch_ucx_tune_mode_t                                    mode;
+    std::string                                              file;
+    int                                                      iters;
+    size_t                                                   max_size;
+    bool                                                     dirty;
+    std::map<torch_ucx_tune_key_t, torch_ucx_tune_entry_t>   table;
+};
+
+torch_ucx_status_t torch_ucx_tune_init(torch_ucx_coll_comm_t *comm,
+                                       const std::shared_ptr<Store>& store);
+
+/* True if a lookup of len would benchmark its bucket */
+bool torch_ucx_tune_needed(torch_ucx_coll_comm_t *comm,
+                           torch_ucx_coll_type_t coll, size_t len);
+
+/* Returns the tuned parameters for the bucket of len, benchmarking the
+ * candidates first if the bucket is not in the table and tuning is on.
+ * Has to be called by all ranks in the same order, like a collective.
+ * Tuning completes all started collectives of the comm and runs the
+ * candidates on the calling thread, no other thread may progress the
+ * comm meanwhile. */
+bool torch_ucx_tune_lookup(torch_ucx_coll_comm_t *comm,
+                           torch_ucx_coll_type_t coll, size_t len,
+                           torch_ucx_tune_entry_t *entry);
+
+void torch_ucx_tune_apply(const torch_ucx_tune_entry_t *entry,
+                          torch_ucx_coll_config_t *config);
+
+void torch_ucx_tune_close(torch_ucx_coll_comm_t *comm);
+
+}
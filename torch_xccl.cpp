@@ -4,72 +4,145 @@
  * * See file LICENSE for terms.
  * */
 
+#include <algorithm>
+#include <cstdlib>
 #include "torch_xccl.hpp"
 
 namespace c10d {
 
 struct xccl_oob_allgather_req_t {
-    xccl_ep_range_t     range;
-    void                *sbuf;
-    void                *rbuf;
-    void                *oob_coll_ctx;
-    int                 my_rank;
-    size_t              msglen;
-    int                 iter;
-    torch_ucx_request_t *reqs[2];
+    xccl_ep_range_t      range;
+    void                 *sbuf;
+    void                 *rbuf;
+    torch_ucx_comm_t     *oob_ctx;
+    torch_xccl_oob_alg_t alg;
+    int                  my_rank;
+    int                  size;
+    size_t               msglen;
+    int                  iter;
+    int                  n_iters;
+    std::vector<char>    scratch;
+    torch_ucx_request_t  *reqs[2];
 };
 
-static xccl_status_t oob_allgather_test(void *req)
+static void torch_xccl_get_oob_alg(torch_xccl_oob_alg_t *alg)
 {
-  xccl_oob_allgather_req_t *oob_req = static_cast<xccl_oob_allgather_req_t*>(req);
-  int rank, size, sendto, recvfrom, recvdatafrom, senddatafrom;
-  torch_ucx_comm_t *oob_ctx = static_cast<torch_ucx_comm_t*>(oob_req->oob_coll_ctx);
-  char *tmpsend = NULL, *tmprecv = NULL;
-  size_t msglen = oob_req->msglen;
-  torch_ucx_status_t st;
+    char *env;
 
-  if (oob_req->range.type == XCCL_EP_RANGE_UNDEFINED) {
-    size = oob_ctx->size;
-    rank = oob_ctx->rank;
-  } else {
-    size = oob_req->range.ep_num;
-    rank = oob_req->my_rank;
-  }
+    *alg = TORCH_XCCL_OOB_ALG_AUTO;
+    env = std::getenv("TORCH_UCC_XCCL_OOB_ALG");
+    if (!env) {
+        return;
+    }
+    if (!strcmp(env, "ring")) {
+        *alg = TORCH_XCCL_OOB_ALG_RING;
+    } else if (!strcmp(env, "rd")) {
+        *alg = TORCH_XCCL_OOB_ALG_RECURSIVE_DOUBLING;
+    } else if (!strcmp(env, "bruck")) {
+        *alg = TORCH_XCCL_OOB_ALG_BRUCK;
+    }
+}
 
-  if (oob_req->iter == 0) {
-    tmprecv = (char*) oob_req->rbuf + (ptrdiff_t)(rank * msglen);
-    memcpy(tmprecv, oob_req->sbuf, msglen);
-  }
-  sendto   = (rank + 1) % size;
-  recvfrom = (rank - 1 + size) % size;
+static inline int oob_log2_ceil(int size)
+{
+    int n = 0;
+
+    while ((1 << n) < size) {
+        n++;
+    }
+    return n;
+}
+
+static inline int oob_peer(xccl_oob_allgather_req_t *oob_req, int peer)
+{
   if (oob_req->range.type != XCCL_EP_RANGE_UNDEFINED) {
-    sendto   = xccl_range_to_rank(oob_req->range, sendto);
-    recvfrom = xccl_range_to_rank(oob_req->range, recvfrom);
+    return xccl_range_to_rank(oob_req->range, peer);
   }
-  for (; oob_req->iter < size - 1; oob_req->iter++) {
-    if (oob_req->iter > 0) {
-      st = torch_ucx_req_test(oob_ctx, oob_req->reqs, 2, NULL, 1, 2);
-      if (st == TORCH_UCX_INPROGRESS) {
-        return XCCL_INPROGRESS;
-      }
-    }
-    recvdatafrom = (rank - oob_req->iter - 1 + size) % size;
-    senddatafrom = (rank - oob_req->iter + size) % size;
-    tmprecv = (char*)oob_req->rbuf + (ptrdiff_t)(recvdatafrom * msglen);
-    tmpsend = (char*)oob_req->rbuf + (ptrdiff_t)(senddatafrom * msglen);
+  return peer;
+}
+
+/* Ring takes size - 1 steps. Recursive doubling exchanges a doubling
+ * group of blocks with rank ^ 2^k and needs a power of two size. Bruck
+ * works for any size, it accumulates blocks in scratch starting with the
+ * local one and rotates them into place after the last step. */
+static void oob_allgather_post(xccl_oob_allgather_req_t *oob_req)
+{
+  int    rank   = oob_req->my_rank;
+  int    size   = oob_req->size;
+  int    iter   = oob_req->iter;
+  size_t msglen = oob_req->msglen;
+  char   *rbuf  = (char*)oob_req->rbuf;
+  int    sendto, recvfrom, dist, count;
+  char   *tmpsend, *tmprecv;
+  size_t sendlen, recvlen;
+
+  switch (oob_req->alg) {
+    case TORCH_XCCL_OOB_ALG_RECURSIVE_DOUBLING:
+      dist     = 1 << iter;
+      sendto   = rank ^ dist;
+      recvfrom = sendto;
+      tmpsend  = rbuf + (ptrdiff_t)((rank & ~(dist - 1)) * msglen);
+      tmprecv  = rbuf + (ptrdiff_t)((sendto & ~(dist - 1)) * msglen);
+      sendlen  = dist * msglen;
+      recvlen  = dist * msglen;
+      break;
+    case TORCH_XCCL_OOB_ALG_BRUCK:
+      dist     = 1 << iter;
+      count    = std::min(dist, size - dist);
+      sendto   = (rank - dist + size) % size;
+      recvfrom = (rank + dist) % size;
+      tmpsend  = oob_req->scratch.data();
+      tmprecv  = oob_req->scratch.data() + (ptrdiff_t)(dist * msglen);
+      sendlen  = count * msglen;
+      recvlen  = count * msglen;
+      break;
+    default:
+      sendto   = (rank + 1) % size;
+      recvfrom = (rank - 1 + size) % size;
+      tmpsend  = rbuf + (ptrdiff_t)(((rank - iter + size) % size) * msglen);
+      tmprecv  = rbuf + (ptrdiff_t)(((rank - iter - 1 + size) % size) * msglen);
+      sendlen  = msglen;
+      recvlen  = msglen;
+      break;
+  }
+
+  torch_ucx_send_nb(oob_req->oob_ctx, tmpsend, sendlen,
+                    oob_peer(oob_req, sendto), 1,
+                    &oob_req->reqs[0], TORCH_UCX_OOB_TAG);
+  torch_ucx_recv_nb(oob_req->oob_ctx, tmprecv, recvlen,
+                    oob_peer(oob_req, recvfrom), 1,
+                    &oob_req->reqs[1], TORCH_UCX_OOB_TAG);
+}
 
-    torch_ucx_send_nb(oob_ctx, tmpsend, msglen, sendto, 1,
-                      &oob_req->reqs[0], TORCH_UCX_OOB_TAG);
+static xccl_status_t oob_allgather_test(void *req)
+{
+  xccl_oob_allgather_req_t *oob_req = static_cast<xccl_oob_allgather_req_t*>(req);
+  torch_ucx_status_t st;
 
-    torch_ucx_recv_nb(oob_ctx, tmprecv, msglen, recvfrom, 1,
-                      &oob_req->reqs[1], TORCH_UCX_OOB_TAG);
+  for (; oob_req->iter < oob_req->n_iters; oob_req->iter++) {
+    st = torch_ucx_req_test(oob_req->oob_ctx, oob_req->reqs, 2, NULL, 1, 2);
+    if (st == TORCH_UCX_INPROGRESS) {
+      return XCCL_INPROGRESS;
+    }
+    oob_allgather_post(oob_req);
   }
 
-  st = torch_ucx_req_test(oob_ctx, oob_req->reqs, 2, NULL, 1, 2);
+  st = torch_ucx_req_test(oob_req->oob_ctx, oob_req->reqs, 2, NULL, 1, 2);
   if (st == TORCH_UCX_INPROGRESS) {
     return XCCL_INPROGRESS;
   }
 
+  if ((oob_req->alg == TORCH_XCCL_OOB_ALG_BRUCK) &&
+      (oob_req->iter == oob_req->n_iters)) {
+    for (int i = 0; i < oob_req->size; i++) {
+      memcpy((char*)oob_req->rbuf +
+             (ptrdiff_t)(((oob_req->my_rank + i) % oob_req->size) * oob_req->msglen),
+             oob_req->scratch.data() + (ptrdiff_t)(i * oob_req->msglen),
+             oob_req->msglen);
+    }
+    oob_req->iter++;
+  }
+
   return XCCL_OK;
 }
 
@@ -85,14 +158,50 @@ static int oob_allgather(void *sbuf, void *rbuf, size_t msglen,
                          int my_rank, xccl_ep_range_t range,
                          void *oob_coll_ctx, void **req)
 {
-  xccl_oob_allgather_req_t *oob_req = new(xccl_oob_allgather_req_t);
+  torch_xccl_comm_t        *xccl_comm = static_cast<torch_xccl_comm_t*>(oob_coll_ctx);
+  xccl_oob_allgather_req_t *oob_req   = new(xccl_oob_allgather_req_t);
+  int                      size;
+
   oob_req->sbuf         = sbuf;
   oob_req->rbuf         = rbuf;
   oob_req->msglen       = msglen;
   oob_req->range        = range;
-  oob_req->oob_coll_ctx = oob_coll_ctx;
-  oob_req->my_rank      = my_rank;
+  oob_req->oob_ctx      = xccl_comm->p2p_comm;
   oob_req->iter         = 0;
+  oob_req->reqs[0]      = NULL;
+  oob_req->reqs[1]      = NULL;
+  if (range.type == XCCL_EP_RANGE_UNDEFINED) {
+    oob_req->size       = xccl_comm->p2p_comm->size;
+    oob_req->my_rank    = xccl_comm->p2p_comm->rank;
+  } else {
+    oob_req->size       = range.ep_num;
+    oob_req->my_rank    = my_rank;
+  }
+  size = oob_req->size;
+
+  oob_req->alg = xccl_comm->oob_alg;
+  if ((oob_req->alg == TORCH_XCCL_OOB_ALG_AUTO) ||
+      (oob_req->alg == TORCH_XCCL_OOB_ALG_RECURSIVE_DOUBLING)) {
+    oob_req->alg = ((size & (size - 1)) == 0) ?
+                   TORCH_XCCL_OOB_ALG_RECURSIVE_DOUBLING :
+                   TORCH_XCCL_OOB_ALG_BRUCK;
+  }
+
+  switch (oob_req->alg) {
+    case TORCH_XCCL_OOB_ALG_RECURSIVE_DOUBLING:
+      oob_req->n_iters = oob_log2_ceil(size);
+      memcpy((char*)rbuf + (ptrdiff_t)(oob_req->my_rank * msglen), sbuf, msglen);
+      break;
+    case TORCH_XCCL_OOB_ALG_BRUCK:
+      oob_req->n_iters = oob_log2_ceil(size);
+      oob_req->scratch.resize(size * msglen);
+      memcpy(oob_req->scratch.data(), sbuf, msglen);
+      break;
+    default:
+      oob_req->n_iters = size - 1;
+      memcpy((char*)rbuf + (ptrdiff_t)(oob_req->my_rank * msglen), sbuf, msglen);
+      break;
+  }
   *req = oob_req;
 
   return oob_allgather_test(oob_req);
@@ -107,6 +216,8 @@ torch_ucx_status_t torch_xccl_comm_init(torch_ucx_comm_t *p2p_comm,
     xccl_status_t     st;
   
     xccl_comm = new torch_xccl_comm_t;
+    xccl_comm->p2p_comm = p2p_comm;
+    torch_xccl_get_oob_alg(&xccl_comm->oob_alg);
     memset(&lib_params, 0, sizeof(lib_params));
     lib_params.field_mask = XCCL_LIB_PARAM_FIELD_TEAM_USAGE |
                             XCCL_LIB_PARAM_FIELD_COLL_TYPES;
@@ -149,7 +260,7 @@ torch_ucx_status_t torch_xccl_comm_init(torch_ucx_comm_t *p2p_comm,
     ctx_params.oob.allgather    = oob_allgather;
     ctx_params.oob.req_test     = oob_allgather_test;
     ctx_params.oob.req_free     = oob_allgather_free;
-    ctx_params.oob.coll_context = static_cast<void*>(p2p_comm);
+    ctx_params.oob.coll_context = static_cast<void*>(xccl_comm);
     ctx_params.oob.rank         = p2p_comm->rank;
     ctx_params.oob.size         = p2p_comm->size;
   
@@ -172,7 +283,7 @@ torch_ucx_status_t torch_xccl_comm_init(torch_ucx_comm_t *p2p_comm,
     team_params.oob.allgather        = oob_allgather;
     team_params.oob.req_test         = oob_allgather_test;
     team_params.oob.req_free         = oob_allgather_free;
-    team_params.oob.coll_context     = static_cast<void*>(p2p_comm);
+    team_params.oob.coll_context     = static_cast<void*>(xccl_comm);
     team_params.oob.rank             = p2p_comm->rank;
     team_params.oob.size             = p2p_comm->size;
   
@@ -11,11 +11,19 @@
 
 namespace c10d {
 
+enum torch_xccl_oob_alg_t {
+    TORCH_XCCL_OOB_ALG_AUTO,
+    TORCH_XCCL_OOB_ALG_RING,
+    TORCH_XCCL_OOB_ALG_RECURSIVE_DOUBLING,
+    TORCH_XCCL_OOB_ALG_BRUCK
+};
+
 struct torch_xccl_comm_t {
-    torch_ucx_comm_t *p2p_comm;
-    xccl_lib_h       xccl_lib;
-    xccl_context_h   xccl_ctx;
-    xccl_team_h      xccl_team;
+    torch_ucx_comm_t     *p2p_comm;
+    torch_xccl_oob_alg_t oob_alg;
+    xccl_lib_h           xccl_lib;
+    xccl_context_h       xccl_ctx;
+    xccl_team_h          xccl_team;
 };
 
 torch_ucx_status_t torch_xccl_comm_init(torch_ucx_comm_t *p2p_comm,